@@ -106,15 +106,87 @@ inline bool operator< (Address const &a, Address const &b)
                 && a.getNetworkAddressExtension () < b.getNetworkAddressExtension ();
 }
 
+inline bool operator== (Address const &a, Address const &b)
+{
+        return a.getRxId () == b.getRxId () && a.getTxId () == b.getTxId () && a.getSourceAddress () == b.getSourceAddress ()
+                && a.getTargetAddress () == b.getTargetAddress () && a.getNetworkAddressExtension () == b.getNetworkAddressExtension ()
+                && a.getMessageType () == b.getMessageType () && a.getTargetAddressType () == b.getTargetAddressType ();
+}
+
+inline bool operator!= (Address const &a, Address const &b) { return !(a == b); }
+
+/**
+ * Hash of a session key (see Key in the address encoders).
+ */
+struct KeyHash {
+        uint32_t operator() (uint32_t k) const
+        {
+                // Finalizer from murmur3, so neighbouring ids land in different buckets.
+                k ^= k >> 16;
+                k *= 0x85ebca6b;
+                k ^= k >> 13;
+                k *= 0xc2b2ae35;
+                k ^= k >> 16;
+                return k;
+        }
+
+        uint32_t operator() (uint64_t k) const { return (*this) (uint32_t (k) ^ uint32_t (k >> 32)); }
+};
+
+/**
+ * CAN id acceptance filter : frames for which (id & mask) == (this->id & mask) pass. Can
+ * be turned into the CAN_RAW_FILTER of a SocketCAN socket, or programmed into a CAN
+ * controller.
+ */
+struct IdFilter {
+        uint32_t id{};
+        uint32_t mask{};
+        bool extended{};
+
+        bool accepts (uint32_t frameId, bool frameExtended) const { return frameExtended == extended && (frameId & mask) == (id & mask); }
+        bool operator== (IdFilter const &o) const { return id == o.id && mask == o.mask && extended == o.extended; }
+        bool operator!= (IdFilter const &o) const { return !(*this == o); }
+};
+
+/*
+ * Every address encoder below provides (apart from fromFrame and toFrame) a compact
+ * representation of an address decoded from a frame called Key. It's an integer holding
+ * only the bits the encoder actually reads from the frame (the id and, for some, the first
+ * data byte), so received frames are matched and looked up by comparing one integer :
+ *
+ * - keyFromFrame (frame) returns the key, or nothing if the frame can't be decoded.
+ * - fromKey (key) returns the same address as fromFrame would.
+ * - localKey (ours) is what (key & LOCAL_KEY_MASK) equals for frames sent to us (matches).
+ * - peerKey (peer) is what (key & PEER_KEY_MASK) equals for frames sent back by the peer we
+ *   are transmitting to (matchesPeer).
+ * - localFilter (ours) is an IdFilter passing all the frames which match ours. This includes
+ *   flow control frames of messages sent to ours (the default destination of send). It checks
+ *   only the CAN id, so it may pass more.
+ */
+
 /****************************************************************************/
 
 struct Normal11AddressEncoder {
 
+        /// CAN id.
+        using Key = uint32_t;
+        static constexpr Key LOCAL_KEY_MASK = ~Key{};
+        static constexpr Key PEER_KEY_MASK = ~Key{};
+
         /**
          * Create an address from a received CAN frame. This is
          * the address which the remote party used to send the frame to us.
          */
         template <typename CanFrameWrapper> static etl::optional<Address> fromFrame (CanFrameWrapper const &f)
+        {
+                if (auto k = keyFromFrame (f)) {
+                        return fromKey (*k);
+                }
+
+                return {};
+        }
+
+        template <typename CanFrameWrapper> static etl::optional<Key> keyFromFrame (CanFrameWrapper const &f)
         {
                 auto fId = f.getId ();
 
@@ -122,9 +194,13 @@ struct Normal11AddressEncoder {
                         return {};
                 }
 
-                return Address (0x00, fId);
+                return Key (fId);
         }
 
+        static Address fromKey (Key k) { return Address (0x00, k); }
+        static Key localKey (Address const &ours) { return ours.getRxId (); }
+        static Key peerKey (Address const &peer) { return peer.getRxId (); }
+
         /**
          * Store address into a CAN frame. This is the address of the remote party we want the message to get to.
          */
@@ -139,28 +215,52 @@ struct Normal11AddressEncoder {
                 return true;
         }
 
+        static IdFilter localFilter (Address const &ours) { return {ours.getRxId (), MAX_11_ID, false}; }
+
         /// Implements address matching for this type of addressing.
         static bool matches (Address const &theirs, Address const &ours) { return theirs.getTxId () == ours.getRxId (); }
+
+        /// Checks if a frame sent by theirs is a reply from the peer we are transmitting to using the peer address.
+        static bool matchesPeer (Address const &theirs, Address const &peer) { return matches (theirs, peer); }
 };
 
 /****************************************************************************/
 
 struct Normal29AddressEncoder {
 
+        /// CAN id.
+        using Key = uint32_t;
+        static constexpr Key LOCAL_KEY_MASK = ~Key{};
+        static constexpr Key PEER_KEY_MASK = ~Key{};
+
         /**
          * Create an address from a received CAN frame. This is
          * the address which the remote party used to send the frame to us.
          */
         template <typename CanFrameWrapper> static etl::optional<Address> fromFrame (CanFrameWrapper const &f)
+        {
+                if (auto k = keyFromFrame (f)) {
+                        return fromKey (*k);
+                }
+
+                return {};
+        }
+
+        template <typename CanFrameWrapper> static etl::optional<Key> keyFromFrame (CanFrameWrapper const &f)
         {
                 auto fId = f.getId ();
 
                 if (!f.isExtended () || fId > MAX_29_ID) {
                         return {};
                 }
-                return Address (0x00, fId);
+
+                return Key (fId);
         }
 
+        static Address fromKey (Key k) { return Address (0x00, k); }
+        static Key localKey (Address const &ours) { return ours.getRxId (); }
+        static Key peerKey (Address const &peer) { return peer.getRxId (); }
+
         /**
          * Store address into a CAN frame. This is the address of the remote party we want the message to get to.
          */
@@ -175,8 +275,13 @@ struct Normal29AddressEncoder {
                 return true;
         }
 
+        static IdFilter localFilter (Address const &ours) { return {ours.getRxId (), MAX_29_ID, true}; }
+
         /// Implements address matching for this type of addressing.
         static bool matches (Address const &theirs, Address const &ours) { return theirs.getTxId () == ours.getRxId (); }
+
+        /// Checks if a frame sent by theirs is a reply from the peer we are transmitting to using the peer address.
+        static bool matchesPeer (Address const &theirs, Address const &peer) { return matches (theirs, peer); }
 };
 
 /****************************************************************************/
@@ -190,11 +295,25 @@ struct NormalFixed29AddressEncoder {
         static constexpr uint32_t N_SA_MASK = 0x0000000ff;
         static constexpr uint32_t MAX_N = 0xff; /// Maximum value that can be stored in either N_TA, N_SA.
 
+        /// Lower 17 bits of the CAN id : N_TAtype, N_TA and N_SA.
+        using Key = uint32_t;
+        static constexpr Key LOCAL_KEY_MASK = N_TA_MASK;
+        static constexpr Key PEER_KEY_MASK = N_TA_MASK | N_SA_MASK;
+
         /**
          * Create an address from a received CAN frame. This is
          * the address which the remote party used to send the frame to us.
          */
         template <typename CanFrameWrapper> static etl::optional<Address> fromFrame (CanFrameWrapper const &f)
+        {
+                if (auto k = keyFromFrame (f)) {
+                        return fromKey (*k);
+                }
+
+                return {};
+        }
+
+        template <typename CanFrameWrapper> static etl::optional<Key> keyFromFrame (CanFrameWrapper const &f)
         {
                 auto fId = f.getId ();
 
@@ -202,11 +321,18 @@ struct NormalFixed29AddressEncoder {
                         return {};
                 }
 
-                return Address (0x00, 0x00, fId & N_SA_MASK, (fId & N_TA_MASK) >> 8, Address::MessageType::DIAGNOSTICS,
-                                (bool (fId & N_TATYPE_MASK)) ? (Address::TargetAddressType::FUNCTIONAL)
-                                                             : (Address::TargetAddressType::PHYSICAL));
+                return Key (fId & (N_TATYPE_MASK | N_TA_MASK | N_SA_MASK));
+        }
+
+        static Address fromKey (Key k)
+        {
+                return Address (0x00, 0x00, k & N_SA_MASK, (k & N_TA_MASK) >> 8, Address::MessageType::DIAGNOSTICS,
+                                (bool (k & N_TATYPE_MASK)) ? (Address::TargetAddressType::FUNCTIONAL) : (Address::TargetAddressType::PHYSICAL));
         }
 
+        static Key localKey (Address const &ours) { return Key (ours.getSourceAddress ()) << 8; }
+        static Key peerKey (Address const &peer) { return Key (peer.getSourceAddress ()) << 8 | peer.getTargetAddress (); }
+
         /**
          * Store address into a CAN frame. This is the address of the remote party we want the message to get to.
          */
@@ -220,8 +346,23 @@ struct NormalFixed29AddressEncoder {
                 return true;
         }
 
+        /// Both N_TAtypes.
+        static IdFilter localFilter (Address const &ours)
+        {
+                return {NORMAL_FIXED_29 | Key (ours.getSourceAddress ()) << 8, NORMAL_FIXED_29_MASK | N_TA_MASK, true};
+        }
+
         /// Implements address matching for this type of addressing.
         static bool matches (Address const &theirs, Address const &ours) { return theirs.getTargetAddress () == ours.getSourceAddress (); }
+
+        /// Checks if a frame sent by theirs is a reply from the peer we are transmitting to using the peer address.
+        static bool matchesPeer (Address const &theirs, Address const &peer)
+        {
+                return matches (theirs, peer) && theirs.getSourceAddress () == peer.getTargetAddress ();
+        }
+
+        /// Peers sending to us differ only in N_SA. Used by DirectSessionIndex.
+        static uint8_t directIndex (Key theirs) { return theirs & N_SA_MASK; }
 };
 
 /****************************************************************************/
@@ -230,7 +371,21 @@ struct Extended11AddressEncoder {
 
         static constexpr uint32_t MAX_TA = 0xff;
 
+        /// CAN id << 8 | N_TA.
+        using Key = uint32_t;
+        static constexpr Key LOCAL_KEY_MASK = ~Key{};
+        static constexpr Key PEER_KEY_MASK = ~Key{};
+
         template <typename CanFrameWrapper> static etl::optional<Address> fromFrame (CanFrameWrapper const &f)
+        {
+                if (auto k = keyFromFrame (f)) {
+                        return fromKey (*k);
+                }
+
+                return {};
+        }
+
+        template <typename CanFrameWrapper> static etl::optional<Key> keyFromFrame (CanFrameWrapper const &f)
         {
                 auto fId = f.getId ();
 
@@ -238,9 +393,13 @@ struct Extended11AddressEncoder {
                         return {};
                 }
 
-                return Address (0x00, fId, 0x00, f.get (0));
+                return Key (fId) << 8 | f.get (0);
         }
 
+        static Address fromKey (Key k) { return Address (0x00, k >> 8, 0x00, k & MAX_TA); }
+        static Key localKey (Address const &ours) { return Key (ours.getRxId ()) << 8 | ours.getSourceAddress (); }
+        static Key peerKey (Address const &peer) { return localKey (peer); }
+
         template <typename CanFrameWrapper> static bool toFrame (Address const &a, CanFrameWrapper &f)
         {
                 if (a.getTxId () > MAX_11_ID) {
@@ -258,11 +417,17 @@ struct Extended11AddressEncoder {
                 return true;
         }
 
+        /// N_TA (first data byte) is not checked.
+        static IdFilter localFilter (Address const &ours) { return {ours.getRxId (), MAX_11_ID, false}; }
+
         /// Implements address matching for this type of addressing.
         static bool matches (Address const &theirs, Address const &ours)
         {
                 return theirs.getTxId () == ours.getRxId () && theirs.getTargetAddress () == ours.getSourceAddress ();
         }
+
+        /// Checks if a frame sent by theirs is a reply from the peer we are transmitting to using the peer address.
+        static bool matchesPeer (Address const &theirs, Address const &peer) { return matches (theirs, peer); }
 };
 
 /****************************************************************************/
@@ -271,7 +436,21 @@ struct Extended29AddressEncoder {
 
         static constexpr uint32_t MAX_TA = 0xff;
 
+        /// CAN id << 8 | N_TA. Does not fit in 32 bits.
+        using Key = uint64_t;
+        static constexpr Key LOCAL_KEY_MASK = ~Key{};
+        static constexpr Key PEER_KEY_MASK = ~Key{};
+
         template <typename CanFrameWrapper> static etl::optional<Address> fromFrame (CanFrameWrapper const &f)
+        {
+                if (auto k = keyFromFrame (f)) {
+                        return fromKey (*k);
+                }
+
+                return {};
+        }
+
+        template <typename CanFrameWrapper> static etl::optional<Key> keyFromFrame (CanFrameWrapper const &f)
         {
                 auto fId = f.getId ();
 
@@ -279,9 +458,13 @@ struct Extended29AddressEncoder {
                         return {};
                 }
 
-                return Address (0x00, fId, 0x00, f.get (0));
+                return Key (fId) << 8 | f.get (0);
         }
 
+        static Address fromKey (Key k) { return Address (0x00, uint32_t (k >> 8), 0x00, uint8_t (k & MAX_TA)); }
+        static Key localKey (Address const &ours) { return Key (ours.getRxId ()) << 8 | ours.getSourceAddress (); }
+        static Key peerKey (Address const &peer) { return localKey (peer); }
+
         template <typename CanFrameWrapper> static bool toFrame (Address const &a, CanFrameWrapper &f)
         {
                 if (a.getTxId () > MAX_29_ID) {
@@ -299,30 +482,61 @@ struct Extended29AddressEncoder {
                 return true;
         }
 
+        /// N_TA (first data byte) is not checked.
+        static IdFilter localFilter (Address const &ours) { return {ours.getRxId (), MAX_29_ID, true}; }
+
         /// Implements address matching for this type of addressing.
         static bool matches (Address const &theirs, Address const &ours)
         {
                 return theirs.getTxId () == ours.getRxId () && theirs.getTargetAddress () == ours.getSourceAddress ();
         }
+
+        /// Checks if a frame sent by theirs is a reply from the peer we are transmitting to using the peer address.
+        static bool matchesPeer (Address const &theirs, Address const &peer) { return matches (theirs, peer); }
 };
 
 /****************************************************************************/
 
 struct Mixed11AddressEncoder {
 
+        static constexpr uint32_t MAX_AE = 0xff;
+
+        /// CAN id << 8 | N_AE.
+        using Key = uint32_t;
+        static constexpr Key LOCAL_KEY_MASK = ~Key{};
+        static constexpr Key PEER_KEY_MASK = ~Key{};
+
         /**
          * Create an address from a received CAN frame. This is
          * the address which the remote party used to send the frame to us.
          */
         template <typename CanFrameWrapper> static etl::optional<Address> fromFrame (CanFrameWrapper const &f)
+        {
+                if (auto k = keyFromFrame (f)) {
+                        return fromKey (*k);
+                }
+
+                return {};
+        }
+
+        template <typename CanFrameWrapper> static etl::optional<Key> keyFromFrame (CanFrameWrapper const &f)
         {
                 if (f.isExtended () || f.getDlc () < 1 || f.getId () > MAX_11_ID) {
                         return {};
                 }
 
-                return Address (0x00, f.getId (), 0x00, 0x00, f.get (0), Address::MessageType::REMOTE_DIAGNOSTICS);
+                return Key (f.getId ()) << 8 | f.get (0);
+        }
+
+        static Address fromKey (Key k) { return Address (0x00, k >> 8, 0x00, 0x00, k & MAX_AE, Address::MessageType::REMOTE_DIAGNOSTICS); }
+
+        static Key localKey (Address const &ours)
+        {
+                return Key (ours.getRxId ()) << 8 | ours.getNetworkAddressExtension ();
         }
 
+        static Key peerKey (Address const &peer) { return localKey (peer); }
+
         /**
          * Store address into a CAN frame. This is the address of the remote party we want the message to get to.
          */
@@ -346,11 +560,17 @@ struct Mixed11AddressEncoder {
                 return true;
         }
 
+        /// N_AE (first data byte) is not checked.
+        static IdFilter localFilter (Address const &ours) { return {ours.getRxId (), MAX_11_ID, false}; }
+
         /// Implements address matching for this type of addressing.
         static bool matches (Address const &theirs, Address const &ours)
         {
                 return theirs.getTxId () == ours.getRxId () && theirs.getNetworkAddressExtension () == ours.getNetworkAddressExtension ();
         }
+
+        /// Checks if a frame sent by theirs is a reply from the peer we are transmitting to using the peer address.
+        static bool matchesPeer (Address const &theirs, Address const &peer) { return matches (theirs, peer); }
 };
 
 /****************************************************************************/
@@ -363,11 +583,27 @@ struct Mixed29AddressEncoder {
         static constexpr uint32_t N_TA_MASK = 0x00000ff00;
         static constexpr uint32_t N_SA_MASK = 0x0000000ff;
 
+        /// N_SA, N_TA, N_TAtype (bit 16, set for functional) and N_AE (bits 24-31).
+        using Key = uint32_t;
+        static constexpr Key KEY_FUNCTIONAL = 0x10000;
+        static constexpr Key KEY_AE_MASK = 0xff000000;
+        static constexpr Key LOCAL_KEY_MASK = N_TA_MASK | KEY_AE_MASK;
+        static constexpr Key PEER_KEY_MASK = N_TA_MASK | N_SA_MASK | KEY_AE_MASK;
+
         /**
          * Create an address from a received CAN frame. This is
          * the address which the remote party used to send the frame to us.
          */
         template <typename CanFrameWrapper> static etl::optional<Address> fromFrame (CanFrameWrapper const &f)
+        {
+                if (auto k = keyFromFrame (f)) {
+                        return fromKey (*k);
+                }
+
+                return {};
+        }
+
+        template <typename CanFrameWrapper> static etl::optional<Key> keyFromFrame (CanFrameWrapper const &f)
         {
                 auto fId = f.getId ();
 
@@ -375,19 +611,32 @@ struct Mixed29AddressEncoder {
                         return {};
                 }
 
+                Key k = (fId & (N_TA_MASK | N_SA_MASK)) | Key (f.get (0)) << 24;
+
                 if (bool ((fId & PHYS_FUNC_29_MASK) == PHYS_29)) {
-                        return Address (0x00, 0x00, fId & N_SA_MASK, (fId & N_TA_MASK) >> 8, f.get (0), Address::MessageType::REMOTE_DIAGNOSTICS,
-                                        Address::TargetAddressType::PHYSICAL);
+                        return k;
                 }
 
                 if (bool ((fId & PHYS_FUNC_29_MASK) == FUNC_29)) {
-                        return Address (0x00, 0x00, fId & N_SA_MASK, (fId & N_TA_MASK) >> 8, f.get (0), Address::MessageType::REMOTE_DIAGNOSTICS,
-                                        Address::TargetAddressType::FUNCTIONAL);
+                        return k | KEY_FUNCTIONAL;
                 }
 
                 return {};
         }
 
+        static Address fromKey (Key k)
+        {
+                return Address (0x00, 0x00, k & N_SA_MASK, (k & N_TA_MASK) >> 8, k >> 24, Address::MessageType::REMOTE_DIAGNOSTICS,
+                                (bool (k & KEY_FUNCTIONAL)) ? (Address::TargetAddressType::FUNCTIONAL) : (Address::TargetAddressType::PHYSICAL));
+        }
+
+        static Key localKey (Address const &ours)
+        {
+                return Key (ours.getSourceAddress ()) << 8 | Key (ours.getNetworkAddressExtension ()) << 24;
+        }
+
+        static Key peerKey (Address const &peer) { return localKey (peer) | peer.getTargetAddress (); }
+
         /**
          * Store address into a CAN frame. This is the address of the remote party we want the message to get to.
          */
@@ -409,12 +658,27 @@ struct Mixed29AddressEncoder {
                 return true;
         }
 
+        /// Both N_TAtypes (0x18CE and 0x18CD, and thus 0x18CC and 0x18CF as well). N_AE is not checked.
+        static IdFilter localFilter (Address const &ours)
+        {
+                return {(PHYS_29 & FUNC_29) | Key (ours.getSourceAddress ()) << 8, (PHYS_FUNC_29_MASK & ~(PHYS_29 ^ FUNC_29)) | N_TA_MASK, true};
+        }
+
         /// Implements address matching for this type of addressing.
         static bool matches (Address const &theirs, Address const &ours)
         {
                 return theirs.getTargetAddress () == ours.getSourceAddress ()
                         && theirs.getNetworkAddressExtension () == ours.getNetworkAddressExtension ();
         }
+
+        /// Checks if a frame sent by theirs is a reply from the peer we are transmitting to using the peer address.
+        static bool matchesPeer (Address const &theirs, Address const &peer)
+        {
+                return matches (theirs, peer) && theirs.getSourceAddress () == peer.getTargetAddress ();
+        }
+
+        /// Peers sending to us differ only in N_SA. Used by DirectSessionIndex.
+        static uint8_t directIndex (Key theirs) { return theirs & N_SA_MASK; }
 };
 
 /**
@@ -434,8 +698,48 @@ template <typename T> struct AddressTraitsBase {
         {
                 return ((getNPciByte (f) & 0x0f) << 8) | f.get (N_PCI_OFSET + 1);
         }
+
+        /// 32 bit FF_DL which follows the FF_DL escape sequence (12 bit FF_DL equal to 0), ISO 15765-2:2016.
+        template <typename CFWrapper> static uint32_t getDataLengthF32 (CFWrapper const &f)
+        {
+                return (uint32_t (f.get (N_PCI_OFSET + 2)) << 24) | (uint32_t (f.get (N_PCI_OFSET + 3)) << 16)
+                        | (uint32_t (f.get (N_PCI_OFSET + 4)) << 8) | f.get (N_PCI_OFSET + 5);
+        }
         template <typename CFWrapper> static uint8_t getSerialNumber (CFWrapper const &f) { return getNPciByte (f) & 0x0f; }
         template <typename CFWrapper> static FlowStatus getFlowStatus (CFWrapper const &f) { return FlowStatus (getNPciByte (f) & 0x0f); }
+        template <typename CFWrapper> static uint8_t getBlockSize (CFWrapper const &f) { return f.get (N_PCI_OFSET + 1); }
+        template <typename CFWrapper> static uint8_t getSeparationTime (CFWrapper const &f) { return f.get (N_PCI_OFSET + 2); }
+
+        /*---------------------------------------------------------------------------*/
+
+        /*
+         * Frame geometry : how many payload bytes fit in frames dl bytes long (8 for classic CAN,
+         * up to 64 for CAN FD), and where they start. Geometry has them as constants.
+         */
+
+        /// Longest Single Frame payload with the 4 bit SF_DL.
+        static constexpr size_t SHORT_SINGLE_FRAME_MAX_SIZE = 7 - N_PCI_OFSET;
+
+        /// Longest Single Frame payload. CAN FD frames longer than 8 bytes can have the SF_DL in the second byte.
+        static constexpr size_t singleFrameMaxSize (size_t dl) { return (dl > 8) ? (dl - 2 - N_PCI_OFSET) : (SHORT_SINGLE_FRAME_MAX_SIZE); }
+
+        /// Where the payload of a First Frame starts. escaped means the 32 bit FF_DL.
+        static constexpr size_t firstFrameDataOffset (bool escaped) { return N_PCI_OFSET + ((escaped) ? (6) : (2)); }
+        static constexpr size_t firstFrameMaxSize (size_t dl, bool escaped = false) { return dl - firstFrameDataOffset (escaped); }
+
+        static constexpr size_t CONSECUTIVE_FRAME_DATA_OFFSET = N_PCI_OFSET + 1;
+        static constexpr size_t consecutiveFrameMaxSize (size_t dl) { return dl - CONSECUTIVE_FRAME_DATA_OFFSET; }
+
+        static constexpr size_t FLOW_CONTROL_FRAME_SIZE = N_PCI_OFSET + 3;
+
+        /// The sizes above for frames DL bytes long.
+        template <size_t DL> struct Geometry {
+                static_assert (DL >= 8, "Frames shorter than 8 bytes are not supported.");
+                static constexpr size_t SINGLE_FRAME_MAX_SIZE = singleFrameMaxSize (DL);
+                static constexpr size_t FIRST_FRAME_MAX_SIZE = firstFrameMaxSize (DL);
+                static constexpr size_t ESCAPED_FIRST_FRAME_MAX_SIZE = firstFrameMaxSize (DL, true);
+                static constexpr size_t CONSECUTIVE_FRAME_MAX_SIZE = consecutiveFrameMaxSize (DL);
+        };
 };
 
 template <typename AddressEncoder> struct AddressTraits : public AddressTraitsBase<AddressTraits<AddressEncoder>> {
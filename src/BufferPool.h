@@ -0,0 +1,343 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#pragma once
+#include "CppCompat.h"
+
+namespace tp {
+
+/// BLOCKS_N blocks of BLOCK_SIZE_N bytes each. See BufferPool.
+template <size_t BLOCK_SIZE_N, size_t BLOCKS_N> struct BufferClass {
+        static constexpr size_t BLOCK_SIZE = BLOCK_SIZE_N;
+        static constexpr size_t BLOCKS = BLOCKS_N;
+        static_assert (BLOCK_SIZE_N > 0 && BLOCKS_N > 0 && BLOCKS_N < 0xffff, "Wrong buffer class.");
+};
+
+namespace detail {
+
+/// One BufferClass, and the rest of them (which have bigger blocks) as the base class.
+template <typename... BufferClassT> class BufferClassChain {
+public:
+        uint8_t *allocate (size_t /* len */, size_t & /* capacity */) { return nullptr; }
+        bool deallocate (uint8_t * /* p */) { return false; }
+        size_t freeBlocks () const { return 0; }
+        static constexpr size_t totalBytes () { return 0; }
+        static constexpr size_t smallestBlock () { return size_t (-1); }
+};
+
+template <typename ClassT, typename... RestT> class BufferClassChain<ClassT, RestT...> : public BufferClassChain<RestT...> {
+public:
+        using Base = BufferClassChain<RestT...>;
+        using BlockIndex = uint16_t;
+        static_assert (ClassT::BLOCK_SIZE < Base::smallestBlock (), "Buffer classes have to be sorted by the block size.");
+
+        BufferClassChain ()
+        {
+                for (size_t i = ClassT::BLOCKS; i > 0; --i) {
+                        freeList.push_back (BlockIndex (i - 1));
+                }
+        }
+
+        /// The smallest free block which can hold len bytes. If this class is exhausted, a bigger one is tried.
+        uint8_t *allocate (size_t len, size_t &capacity)
+        {
+                if (len > ClassT::BLOCK_SIZE || freeList.empty ()) {
+                        return Base::allocate (len, capacity);
+                }
+
+                BlockIndex i = freeList.back ();
+                freeList.pop_back ();
+                capacity = ClassT::BLOCK_SIZE;
+                return &storage[i][0];
+        }
+
+        /// Returns false if p was not allocated from this pool.
+        bool deallocate (uint8_t *p)
+        {
+                if (p < &storage[0][0] || p >= &storage[0][0] + sizeof (storage)) {
+                        return Base::deallocate (p);
+                }
+
+                freeList.push_back (BlockIndex ((p - &storage[0][0]) / ClassT::BLOCK_SIZE));
+                return true;
+        }
+
+        size_t freeBlocks () const { return freeList.size () + Base::freeBlocks (); }
+        static constexpr size_t totalBytes () { return ClassT::BLOCK_SIZE * ClassT::BLOCKS + Base::totalBytes (); }
+        static constexpr size_t smallestBlock () { return ClassT::BLOCK_SIZE; }
+
+private:
+        uint8_t storage[ClassT::BLOCKS][ClassT::BLOCK_SIZE]{};
+        etl::vector<BlockIndex, ClassT::BLOCKS> freeList;
+};
+
+} // namespace detail
+
+/**
+ * Fixed amount of memory for ISO messages, divided into size classes, like :
+ *
+ *      using Pool = BufferPool<BufferClass<64, 32>, BufferClass<512, 8>, BufferClass<4095, 2>>;
+ *
+ * Classes have to be sorted by the block size. A buffer gets the smallest free block
+ * which fits, so short messages don't occupy the memory meant for long ones, and the
+ * total memory is known at compile time (totalBytes). No heap is used.
+ */
+template <typename... BufferClassT> class BufferPool : private detail::BufferClassChain<BufferClassT...> {
+public:
+        using Chain = detail::BufferClassChain<BufferClassT...>;
+
+        /// Borrows a block of at least len bytes, and sets capacity to its size. Returns nullptr if there's no free block big enough.
+        uint8_t *allocate (size_t len, size_t &capacity) { return Chain::allocate (len, capacity); }
+
+        /// Returns the block to the pool.
+        void deallocate (uint8_t *p)
+        {
+                [[maybe_unused]] bool found = Chain::deallocate (p);
+                Expects (found);
+        }
+
+        /// Number of blocks not borrowed, in all the classes.
+        size_t freeBlocks () const { return Chain::freeBlocks (); }
+
+        static constexpr size_t totalBytes () { return Chain::totalBytes (); }
+};
+
+/**
+ * Byte container with std::vector like interface (as much as this library uses) which
+ * stores its contents in a block borrowed from the pool passed to the constructor (or
+ * setPool). It can be used as the IsoMessage, so receive sessions, the transmit state
+ * machines and the queue borrow memory only for as long as they use it. Unlike std::vector,
+ * clear () returns the block to the pool. If the pool has no block big enough (or the
+ * message has no pool), reserve does nothing and inserts are ignored, so check capacity ()
+ * after reserve. Pools are not thread safe : the messages of a pool have to be modified
+ * and destroyed by one thread at a time.
+ */
+template <typename PoolT> class PooledIsoMessage {
+public:
+        using Pool = PoolT;
+        using value_type = uint8_t;
+        using size_type = size_t;
+        using reference = uint8_t &;
+        using const_reference = uint8_t const &;
+        using iterator = uint8_t *;
+        using const_iterator = uint8_t const *;
+
+        PooledIsoMessage () = default;
+        explicit PooledIsoMessage (PoolT &p) : pool (&p) {}
+
+        template <typename It> PooledIsoMessage (PoolT &p, It first, It last) : pool (&p) { insert (end (), first, last); }
+
+        /// The copy borrows from the same pool.
+        PooledIsoMessage (PooledIsoMessage const &other) : pool (other.pool) { insert (end (), other.begin (), other.end ()); }
+
+        PooledIsoMessage (PooledIsoMessage &&other) noexcept : pool (other.pool), buffer (other.buffer), len (other.len), cap (other.cap)
+        {
+                other.buffer = nullptr;
+                other.len = other.cap = 0;
+        }
+
+        /// Keeps the pool, unless this message has none.
+        PooledIsoMessage &operator= (PooledIsoMessage const &other)
+        {
+                if (this != &other) {
+                        if (pool == nullptr) {
+                                pool = other.pool;
+                        }
+
+                        len = 0;
+                        insert (end (), other.begin (), other.end ());
+                }
+
+                return *this;
+        }
+
+        /// The block is taken over, so the pool it belongs to is as well.
+        PooledIsoMessage &operator= (PooledIsoMessage &&other) noexcept
+        {
+                if (this != &other) {
+                        clear ();
+                        pool = other.pool;
+                        buffer = other.buffer;
+                        len = other.len;
+                        cap = other.cap;
+                        other.buffer = nullptr;
+                        other.len = other.cap = 0;
+                }
+
+                return *this;
+        }
+
+        ~PooledIsoMessage () { clear (); }
+
+        /// Sets the pool further blocks are borrowed from. The contents are dropped if it's a different one.
+        void setPool (PoolT &p)
+        {
+                if (pool != &p) {
+                        clear ();
+                        pool = &p;
+                }
+        }
+
+        PoolT *getPool () const { return pool; }
+
+        size_t size () const { return len; }
+        size_t capacity () const { return cap; }
+        bool empty () const { return len == 0; }
+
+        uint8_t *data () { return buffer; }
+        uint8_t const *data () const { return buffer; }
+
+        iterator begin () { return buffer; }
+        iterator end () { return buffer + len; }
+        const_iterator begin () const { return buffer; }
+        const_iterator end () const { return buffer + len; }
+
+        uint8_t &operator[] (size_t i) { return buffer[i]; }
+        uint8_t const &operator[] (size_t i) const { return buffer[i]; }
+
+        uint8_t &at (size_t i)
+        {
+                Expects (i < len);
+                return buffer[i];
+        }
+
+        uint8_t const &at (size_t i) const
+        {
+                Expects (i < len);
+                return buffer[i];
+        }
+
+        /// Moves the contents to a block of at least n bytes. Check capacity () afterwards.
+        void reserve (size_t n)
+        {
+                if (n <= cap || pool == nullptr) {
+                        return;
+                }
+
+                size_t newCap{};
+                uint8_t *newBuffer = pool->allocate (n, newCap);
+
+                if (newBuffer == nullptr) {
+                        return;
+                }
+
+                for (size_t i = 0; i < len; ++i) {
+                        newBuffer[i] = buffer[i];
+                }
+
+                if (buffer != nullptr) {
+                        pool->deallocate (buffer);
+                }
+
+                buffer = newBuffer;
+                cap = newCap;
+        }
+
+        /// Returns the block to the pool.
+        void clear ()
+        {
+                if (buffer != nullptr) {
+                        pool->deallocate (buffer);
+                }
+
+                buffer = nullptr;
+                len = cap = 0;
+        }
+
+        void push_back (uint8_t b) { insert (end (), b); }
+
+        iterator insert (const_iterator pos, uint8_t b)
+        {
+                uint8_t const *first = &b;
+                return insert (pos, first, first + 1);
+        }
+
+        template <typename It> iterator insert (const_iterator pos, It first, It last)
+        {
+                size_t index = pos - begin ();
+                size_t n = 0;
+
+                for (It i = first; i != last; ++i) {
+                        ++n;
+                }
+
+                reserve (len + n);
+
+                if (len + n > cap) {
+                        return end ();
+                }
+
+                for (size_t i = len; i > index; --i) {
+                        buffer[i - 1 + n] = buffer[i - 1];
+                }
+
+                for (size_t i = index; first != last; ++first, ++i) {
+                        buffer[i] = *first;
+                }
+
+                len += n;
+                return buffer + index;
+        }
+
+        void resize (size_t n, uint8_t value = 0)
+        {
+                reserve (n);
+
+                if (n > cap) {
+                        return;
+                }
+
+                for (size_t i = len; i < n; ++i) {
+                        buffer[i] = value;
+                }
+
+                len = n;
+        }
+
+        bool operator== (PooledIsoMessage const &other) const
+        {
+                if (len != other.len) {
+                        return false;
+                }
+
+                for (size_t i = 0; i < len; ++i) {
+                        if (buffer[i] != other.buffer[i]) {
+                                return false;
+                        }
+                }
+
+                return true;
+        }
+
+        bool operator!= (PooledIsoMessage const &other) const { return !(*this == other); }
+
+private:
+        PoolT *pool{};
+        uint8_t *buffer{};
+        size_t len{};
+        size_t cap{};
+};
+
+/// Stands in for the pool of messages which don't use one. See MessageBufferPool.
+struct NoBufferPool {
+};
+
+/// Pool type of the IsoMessage if it's a PooledIsoMessage (or anything declaring Pool and setPool), NoBufferPool otherwise.
+template <typename T, typename = void> struct MessageBufferPool {
+        using type = NoBufferPool;
+        static constexpr bool value = false;
+};
+
+template <typename T>
+struct MessageBufferPool<T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().setPool (
+                                                                  std::declval<typename T::Pool &> ())))>::type> {
+        using type = typename T::Pool;
+        static constexpr bool value = true;
+};
+
+} // namespace tp
@@ -65,6 +65,9 @@ public:
         uint8_t get (size_t i) const { return gsl::at (frame.data, i); }
         void set (size_t i, uint8_t b) { gsl::at (frame.data, i) = b; }
 
+        /// Whole data field (8 bytes, regardless of the DLC). Optional : lets the protocol copy the payload at once instead of byte by byte.
+        uint8_t const *data () const { return frame.data.data (); }
+
 private:
         // TODO this should be some kind of handler if we want to call this class a "wrapper".
         // This way we would get rid of one copy during reception of a CAN frame.
@@ -73,4 +76,92 @@ private:
         CanFrame frame{};
 };
 
+/*****************************************************************************/
+
+/**
+ * CAN FD counterpart of the CanFrame (ISO 11898-1:2015), up to 64 data bytes. Unlike in
+ * the CanFrame, dlc is the data length in bytes (0-8, 12, 16, 20, 24, 32, 48 or 64), not
+ * the 4 bit code sent on the bus.
+ */
+struct CanFdFrame {
+
+        CanFdFrame () = default;
+
+        template <typename... T>
+        CanFdFrame (uint32_t id, bool extended, T... t) : id (id), extended (extended), data{uint8_t (t)...}, dlc (sizeof...(t))
+        {
+                Expects ((id & 0xE0000000) == 0);
+        }
+
+        uint32_t id;
+        bool extended;
+        etl::array<uint8_t, 64> data;
+        uint8_t dlc;
+};
+
+template <> class CanFrameWrapper<CanFdFrame> {
+public:
+        /// Frames this big are sent and received, which turns the CAN FD mode of the TransportProtocol on.
+        static constexpr size_t MAX_DATA_LENGTH = 64;
+
+        explicit CanFrameWrapper (CanFdFrame cf) : frame (std::move (cf)) {}
+        template <typename... T> CanFrameWrapper (uint32_t id, bool extended, T... data) : frame (id, extended, data...) {}
+        CanFrameWrapper () = default;
+
+        template <typename... T> static CanFdFrame create (uint32_t id, bool extended, T... data)
+        {
+                return CanFdFrame{id, extended, data...};
+        }
+
+        CanFdFrame const &value () const { return frame; }
+
+        uint32_t getId () const { return frame.id; }
+        void setId (uint32_t i) { frame.id = i; }
+
+        bool isExtended () const { return frame.extended; }
+        void setExtended (bool b) { frame.extended = b; }
+
+        /// Data length in bytes.
+        uint8_t getDlc () const { return frame.dlc; }
+        void setDlc (uint8_t d) { frame.dlc = d; }
+
+        uint8_t get (size_t i) const { return gsl::at (frame.data, i); }
+        void set (size_t i, uint8_t b) { gsl::at (frame.data, i) = b; }
+
+        uint8_t const *data () const { return frame.data.data (); }
+
+private:
+        CanFdFrame frame{};
+};
+
+/*****************************************************************************/
+
+/// Data field size of frames handled by CanFrameWrapperT : MAX_DATA_LENGTH if it declares one (CAN FD), 8 otherwise.
+template <typename CanFrameWrapperT, typename = void> struct FrameMaxDataLength {
+        static constexpr size_t value = 8;
+};
+
+template <typename CanFrameWrapperT>
+struct FrameMaxDataLength<CanFrameWrapperT, typename etl::enable_if<true, decltype ((void)(CanFrameWrapperT::MAX_DATA_LENGTH))>::type> {
+        static constexpr size_t value = CanFrameWrapperT::MAX_DATA_LENGTH;
+};
+
+/// The shortest valid CAN FD data length which can hold len bytes (ISO 11898-1:2015, table 5).
+constexpr size_t canFdLength (size_t len)
+{
+        if (len <= 8) {
+                return len;
+        }
+
+        if (len <= 24) {
+                return (len + 3) & ~size_t (3); // 12, 16, 20, 24
+        }
+
+        if (len <= 32) {
+                return 32;
+        }
+
+        return (len <= 48) ? (48) : (64);
+}
+
 } // namespace tp
@@ -9,8 +9,9 @@
 #pragma once
 
 #include <etl/array.h>
-#include <etl/map.h>
 #include <etl/optional.h>
+#include <etl/span.h>
+#include <etl/vector.h>
 
 /**
  * This file is for maintaining compatibility with systems where C++ standard library is
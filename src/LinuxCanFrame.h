@@ -62,10 +62,76 @@ public:
         uint8_t get (size_t i) const { return gsl::at (frame.data, i); }
         void set (size_t i, uint8_t b) { gsl::at (frame.data, i) = b; }
 
+        /// Whole data field (8 bytes, regardless of the DLC). Optional : lets the protocol copy the payload at once instead of byte by byte.
+        uint8_t const *data () const { return frame.data; }
+
 private:
         can_frame frame{};
 };
 
+/**
+ * Wrapper for the canfd_frame, which makes the TransportProtocol use the CAN FD frame
+ * format (see MAX_DATA_LENGTH). The socket has to have CAN_RAW_FD_FRAMES enabled, and
+ * frames are written with CANFD_MTU. The output interface can set CANFD_BRS in the
+ * flags for the bit rate switch.
+ */
+template <> class CanFrameWrapper<canfd_frame> {
+public:
+        static constexpr size_t MAX_DATA_LENGTH = CANFD_MAX_DLEN;
+
+        CanFrameWrapper () = default;
+        explicit CanFrameWrapper (canfd_frame const &cf) : frame (cf) {} /// Construct from underlying implementation type.
+
+        template <typename A, typename... B> void setData (int totalElements, A c1, B... cr)
+        {
+                static_assert (sizeof...(cr) <= CANFD_MAX_DLEN - 1);
+                set (totalElements - 1 - sizeof...(cr), c1);
+
+                if constexpr (sizeof...(cr) > 0) {
+                        setData (totalElements, cr...);
+                }
+        }
+
+        template <typename... T> CanFrameWrapper (uint32_t id, bool extended, T... data)
+        {
+                setId (id);
+                setExtended (extended);
+                setData (sizeof...(data), data...);
+                setDlc (sizeof...(data));
+        }
+
+        canfd_frame const &value () const { return frame; }
+
+        uint32_t getId () const { return (isExtended ()) ? (frame.can_id & CAN_EFF_MASK) : (frame.can_id & CAN_SFF_MASK); }
+        void setId (uint32_t i) { frame.can_id = i; }
+
+        bool isExtended () const { return bool (frame.can_id & CAN_EFF_FLAG); }
+        void setExtended (bool b)
+        {
+                if (b) {
+                        frame.can_id |= CAN_EFF_FLAG;
+                }
+                else {
+                        frame.can_id &= ~CAN_EFF_FLAG;
+                }
+        }
+
+        /// Data length in bytes (canfd_frame::len).
+        uint8_t getDlc () const { return frame.len; }
+        void setDlc (uint8_t d) { frame.len = d; }
+
+        uint8_t getFlags () const { return frame.flags; }
+        void setFlags (uint8_t f) { frame.flags = f; }
+
+        uint8_t get (size_t i) const { return gsl::at (frame.data, i); }
+        void set (size_t i, uint8_t b) { gsl::at (frame.data, i) = b; }
+
+        uint8_t const *data () const { return frame.data; }
+
+private:
+        canfd_frame frame{};
+};
+
 /**
  * This interface assumes that sending single CAN frame is instant and we
  * know the status (whether it failed or succeeded) instantly (thus boolean)
@@ -75,9 +141,12 @@ private:
  * that sending a CAN message should take not more as 1000ms + 50% i.e. 1500ms. If
  * this interface detects (internally) that, this time constraint wasn't met, it
  * also should return false. Those are N_As and N_Ar timeouts.
+ *
+ * Instead of bool, OutputResult can be returned : RETRY when the frame can't be taken
+ * right now (i.e. ENOBUFS), so segmented transmissions slow down instead of being aborted.
  */
 struct LinuxCanOutputInterface {
-        bool operator() (CanFrame const & /*unused*/) { return true; }
+        template <typename CanFrameT> bool operator() (CanFrameT const & /*unused*/) { return true; }
 };
 
 } // namespace tp
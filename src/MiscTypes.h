@@ -27,11 +27,30 @@ enum class Result {
         N_BUFFER_OVFLW, /// When receiving flow control with FlowStatus = OVFLW. Transmission is aborted.
         N_ERROR,        /// General error.
         // implementation defined result codes
-        N_MESSAGE_NUM_MAX /// Not a standard error. This one means that there is too many different isoMessages being assembled from multiple
-                          /// chunks of CAN frames now.
+        N_MESSAGE_NUM_MAX, /// Not a standard error. This one means that there is too many different isoMessages being assembled from multiple
+                           /// chunks of CAN frames now.
+        N_TX_DROPPED       /// Not a standard error. A message waiting in the transmit queue was dropped to make room for a newer one.
 
 };
 
+/**
+ * What an output interface can return instead of bool (true means SENT, false FAILED).
+ */
+enum class OutputResult {
+        SENT,   /// The frame was accepted.
+        RETRY,  /// Not accepted this time (i.e. the TX queue is full, ENOBUFS). Segmented transmissions try again for up to N_As.
+        FAILED, /// Not accepted, and trying again won't help. The transmission is aborted.
+};
+
+/**
+ * What a batched output interface (sendBatch, see TransportProtocol::setMaxBurst) can return
+ * instead of the number of frames accepted (which means the rest is to be retried).
+ */
+struct BatchOutputResult {
+        size_t accepted{};                       /// How many frames were accepted, counting from the first one.
+        OutputResult rest{OutputResult::RETRY}; /// What to do with the others : RETRY or FAILED.
+};
+
 /**
  * Status (mostly error) codes passed into the errorHandler.
  */
@@ -60,6 +79,27 @@ struct EmptyCallback {
         template <typename... T> void operator() (T... /* a */) {}
 };
 
+/**
+ * What to do when a segmented message can't be sent right away and the transmit queue
+ * is full.
+ */
+enum class TxQueuePolicy {
+        REJECT,      /// send returns false (the default).
+        DROP_OLDEST, /// The oldest waiting message is dropped (confirmed with N_TX_DROPPED) and the new one is queued.
+        BLOCK        /// send runs the caller's event loop (see setTxBlockHook) until there's room or the timeout expires.
+};
+
+/**
+ * Transmit queue statistics.
+ */
+struct TxQueueStatistics {
+        size_t depth{};      /// Number of messages waiting right now.
+        size_t maxDepth{};   /// The highest number of messages waiting at the same time.
+        uint32_t queued{};   /// Total number of messages which had to wait in the queue.
+        uint32_t dropped{};  /// Total number of messages dropped because of TxQueuePolicy::DROP_OLDEST.
+        uint32_t rejected{}; /// Total number of messages rejected because the queue was full.
+};
+
 /// NPDU -> Network Protocol Data Unit
 enum class IsoNPduType { SINGLE_FRAME = 0, FIRST_FRAME = 1, CONSECUTIVE_FRAME = 2, FLOW_FRAME = 3 };
 
@@ -0,0 +1,236 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#pragma once
+#include "CppCompat.h"
+
+namespace tp {
+
+/**
+ * Selects the data structure used to look up segmented messages being received
+ * (one lookup per CAN frame).
+ */
+enum class SessionIndexType {
+        HASH,  /// Open addressing hash table. Works with every address encoder.
+        DIRECT /// 256 entry table indexed by one byte of the address (N_SA). Only for encoders which provide directIndex.
+};
+
+/// Checks if T has a clear () method.
+template <typename T, typename = void> struct HasClear : public etl::false_type {
+};
+
+template <typename T>
+struct HasClear<T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().clear ()))>::type> : public etl::true_type {
+};
+
+/**
+ * Fixed pool of N sessions (i.e. messages being assembled). Sessions never move once
+ * allocated, the indexes below store only the slot numbers. Values which have a clear ()
+ * method are cleared when released instead of being replaced with ValueT{} on reuse, so
+ * they can keep (or give back, it's up to them) their resources between sessions.
+ */
+template <typename KeyT, typename ValueT, size_t N> class SessionPool {
+public:
+        using SlotIndex = uint16_t;
+        static constexpr SlotIndex EMPTY = 0xffff;
+        static_assert (N > 0 && N < EMPTY, "Wrong number of sessions.");
+
+        SessionPool ()
+        {
+                for (size_t i = N; i > 0; --i) {
+                        freeSlots.push_back (SlotIndex (i - 1));
+                }
+        }
+
+        bool full () const { return freeSlots.empty (); }
+        bool empty () const { return freeSlots.size () == N; }
+        size_t size () const { return N - freeSlots.size (); }
+
+        /// Takes a free slot. Check full () first.
+        SlotIndex allocate (KeyT const &k)
+        {
+                SlotIndex slot = freeSlots.back ();
+                freeSlots.pop_back ();
+                keys[slot] = k;
+
+                if constexpr (!HasClear<ValueT>::value) {
+                        values[slot] = ValueT{};
+                }
+
+                return slot;
+        }
+
+        void release (SlotIndex slot)
+        {
+                if constexpr (HasClear<ValueT>::value) {
+                        values[slot].clear ();
+                }
+
+                freeSlots.push_back (slot);
+        }
+
+        KeyT const &key (SlotIndex slot) const { return keys[slot]; }
+        ValueT &value (SlotIndex slot) { return values[slot]; }
+        SlotIndex slotOf (ValueT const *v) const { return SlotIndex (v - &values[0]); }
+
+private:
+        etl::array<KeyT, N> keys{};
+        etl::array<ValueT, N> values{};
+        etl::vector<SlotIndex, N> freeSlots;
+};
+
+/**
+ * Open addressing (linear probing) hash table with at least twice as many buckets as
+ * sessions, so probe sequences stay short. Removal uses backward shift, so there are
+ * no tombstones and the lookup cost does not degrade over time.
+ */
+template <typename KeyT, typename ValueT, size_t N, typename HashT> class HashSessionIndex {
+public:
+        using Pool = SessionPool<KeyT, ValueT, N>;
+        using SlotIndex = typename Pool::SlotIndex;
+
+        HashSessionIndex () { table.fill (Pool::EMPTY); }
+
+        bool full () const { return pool.full (); }
+        bool empty () const { return pool.empty (); }
+        size_t size () const { return pool.size (); }
+
+        ValueT *find (KeyT const &k)
+        {
+                size_t bucket = findBucket (k);
+                return (table[bucket] == Pool::EMPTY) ? (nullptr) : (&pool.value (table[bucket]));
+        }
+
+        /// Creates a new session for k, which must not be present. Returns nullptr if there's no room.
+        ValueT *insert (KeyT const &k)
+        {
+                if (pool.full ()) {
+                        return nullptr;
+                }
+
+                size_t bucket = findBucket (k);
+                table[bucket] = pool.allocate (k);
+                return &pool.value (table[bucket]);
+        }
+
+        void erase (KeyT const &k)
+        {
+                size_t hole = findBucket (k);
+
+                if (table[hole] == Pool::EMPTY) {
+                        return;
+                }
+
+                pool.release (table[hole]);
+
+                // Backward shift : move following entries of the cluster into the hole if their home bucket allows that.
+                for (size_t i = (hole + 1) & MASK; table[i] != Pool::EMPTY; i = (i + 1) & MASK) {
+                        size_t home = HashT{}(pool.key (table[i])) & MASK;
+
+                        if (((i - home) & MASK) >= ((i - hole) & MASK)) {
+                                table[hole] = table[i];
+                                hole = i;
+                        }
+                }
+
+                table[hole] = Pool::EMPTY;
+        }
+
+        /// Slot numbers are stable for the lifetime of a session, and are less than N. Useful for keeping related data outside.
+        SlotIndex slotOf (ValueT const *v) const { return pool.slotOf (v); }
+        KeyT const &keyAt (SlotIndex slot) const { return pool.key (slot); }
+        ValueT &valueAt (SlotIndex slot) { return pool.value (slot); }
+
+private:
+        static constexpr size_t tableSize ()
+        {
+                size_t s = 1;
+
+                while (s < 2 * N) {
+                        s <<= 1;
+                }
+
+                return s;
+        }
+
+        static constexpr size_t TABLE_SIZE = tableSize ();
+        static constexpr size_t MASK = TABLE_SIZE - 1;
+
+        /// Returns the bucket where k is or, if absent, where it should go.
+        size_t findBucket (KeyT const &k) const
+        {
+                size_t i = HashT{}(k) & MASK;
+
+                while (table[i] != Pool::EMPTY && !(pool.key (table[i]) == k)) {
+                        i = (i + 1) & MASK;
+                }
+
+                return i;
+        }
+
+        etl::array<SlotIndex, TABLE_SIZE> table;
+        Pool pool;
+};
+
+/**
+ * 256 entry table indexed directly with one byte of the address. EncoderT::directIndex (key)
+ * returns this byte, which has to tell the peers apart (N_SA for NormalFixed29 and Mixed29).
+ */
+template <typename KeyT, typename ValueT, size_t N, typename EncoderT> class DirectSessionIndex {
+public:
+        using Pool = SessionPool<KeyT, ValueT, N>;
+        using SlotIndex = typename Pool::SlotIndex;
+
+        DirectSessionIndex () { table.fill (Pool::EMPTY); }
+
+        bool full () const { return pool.full (); }
+        bool empty () const { return pool.empty (); }
+        size_t size () const { return pool.size (); }
+
+        ValueT *find (KeyT const &k)
+        {
+                SlotIndex slot = table[EncoderT::directIndex (k)];
+                return (slot != Pool::EMPTY && pool.key (slot) == k) ? (&pool.value (slot)) : (nullptr);
+        }
+
+        /// Creates a new session for k, which must not be present. Returns nullptr if there's no room.
+        ValueT *insert (KeyT const &k)
+        {
+                SlotIndex &entry = table[EncoderT::directIndex (k)];
+
+                if (pool.full () || entry != Pool::EMPTY) {
+                        return nullptr;
+                }
+
+                entry = pool.allocate (k);
+                return &pool.value (entry);
+        }
+
+        void erase (KeyT const &k)
+        {
+                SlotIndex &entry = table[EncoderT::directIndex (k)];
+
+                if (entry == Pool::EMPTY || !(pool.key (entry) == k)) {
+                        return;
+                }
+
+                pool.release (entry);
+                entry = Pool::EMPTY;
+        }
+
+        /// Slot numbers are stable for the lifetime of a session, and are less than N. Useful for keeping related data outside.
+        SlotIndex slotOf (ValueT const *v) const { return pool.slotOf (v); }
+        KeyT const &keyAt (SlotIndex slot) const { return pool.key (slot); }
+        ValueT &valueAt (SlotIndex slot) { return pool.value (slot); }
+
+private:
+        etl::array<SlotIndex, 256> table;
+        Pool pool;
+};
+
+} // namespace tp
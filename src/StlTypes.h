@@ -18,15 +18,19 @@ class CanFrame;
 
 /**
  * @brief The TimeProvider struct
- * TODO if I'm not mistaken, those classes ought to have 100µs resolution instead of 1ms (1000µs).
+ * Monotonic (system clock adjustments don't affect the timeouts) with µs resolution, so
+ * STmin values 0xf1 - 0xf9 (100 - 900µs) are honored. Time providers without TICKS_PER_SECOND
+ * are assumed to return ms.
  */
 struct ChronoTimeProvider {
+        static constexpr uint32_t TICKS_PER_SECOND = 1000000;
+
         long operator() () const
         {
                 using namespace std::chrono;
-                system_clock::time_point now = system_clock::now ();
+                steady_clock::time_point now = steady_clock::now ();
                 auto duration = now.time_since_epoch ();
-                return duration_cast<milliseconds> (duration).count ();
+                return duration_cast<microseconds> (duration).count ();
         }
 };
 
@@ -0,0 +1,159 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#pragma once
+#include "CppCompat.h"
+
+namespace tp {
+
+/**
+ * Deadlines of up to N timers identified by numbers 0..N-1. It is a binary min-heap
+ * with an index (timer id -> heap position), so rescheduling and canceling a timer are
+ * O(log N), and finding expired ones costs O(expired * log N) regardless of how many
+ * timers are running. Time is in ticks of the time provider and may wrap around, as
+ * long as no deadline is more than 2^31 ticks away.
+ */
+template <size_t N> class TimerQueue {
+public:
+        using Id = uint16_t;
+        static constexpr Id NONE = 0xffff;
+        static_assert (N > 0 && N < NONE, "Wrong number of timers.");
+
+        TimerQueue () { position.fill (NONE); }
+
+        bool empty () const { return count == 0; }
+        size_t size () const { return count; }
+        bool isScheduled (Id id) const { return position[id] != NONE; }
+
+        /// Deadline of the timer which expires first. Check empty () first.
+        uint32_t nextDeadline () const { return heap[0].deadline; }
+
+        /// Starts the timer, or moves its deadline if it's already running.
+        void schedule (Id id, uint32_t deadline)
+        {
+                if (position[id] == NONE) {
+                        position[id] = count;
+                        heap[count++] = Entry{deadline, id};
+                        siftUp (position[id]);
+                        return;
+                }
+
+                size_t i = position[id];
+                bool earlier = before (deadline, heap[i].deadline);
+                heap[i].deadline = deadline;
+
+                if (earlier) {
+                        siftUp (i);
+                }
+                else {
+                        siftDown (i);
+                }
+        }
+
+        /// Stops the timer. Does nothing if it's not running.
+        void cancel (Id id)
+        {
+                if (position[id] != NONE) {
+                        removeAt (position[id]);
+                }
+        }
+
+        /**
+         * Removes all the timers with deadline <= nowTicks, and calls f (id) for each of
+         * them. f may schedule and cancel timers.
+         */
+        template <typename Fun> void expire (uint32_t nowTicks, Fun &&f)
+        {
+                while (count > 0 && !before (nowTicks, heap[0].deadline)) {
+                        Id id = heap[0].id;
+                        removeAt (0);
+                        f (id);
+                }
+        }
+
+private:
+        struct Entry {
+                uint32_t deadline;
+                Id id;
+        };
+
+        /// Wrap around safe a < b.
+        static bool before (uint32_t a, uint32_t b) { return int32_t (a - b) < 0; }
+
+        void removeAt (size_t i)
+        {
+                position[heap[i].id] = NONE;
+
+                if (i == --count) {
+                        return;
+                }
+
+                heap[i] = heap[count];
+                position[heap[i].id] = i;
+
+                if (i > 0 && before (heap[i].deadline, heap[(i - 1) / 2].deadline)) {
+                        siftUp (i);
+                }
+                else {
+                        siftDown (i);
+                }
+        }
+
+        void siftUp (size_t i)
+        {
+                while (i > 0) {
+                        size_t parent = (i - 1) / 2;
+
+                        if (!before (heap[i].deadline, heap[parent].deadline)) {
+                                break;
+                        }
+
+                        swap (i, parent);
+                        i = parent;
+                }
+        }
+
+        void siftDown (size_t i)
+        {
+                while (true) {
+                        size_t smallest = i;
+                        size_t left = 2 * i + 1;
+                        size_t right = left + 1;
+
+                        if (left < count && before (heap[left].deadline, heap[smallest].deadline)) {
+                                smallest = left;
+                        }
+
+                        if (right < count && before (heap[right].deadline, heap[smallest].deadline)) {
+                                smallest = right;
+                        }
+
+                        if (smallest == i) {
+                                break;
+                        }
+
+                        swap (i, smallest);
+                        i = smallest;
+                }
+        }
+
+        void swap (size_t a, size_t b)
+        {
+                Entry tmp = heap[a];
+                heap[a] = heap[b];
+                heap[b] = tmp;
+                position[heap[a].id] = a;
+                position[heap[b].id] = b;
+        }
+
+        etl::array<Entry, N> heap{};
+        etl::array<Id, N> position;
+        size_t count{};
+};
+
+} // namespace tp
@@ -8,9 +8,13 @@
 
 #pragma once
 #include "Address.h"
+#include "BufferPool.h"
 #include "CanFrame.h"
 #include "CppCompat.h"
 #include "MiscTypes.h"
+#include "SessionIndex.h"
+#include "TimerQueue.h"
+#include "TxQueue.h"
 
 /**
  * Set maximum number of Flow Control frames with WAIT bit set that can be received
@@ -21,13 +25,34 @@
 #define MAX_WAIT_FRAME_NUMBER 10
 #endif
 
+/**
+ * Max number of consecutive frames passed to a batched output interface at once (see
+ * TransportProtocol::setMaxBurst). They are collected on the stack.
+ */
+#if !defined(MAX_TX_BATCH_SIZE)
+#define MAX_TX_BATCH_SIZE 16
+#endif
+
+/**
+ * How long (in µs) to wait before sending a frame again, when the output interface asked
+ * for it (see OutputResult::RETRY).
+ */
+#if !defined(TX_RETRY_INTERVAL_US)
+#define TX_RETRY_INTERVAL_US 1000
+#endif
+
 namespace tp {
 
 /**
- *
+ * MAX_INTERLEAVED_ISO_MESSAGES_N is the number of segmented messages that can be received
+ * simultaneously, and MAX_INTERLEAVED_TX_MESSAGES_N is the number of segmented messages
+ * that can be sent at the same time (each to a different peer). TX_QUEUE_SIZE_N is the
+ * number of segmented messages that can wait for their turn if all of the former are busy.
+ * SESSION_INDEX_N selects how the messages being received are looked up.
  */
 template <typename CanFrameT, typename IsoMessageT, size_t MAX_MESSAGE_SIZE_N, typename AddressResolverT, typename CanOutputInterfaceT,
-          typename TimeProviderT, typename ExceptionHandlerT, typename CallbackT, size_t MAX_INTERLEAVED_ISO_MESSAGES_N>
+          typename TimeProviderT, typename ExceptionHandlerT, typename CallbackT, size_t MAX_INTERLEAVED_ISO_MESSAGES_N,
+          size_t MAX_INTERLEAVED_TX_MESSAGES_N = 1, size_t TX_QUEUE_SIZE_N = 0, SessionIndexType SESSION_INDEX_N = SessionIndexType::HASH>
 struct TransportProtocolTraits {
         using CanFrame = CanFrameT;
         using IsoMessageTT = IsoMessageT;
@@ -38,6 +63,9 @@ struct TransportProtocolTraits {
         using AddressEncoderT = AddressResolverT;
         static constexpr size_t MAX_MESSAGE_SIZE = MAX_MESSAGE_SIZE_N;
         static constexpr size_t MAX_INTERLEAVED_ISO_MESSAGES = MAX_INTERLEAVED_ISO_MESSAGES_N;
+        static constexpr size_t MAX_INTERLEAVED_TX_MESSAGES = MAX_INTERLEAVED_TX_MESSAGES_N;
+        static constexpr size_t TX_QUEUE_SIZE = TX_QUEUE_SIZE_N;
+        static constexpr SessionIndexType SESSION_INDEX = SESSION_INDEX_N;
 };
 
 /*
@@ -49,9 +77,15 @@ static constexpr size_t N_A_TIMEOUT = 1500;
 static constexpr size_t N_BS_TIMEOUT = 1500;
 static constexpr size_t N_CR_TIMEOUT = 1500;
 
-/// Max allowed by the ISO standard.
+/// Time is kept in µs internally, timeouts above are in ms.
+static constexpr uint32_t US_PER_MS = 1000;
+
+/// Max allowed by the ISO standard with the 12 bit FF_DL.
 static constexpr int MAX_ALLOWED_ISO_MESSAGE_SIZE = 4095;
 
+/// Max allowed by the ISO 15765-2:2016, which encodes longer messages with the 32 bit FF_DL (the FF_DL escape sequence).
+static constexpr uint32_t MAX_ESCAPED_ISO_MESSAGE_SIZE = 0xffffffff;
+
 /**
  * Implements ISO 15765-2 which is also called CAN ISO-TP or CAN ISO transport protocol.
  * Sources:
@@ -77,31 +111,55 @@ public:
         using CanFrameWrapperType = CanFrameWrapper<CanFrame>;
         using AddressEncoderT = typename TraitsT::AddressEncoderT;
         using AddressTraitsT = AddressTraits<AddressEncoderT>;
+        using Key = typename AddressEncoderT::Key;
 
         static constexpr size_t MAX_INTERLEAVED_ISO_MESSAGES = TraitsT::MAX_INTERLEAVED_ISO_MESSAGES;
+        static constexpr size_t MAX_INTERLEAVED_TX_MESSAGES = TraitsT::MAX_INTERLEAVED_TX_MESSAGES;
+        static_assert (MAX_INTERLEAVED_TX_MESSAGES > 0, "At least one transmission state machine is required.");
+        static constexpr size_t TX_QUEUE_SIZE = TraitsT::TX_QUEUE_SIZE;
 
         /// Max allowed by this implementation. Can be lowered if memory is scarce.
         static constexpr size_t MAX_ACCEPTED_ISO_MESSAGE_SIZE = TraitsT::MAX_MESSAGE_SIZE;
+        static_assert (MAX_ACCEPTED_ISO_MESSAGE_SIZE <= MAX_ESCAPED_ISO_MESSAGE_SIZE, "The FF_DL can't encode messages this long.");
+
+        /// Data field size of the frames sent (TX_DL) : 8 for classic CAN, up to 64 for CAN FD. See FrameMaxDataLength.
+        static constexpr size_t TX_DL = FrameMaxDataLength<CanFrameWrapperType>::value;
+        static_assert (TX_DL == 8 || (TX_DL > 8 && TX_DL <= 64 && canFdLength (TX_DL) == TX_DL), "Wrong TX_DL.");
+        static constexpr bool USING_FD = TX_DL > 8;
+
+        /// Payload sizes of frames we send, see AddressTraitsBase.
+        using TxGeometry = typename AddressTraitsT::template Geometry<TX_DL>;
+
+        /// Longest message which fits in a Single Frame. CAN FD ones carry the SF_DL in the second byte (SF escape sequence).
+        static constexpr size_t SINGLE_FRAME_MAX_SIZE = TxGeometry::SINGLE_FRAME_MAX_SIZE;
+
+        /// Unused bytes of CAN FD frames (rounded up to the valid lengths) are set to this.
+        static constexpr uint8_t FD_PADDING_BYTE = 0xcc;
+
+        /// Pool of the messages if IsoMessageT is a PooledIsoMessage (see BufferPool.h), NoBufferPool otherwise.
+        using BufferPoolT = typename MessageBufferPool<IsoMessageT>::type;
+        static constexpr bool POOLED_MESSAGES = MessageBufferPool<IsoMessageT>::value;
 
-        TransportProtocol (Callback callback, CanOutputInterface outputInterface = {}, TimeProvider /*timeProvider*/ = {},
+        TransportProtocol (Callback callback, CanOutputInterface outputInterface = {}, TimeProvider timeProvider = {},
                            ErrorHandler errorHandler = {})
             : callback{callback},
               outputInterface{outputInterface},
-              //              timeProvider{ timeProvider },
-              errorHandler{errorHandler},
-              stateMachine{this->outputInterface}
+              timeProvider{timeProvider},
+              errorHandler{errorHandler}
         {
+                initStateMachines ();
         }
 
-        TransportProtocol (Address myAddress, Callback callback, CanOutputInterface outputInterface = {}, TimeProvider /*timeProvider*/ = {},
+        TransportProtocol (Address myAddress, Callback callback, CanOutputInterface outputInterface = {}, TimeProvider timeProvider = {},
                            ErrorHandler errorHandler = {})
             : callback{callback},
               outputInterface{outputInterface},
-              //              timeProvider{ timeProvider },
+              timeProvider{timeProvider},
               errorHandler{errorHandler},
-              stateMachine{*this, this->outputInterface},
-              myAddress (myAddress)
+              myAddress (myAddress),
+              myKey (AddressEncoderT::localKey (myAddress))
         {
+                initStateMachines ();
         }
 
         // TODO Consider whether to implement copy / move semantics or not.
@@ -112,18 +170,22 @@ public:
         ~TransportProtocol () = default;
 
         /**
-         * Sends a message. If msg is so long, that it wouldn't fit in a SINGLE_FRAME (6 or 7 bytes
-         * depending on addressing used), it is COPIED into the transport protocol object for further
+         * Sends a message. If msg is so long, that it wouldn't fit in a SINGLE_FRAME (SINGLE_FRAME_MAX_SIZE,
+         * 6 or 7 bytes for classic CAN depending on addressing used), it is COPIED into the transport protocol object for further
          * processing, and then via run method is send in multiple CONSECUTIVE_FRAMES.
          * In ISO this method is called a 'request'
+         *
+         * Up to MAX_INTERLEAVED_TX_MESSAGES segmented messages can be sent at the same time,
+         * but only one to a particular peer. If no state machine is available, the message
+         * waits in the transmit queue (see setTxQueuePolicy). Returns false if it was rejected.
          */
         // template <typename IsoMessageSup = IsoMessageT> bool send (Address const &a, IsoMessageSup &&msg);
         bool send (Address const &a, IsoMessageT &&msg);
         bool send (Address const &a, IsoMessageT const &msg);
 
         /**
-         * Sends a message. If msg is so long, that it wouldn't fit in a SINGLE_FRAME (6 or 7 bytes
-         * depending on addressing used), it is MOVED into the transport protocol object for further
+         * Sends a message. If msg is so long, that it wouldn't fit in a SINGLE_FRAME (SINGLE_FRAME_MAX_SIZE,
+         * 6 or 7 bytes for classic CAN depending on addressing used), it is MOVED into the transport protocol object for further
          * processing, and then via run method is send in multiple CONSECUTIVE_FRAMES.
          * In ISO this method is called a 'request'
          */
@@ -132,15 +194,140 @@ public:
                 return send (myAddress, std::forward<IsoMessageSup> (msg));
         }
 
+        /**
+         * Sends msg without copying it : the segmented transmission reads the frames straight
+         * from the caller's memory. The buffer has to stay valid and unchanged for as long as
+         * the message is being sent or waits in the queue, i.e. until isSending (a) returns
+         * false (confirm with an error means that as well). Returns false if it was rejected.
+         */
+        bool sendBorrowed (Address const &a, etl::span<uint8_t const> msg);
+        bool sendBorrowed (etl::span<uint8_t const> msg) { return sendBorrowed (myAddress, msg); }
+
+        /**
+         * Sends a segmented message of length bytes, which are generated while it's being sent
+         * (i.e. compressed or encrypted on the fly), so only the frames the output interface
+         * hasn't taken yet are in memory (one, or up to MAX_TX_BATCH_SIZE with a batched output,
+         * see setMaxBurst). producer is called as size_t producer (size_t offset, etl::span<uint8_t> out)
+         * for every frame, in order, and has to fill out with the message bytes starting at
+         * offset and return out.size (). Frames sent again (see OutputResult::RETRY) are not
+         * produced again, so every offset is asked for once. If it returns less, the transmission is aborted with
+         * confirm (Result::N_ERROR). The producer is not copied, it has to stay alive while the
+         * message is being sent or waits in the queue, i.e. until isSending (a) returns false.
+         * Returns false if the message was rejected.
+         */
+        template <typename ProducerT> bool sendStreamed (Address const &a, size_t length, ProducerT &producer)
+        {
+                if (!isAcceptedSize (a, length)) {
+                        return false;
+                }
+
+                if (length <= SINGLE_FRAME_MAX_SIZE) { // Send using single Frame
+                        etl::array<uint8_t, SINGLE_FRAME_MAX_SIZE> chunk{};
+                        etl::span<uint8_t> out (chunk.data (), length);
+                        return producer (0, out) == length && sendSingleFrame (a, etl::span<uint8_t const> (out));
+                }
+
+                auto read = [] (void *context, size_t offset, etl::span<uint8_t> out) -> size_t {
+                        return (*static_cast<ProducerT *> (context)) (offset, out);
+                };
+
+                return sendMultipleFrames (PendingTransmission{a, IsoMessageT{}, {}, Producer{read, &producer, length}, PayloadSource::PRODUCED});
+        }
+
+        template <typename ProducerT> bool sendStreamed (size_t length, ProducerT &producer) { return sendStreamed (myAddress, length, producer); }
+
         /**
          * Does the book keeping (checks for timeouts, runs the sending state machine).
          */
         void run ();
 
         /**
-         *
+         * Monotonic time in µs (wraps around every ~71 minutes, which is taken care of) read
+         * from this instance's time provider. A simulated clock can be passed to the constructor.
+         */
+        uint32_t now () const
+        {
+                constexpr uint32_t TICKS_PER_SECOND = TimeProviderTicksPerSecond<TimeProvider>::value;
+                static_assert (TICKS_PER_SECOND > 0 && TICKS_PER_SECOND <= 1000000 && 1000000 % TICKS_PER_SECOND == 0,
+                               "TimeProvider::TICKS_PER_SECOND has to divide 1000000.");
+
+                return uint32_t (timeProvider ()) * (1000000 / TICKS_PER_SECOND);
+        }
+
+        /**
+         * Returns the time (in µs, see now) of the earliest event run has to handle :
+         * STmin between consecutive frames, N_Bs and N_Cr timeouts, or a queued message which
+         * can be started. Empty if there's nothing to do until a CAN frame arrives or send is
+         * called. Lets an event loop sleep instead of calling run all the time.
+         */
+        etl::optional<uint32_t> nextDeadline () const { return nextDeadline (now ()); }
+
+        /**
+         * Like nextDeadline, but relative : how many µs can the caller wait before calling run.
+         * 0 means run should be called right away.
+         */
+        etl::optional<uint32_t> timeToNextDeadline () const
+        {
+                uint32_t nowUs = now ();
+
+                if (auto d = nextDeadline (nowUs)) {
+                        int32_t diff = int32_t (*d - nowUs);
+                        return (diff > 0) ? (uint32_t (diff)) : (0);
+                }
+
+                return {};
+        }
+
+        /**
+         * Returns true if any segmented transmission is still in progress or waits in the queue.
+         */
+        bool isSending () const
+        {
+                if (!txQueue.empty ()) {
+                        return true;
+                }
+
+                for (auto const &sm : stateMachines) {
+                        if (sm.getState () != StateMachine::State::DONE) {
+                                return true;
+                        }
+                }
+
+                return false;
+        }
+
+        /**
+         * Returns true if a segmented transmission to the peer a is still in progress or waits
+         * in the queue.
          */
-        bool isSending () const { return stateMachine.getState () != StateMachine::State::DONE; }
+        bool isSending (Address const &a) const
+        {
+                for (auto const &p : txQueue) {
+                        if (isSamePeer (p.address, a)) {
+                                return true;
+                        }
+                }
+
+                return findStateMachine (a) != nullptr;
+        }
+
+        /**
+         * Calls f (Address const &) for every peer a segmented message is being sent to, or waits
+         * in the queue for. Their flow control frames have to get through any acceptance filters
+         * (see localFilter in Address.h and SocketCanBus).
+         */
+        template <typename Fun> void forEachTxAddress (Fun &&f) const
+        {
+                for (auto const &sm : stateMachines) {
+                        if (sm.getState () != StateMachine::State::DONE) {
+                                f (sm.getAddress ());
+                        }
+                }
+
+                for (auto const &p : txQueue) {
+                        f (p.address);
+                }
+        }
 
         /*
          * API jest asynchroniczne, bo na prawdę nie ma tego jak inaczej zrobić. Ramki CAN
@@ -161,6 +348,46 @@ public:
          */
         bool onCanNewFrame (CanFrame const &f) { return onCanNewFrame (CanFrameWrapperType{f}); }
 
+        /**
+         * Processes many received frames at once, in order, like calling onCanNewFrame for each
+         * of them. The clock is read only once for the whole batch, and consecutive frames from
+         * the same sender don't look their message up again. Meant for readers which get many
+         * frames at a time (i.e. recvmmsg).
+         */
+        void onCanNewFrames (etl::span<CanFrame const> frames)
+        {
+                FrameBatch batch;
+
+                for (CanFrame const &f : frames) {
+                        onCanNewFrame (CanFrameWrapperType{f}, batch);
+                }
+        }
+
+        /**
+         * Like onCanNewFrame, but the frame was received at rxTimeUs (µs, in the time base of now),
+         * i.e. according to a kernel or hardware timestamp. N_Cr and N_Bs count from it instead
+         * of from when the frame got processed, so scheduling delays of the caller don't cause
+         * spurious timeouts. Callbacks which take the time get it as well (see README).
+         */
+        bool onCanNewFrame (CanFrame const &f, uint32_t rxTimeUs)
+        {
+                FrameBatch batch;
+                batch.nowUs = rxTimeUs;
+                return onCanNewFrame (CanFrameWrapperType{f}, batch);
+        }
+
+        /// onCanNewFrames with a timestamp of every frame (see above). Both spans have to be of the same size.
+        void onCanNewFrames (etl::span<CanFrame const> frames, etl::span<uint32_t const> rxTimesUs)
+        {
+                Expects (frames.size () == rxTimesUs.size ());
+                FrameBatch batch;
+
+                for (size_t i = 0; i < frames.size (); ++i) {
+                        batch.nowUs = rxTimesUs[i];
+                        onCanNewFrame (CanFrameWrapperType{frames[i]}, batch);
+                }
+        }
+
         /**
          * myAddress address is used during reception
          * - target address of incoming message is checked with myAddress.sourceAddress
@@ -169,7 +396,11 @@ public:
          * - myAddress.targetAddress is used for outgoing frames if no address was specified during request (in send method).
          * - myAddress.sourceAddress is checked with incoming flowFrames if no address was specified during request (in send method).
          */
-        void setMyAddress (Address const &a) { myAddress = a; }
+        void setMyAddress (Address const &a)
+        {
+                myAddress = a;
+                myKey = AddressEncoderT::localKey (a);
+        }
         Address const &getMyAddress () const { return myAddress; }
 
         /**
@@ -198,58 +429,118 @@ public:
          */
         void setBlockSize (uint8_t b) { blockSize = b; }
 
+        /**
+         * How many consecutive frames of one message a single run call can send. More than one
+         * go only if the receiver asked for STmin == 0, up to the end of the block (BS), and as
+         * long as the output interface has room for them : if it has a size_t txCapacity ()
+         * method, it's asked once per run call how many frames it can take right away (i.e.
+         * free TX mailboxes), and that caps the burst. If it has no room at all, it's asked again after TX_RETRY_INTERVAL_US,
+         * for up to N_As. Default 1 means one frame per run call. If the output interface
+         * has a sendBatch (etl::span<CanFrame const>) method, the whole burst (up to
+         * MAX_TX_BATCH_SIZE frames) is passed to it at once. It returns either size_t, the
+         * number of frames accepted (the rest is sent again later, like after OutputResult::RETRY),
+         * or BatchOutputResult, which can also say that the rest failed (OutputResult::FAILED,
+         * the transmission is aborted right away).
+         */
+        void setMaxBurst (size_t n)
+        {
+                Expects (n > 0);
+                maxBurst = n;
+        }
+
+        /**
+         * Sets what send does when a segmented message can't be sent right away and the transmit
+         * queue (TX_QUEUE_SIZE long) is full. blockTimeoutMs is used only with TxQueuePolicy::BLOCK,
+         * which needs a wait hook as well (see setTxBlockHook).
+         */
+        void setTxQueuePolicy (TxQueuePolicy p, uint32_t blockTimeoutMs = N_A_TIMEOUT)
+        {
+                txQueuePolicy = p;
+                txQueueBlockTimeoutMs = blockTimeoutMs;
+        }
+
+        /**
+         * Lets send wait for room in the transmit queue (TxQueuePolicy::BLOCK). The transmissions
+         * in progress complete only when the peers' flow control frames arrive, and only the
+         * caller knows where they come from. So while blocked, send calls hook (uint32_t maxWaitUs)
+         * in a loop, and run after each call. The hook has to wait for at most maxWaitUs for
+         * CAN frames and pass them to onCanNewFrame, i.e. run one iteration of the caller's event
+         * loop (see SocketCanBus::runOnce). It is not copied, and has to stay alive as long as
+         * it's set. Without a hook, or when send is called from a callback (during run or
+         * onCanNewFrame), BLOCK works like REJECT.
+         */
+        template <typename HookT> void setTxBlockHook (HookT &hook)
+        {
+                txBlockHook = BlockHook{[] (void *context, uint32_t maxWaitUs) { (*static_cast<HookT *> (context)) (maxWaitUs); }, &hook};
+        }
+
+        /**
+         * Memory of the messages being received and sent, if IsoMessageT is a PooledIsoMessage.
+         * Every protocol object has its own pool, so it's used by one thread only. Messages
+         * to send can be made in it as well : IsoMessageT (tp.getBufferPool (), first, last).
+         * Messages passed to the callbacks give their blocks back to it when destroyed, so they
+         * can't outlive the protocol object.
+         */
+        BufferPoolT &getBufferPool () { return bufferPool; }
+
+        TxQueueStatistics getTxQueueStatistics () const
+        {
+                TxQueueStatistics stats = txQueueStatistics;
+                stats.depth = txQueue.size ();
+                return stats;
+        }
+
 #ifndef UNIT_TEST
 private:
 #endif
 
-        static uint32_t now ()
-        {
-                static TimeProvider tp;
-                return tp ();
-        }
+        /// Time provider resolution. Providers which don't declare TICKS_PER_SECOND are assumed to return ms.
+        template <typename T, typename = void> struct TimeProviderTicksPerSecond {
+                static constexpr uint32_t value = 1000;
+        };
+
+        template <typename T>
+        struct TimeProviderTicksPerSecond<T, typename etl::enable_if<true, decltype ((void)(T::TICKS_PER_SECOND))>::type> {
+                static constexpr uint32_t value = T::TICKS_PER_SECOND;
+        };
 
         /*
-         * @brief The Timer class
-         * TODO this timer should have 100µs resolution and 100µs units.
+         * @brief The Timer class. All the values are in µs. It does not read the clock by
+         * itself, the current time (see now) is always passed in. Default constructed timer
+         * is expired.
          */
         class Timer {
         public:
-                Timer (uint32_t intervalMs = 0) { start (intervalMs); }
-
                 /// Resets the timer (it starts from 0) and sets the interval. So isExpired will return true after whole interval has passed.
-                void start (uint32_t intervalMs)
+                void start (uint32_t intervalUs, uint32_t nowUs)
                 {
-                        this->intervalMs = intervalMs;
-                        this->startTime = getTick ();
+                        this->intervalUs = intervalUs;
+                        this->startTime = nowUs;
                 }
 
                 /// Change interval without reseting the timer. Can extend as well as shorten.
-                void extend (uint32_t intervalMs) { this->intervalMs = intervalMs; }
+                void extend (uint32_t intervalUs) { this->intervalUs = intervalUs; }
 
-                /// Says if intervalMs has passed since start () was called.
-                bool isExpired () const { return elapsed () >= intervalMs; }
+                /**
+                 * Says if intervalUs has passed since start () was called. Wrap around safe, and times
+                 * earlier than the start (i.e. skewed timestamps) don't count as expired. Timers with
+                 * 0 interval (and default constructed ones) are always expired.
+                 */
+                bool isExpired (uint32_t nowUs) const { return intervalUs == 0 || int32_t (nowUs - startTime) >= int32_t (intervalUs); }
 
-                /// Returns how many ms has passed since start () was called.
-                uint32_t elapsed () const
-                {
-                        uint32_t actualTime = getTick ();
-                        return actualTime - startTime;
-                }
+                /// Time at which the timer expires.
+                uint32_t getDeadline () const { return startTime + intervalUs; }
 
-                /// Convenience method, simple delay ms.
-                void delay (uint32_t delayMs)
+                /// Returns how many µs has passed since start () was called (0 for earlier times). Wrap around safe.
+                uint32_t elapsed (uint32_t nowUs) const
                 {
-                        Timer t{delayMs};
-                        while (!t.isExpired ()) {
-                        }
+                        int32_t diff = int32_t (nowUs - startTime);
+                        return (diff > 0) ? (uint32_t (diff)) : (0);
                 }
 
-                /// Returns system wide ms since system start.
-                uint32_t getTick () const { return now (); }
-
         private:
                 uint32_t startTime = 0;
-                uint32_t intervalMs = 0;
+                uint32_t intervalUs = 0;
         };
 
         /*
@@ -259,13 +550,107 @@ private:
 
                 int append (CanFrameWrapperType const &frame, size_t offset, size_t len);
 
+                /// Makes room for len bytes at once if IsoMessageT can do that. Returns false if there is not enough memory.
+                bool reserve (size_t len)
+                {
+                        if constexpr (HasReserve<IsoMessageT>::value) {
+                                data.reserve (len);
+                                return data.capacity () >= len;
+                        }
+
+                        return true;
+                }
+
+                /// Done with the message. The buffer is cleared, which keeps the capacity of a std::vector, and returns pooled memory.
+                void clear ()
+                {
+                        data.clear ();
+                        multiFrameRemainingLen = 0;
+                        currentSn = 0;
+                        consecutiveFramesReceived = 0;
+                        timeoutReason = Result{};
+                        bytesReceived = 0;
+                        rxDl = 8;
+                }
+
                 // uint32_t address = 0; /// Address Information M_AI
                 IsoMessageT data{};           /// Max 4095 (according to ISO 15765-2) or less if more strict requirements programmed by the user.
-                int multiFrameRemainingLen{}; /// For tracking number of bytes remaining.
+                uint32_t multiFrameRemainingLen{}; /// For tracking number of bytes remaining.
                 int currentSn{};              /// Sequence number of Consecutive Frame.
                 int consecutiveFramesReceived{}; /// For comparison with block size.
-                Timer timer;                     /// For tracking time between first and consecutive frames with the same address.
-                Result timeoutReason{};          /// It timer expired, what was the result.
+                Result timeoutReason{};          /// If the timer (see receiveTimers) expired, what was the result.
+                size_t bytesReceived{};          /// Offset of the next chunk in the streaming mode (data stays empty then).
+                uint8_t rxDl{8};                 /// RX_DL, the data length of the First Frame. Consecutive Frames are that long.
+        };
+
+        /// Checks if the output interface tells how many frames it can take right away, see setMaxBurst.
+        template <typename T, typename = void> struct HasTxCapacity : public etl::false_type {
+        };
+
+        template <typename T>
+        struct HasTxCapacity<T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().txCapacity ()))>::type>
+            : public etl::true_type {
+        };
+
+        /**
+         * Checks if the output interface can send many frames at once (like sendmmsg) :
+         * sendBatch (etl::span<CanFrame const> frames), which returns how many of them were
+         * accepted (size_t), or BatchOutputResult. See setMaxBurst.
+         */
+        template <typename T, typename = void> struct HasBatchedOutput : public etl::false_type {
+        };
+
+        template <typename T>
+        struct HasBatchedOutput<
+                T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().sendBatch (etl::span<CanFrame const>{})))>::type>
+            : public etl::true_type {
+        };
+
+        /// Frames a single sendConsecutiveFrames call can build, i.e. which may have to be sent again.
+        static constexpr size_t MAX_UNSENT_FRAMES = (HasBatchedOutput<CanOutputInterface>::value) ? (MAX_TX_BATCH_SIZE) : (1);
+
+        /// Where the bytes of a message being sent come from.
+        enum class PayloadSource : uint8_t {
+                OWNED,    /// The IsoMessageT moved into the protocol.
+                BORROWED, /// The caller's buffer, see sendBorrowed.
+                PRODUCED  /// Generated frame by frame, see sendStreamed.
+        };
+
+        /// Type erased wait hook, see setTxBlockHook.
+        struct BlockHook {
+                void (*wait) (void *context, uint32_t maxWaitUs){};
+                void *context{};
+        };
+
+        /// Counts nested calls of run, onCanNewFrame and blocked send, so callbacks can't make them re-entrant.
+        class NestingGuard {
+        public:
+                explicit NestingGuard (uint8_t &n) : nesting (n) { ++nesting; }
+                ~NestingGuard () { --nesting; }
+                NestingGuard (NestingGuard const &) = delete;
+                NestingGuard &operator= (NestingGuard const &) = delete;
+
+        private:
+                uint8_t &nesting;
+        };
+
+        /// Type erased producer callable, see sendStreamed.
+        struct Producer {
+                size_t (*read) (void *context, size_t offset, etl::span<uint8_t> out){};
+                void *context{};
+                size_t size{};
+        };
+
+        /**
+         * Segmented message to be sent (or waiting in the transmit queue), together with the
+         * source of its bytes.
+         */
+        struct PendingTransmission {
+                Address address;
+                IsoMessageT message{};
+                etl::span<uint8_t const> borrowed{};
+                Producer producer{};
+                PayloadSource source{PayloadSource::OWNED};
         };
 
         /*
@@ -292,10 +677,14 @@ private:
                 StateMachine (StateMachine const &sm) noexcept = delete;
                 StateMachine &operator= (StateMachine const &sm) noexcept = delete;
 
-                void reset (Address const &a, IsoMessageT &&m)
+                void reset (PendingTransmission &&p)
                 {
-                        myAddress = a;
-                        message = std::move (m);
+                        myAddress = p.address;
+                        peerKey = AddressEncoderT::peerKey (p.address);
+                        message = std::move (p.message);
+                        borrowed = p.borrowed;
+                        producer = p.producer;
+                        source = p.source;
                         state = State::IDLE;
 
                         bytesSent = 0;
@@ -305,35 +694,136 @@ private:
                         receivedSeparationTimeUs = 0;
                         waitFrameNumber = 0;
 
-                        separationTimer.start (0);
-                        bsCrTimer.start (0);
+                        separationTimer = Timer{};
+                        bsCrTimer = Timer{};
+                        lastRunUs.reset ();
+                        retrying = false;
+                        produced.clear ();
+                        producedFrom = 0;
                 }
 
-                Status run (CanFrameWrapperType const *frame = nullptr);
+                /// nowUs is the current time (see TransportProtocol::now).
+                Status run (uint32_t nowUs, CanFrameWrapperType const *frame = nullptr);
+
+                /// When run has something to do next (nowUs if right away). Empty if it's waiting for a frame or DONE.
+                etl::optional<uint32_t> nextDeadline (uint32_t nowUs) const;
                 State getState () const { return state; }
+                Address const &getAddress () const { return myAddress; }
+
+                /// Checks if a frame with this key comes from the peer we are sending to.
+                bool matchesPeer (Key theirKey) const { return (theirKey & AddressEncoderT::PEER_KEY_MASK) == peerKey; }
 
         private:
+                size_t payloadSize () const;
+                Status sendConsecutiveFrames (uint32_t nowUs, size_t isoMessageSize);
+                Status buildConsecutiveFrame (CanFrameWrapperType &canFrame, size_t isoMessageSize, size_t &toSend);
+                void consecutiveFrameSent (uint32_t nowUs, size_t toSend, size_t isoMessageSize);
+                bool frameNotSent (uint32_t nowUs, OutputResult r);
+
+                /// Where the transmission is. Saved before every frame of a batch, so it can be rolled back to the first one not accepted.
+                struct Progress {
+                        State state;
+                        size_t bytesSent;
+                        uint16_t blocksSent;
+                        uint8_t sequenceNumber;
+                        Timer separationTimer;
+                        Timer bsCrTimer;
+                };
+
+                Progress progress () const { return {state, bytesSent, blocksSent, sequenceNumber, separationTimer, bsCrTimer}; }
+                bool writePayload (CanFrameWrapperType &canFrame, size_t frameOffset, size_t len);
+                void dropAcceptedPayload ();
+
                 TransportProtocol &tp;
                 CanOutputInterface &outputInterface;
                 Address myAddress{};
+                Key peerKey{};
                 IsoMessageT message{};
+                etl::span<uint8_t const> borrowed{};
+                Producer producer{};
+                PayloadSource source{PayloadSource::OWNED};
                 State state{State::DONE};
                 size_t bytesSent{};
                 uint16_t blocksSent{};
                 uint8_t sequenceNumber{1};
                 uint8_t receivedBlockSize{};
                 uint32_t receivedSeparationTimeUs{};
-                Timer separationTimer{};
+                Timer separationTimer{}; /// STmin, or TX_RETRY_INTERVAL_US when retrying.
                 Timer bsCrTimer{};
+                Timer nAsTimer{}; /// Started when the output interface first asks to retry a frame.
+                etl::optional<uint32_t> lastRunUs; /// Time of the latest run call. Frames timestamped earlier are taken as received at it.
+                bool retrying{};
                 uint8_t waitFrameNumber{};
+
+                /// Bytes from the producer at producedFrom onwards, kept until the output interface takes their frames. Frames sent again are built from here.
+                etl::vector<uint8_t, MAX_UNSENT_FRAMES * TX_DL> produced;
+                size_t producedFrom{};
         };
 
+        /// Looks up messages being received by the key of the peer which sends them.
+        using TransportMessageIndex =
+                typename etl::conditional<TraitsT::SESSION_INDEX == SessionIndexType::DIRECT,
+                                          DirectSessionIndex<Key, TransportMessage, MAX_INTERLEAVED_ISO_MESSAGES, AddressEncoderT>,
+                                          HashSessionIndex<Key, TransportMessage, MAX_INTERLEAVED_ISO_MESSAGES, KeyHash>>::type;
+
         /*---------------------------------------------------------------------------*/
 
-        bool onCanNewFrame (CanFrameWrapperType const &frame);
+        /// What the frames passed to one onCanNewFrames call share.
+        struct FrameBatch {
+                etl::optional<uint32_t> nowUs; /// Read when first needed, unless the frames are timestamped.
+                Key sessionKey{};              /// Sender of the last frame, if it was a consecutive frame
+                TransportMessage *session{};   /// of a message which isn't complete yet, and the message.
+        };
+
+        bool onCanNewFrame (CanFrameWrapperType const &frame)
+        {
+                FrameBatch batch;
+                return onCanNewFrame (frame, batch);
+        }
+
+        bool onCanNewFrame (CanFrameWrapperType const &frame, FrameBatch &batch);
+
+        uint32_t now (FrameBatch &batch) const
+        {
+                if (!batch.nowUs) {
+                        batch.nowUs = now ();
+                }
+
+                return *batch.nowUs;
+        }
 
         /*---------------------------------------------------------------------------*/
 
+        /// Checks if the frame wrapper exposes its payload as a contiguous array via data ().
+        template <typename T, typename = void> struct HasFrameData : public etl::false_type {
+        };
+
+        template <typename T>
+        struct HasFrameData<T, typename etl::enable_if<true, decltype ((void)(std::declval<T const &> ().data ()))>::type>
+            : public etl::true_type {
+        };
+
+        /// Checks if a range of bytes can be appended to the IsoMessageT with a single insert (end, first, last).
+        template <typename T, typename = void> struct HasRangeInsert : public etl::false_type {
+        };
+
+        template <typename T>
+        struct HasRangeInsert<T,
+                              typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().insert (
+                                                                    std::declval<T &> ().end (), std::declval<uint8_t const *> (),
+                                                                    std::declval<uint8_t const *> ())))>::type> : public etl::true_type {
+        };
+
+        /// Checks if the IsoMessageT can preallocate its storage (like std::vector), and tell how much it got.
+        template <typename T, typename = void> struct HasReserve : public etl::false_type {
+        };
+
+        template <typename T>
+        struct HasReserve<T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().reserve (size_t{})),
+                                                                     (void)(std::declval<T const &> ().capacity ()))>::type>
+            : public etl::true_type {
+        };
+
         /// Checks if callback accepts single IsoMessage param thus has the form callback (IsoMessage msg) TODO use std::is_invocable_v
         template <typename T, typename = void> struct IsCallbackSimple : public etl::false_type {
         };
@@ -364,6 +854,25 @@ private:
             : public etl::true_type {
         };
 
+        /// Advanced callback which also gets the time the message was received at : Address{}, IsoMessageT{}, Result{}, uint32_t{}
+        template <typename T, typename = void> struct IsCallbackTimestamped : public etl::false_type {
+        };
+
+        template <typename T>
+        struct IsCallbackTimestamped<T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> () (Address{}, IsoMessageT{}, Result{},
+                                                                                                            uint32_t{})))>::type>
+            : public etl::true_type {
+        };
+
+        template <typename T, typename = void> struct IsCallbackTimestampedMethod : public etl::false_type {
+        };
+
+        template <typename T>
+        struct IsCallbackTimestampedMethod<T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().indication (
+                                                                                     Address{}, IsoMessageT{}, Result{}, uint32_t{})))>::type>
+            : public etl::true_type {
+        };
+
         template <typename T, typename = void> struct HasCallbackConfirmMethod : public etl::false_type {
         };
 
@@ -378,10 +887,39 @@ private:
 
         template <typename T>
         struct HasCallbackFFIMethod<
-                T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().firstFrameIndication (Address{}, uint16_t{})))>::type>
+                T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().firstFrameIndication (Address{}, uint32_t{})))>::type>
+            : public etl::true_type {
+        };
+
+        template <typename T, typename = void> struct HasCallbackTimestampedFFIMethod : public etl::false_type {
+        };
+
+        template <typename T>
+        struct HasCallbackTimestampedFFIMethod<T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().firstFrameIndication (
+                                                                                          Address{}, uint32_t{}, uint32_t{})))>::type>
+            : public etl::true_type {
+        };
+
+        /// Checks if the callback wants the received messages in chunks (the streaming mode).
+        template <typename T, typename = void> struct HasCallbackChunkMethod : public etl::false_type {
+        };
+
+        template <typename T>
+        struct HasCallbackChunkMethod<T, typename etl::enable_if<true, decltype ((void)(std::declval<T &> ().onChunk (
+                                                                                 Address{}, size_t{}, etl::span<uint8_t const>{})))>::type>
             : public etl::true_type {
         };
 
+        static constexpr bool STREAMING_RECEIVE = HasCallbackChunkMethod<Callback>::value;
+
+        /// Output interfaces return either bool (true if sent), or OutputResult.
+        static OutputResult toOutputResult (bool sent) { return (sent) ? (OutputResult::SENT) : (OutputResult::FAILED); }
+        static OutputResult toOutputResult (OutputResult r) { return r; }
+
+        /// Batched output interfaces return either the number of frames accepted, or BatchOutputResult.
+        static BatchOutputResult toBatchOutputResult (size_t accepted) { return {accepted, OutputResult::RETRY}; }
+        static BatchOutputResult toBatchOutputResult (BatchOutputResult r) { return r; }
+
         void confirm (Address const &a, Result r)
         {
                 if constexpr (HasCallbackConfirmMethod<Callback>::value) {
@@ -389,53 +927,99 @@ private:
                 }
         }
 
-        void firstFrameIndication (Address const &a, uint16_t len)
+        void firstFrameIndication (Address const &a, uint32_t len, uint32_t rxTimeUs)
         {
-                if constexpr (HasCallbackFFIMethod<Callback>::value) {
+                if constexpr (HasCallbackTimestampedFFIMethod<Callback>::value) {
+                        callback.firstFrameIndication (a, len, rxTimeUs);
+                }
+                else if constexpr (HasCallbackFFIMethod<Callback>::value) {
                         callback.firstFrameIndication (a, len);
                 }
         }
 
-        void indication (Address const &a, IsoMessageT const &msg, Result r)
+        /**
+         * The message is passed as an rvalue, because the protocol doesn't need it afterwards.
+         * Callbacks taking IsoMessageT const & see it as before, and those taking IsoMessageT &&
+         * (or by value) can move it out, i.e. to a queue, without copying. The detection traits
+         * above use prvalues, so they recognize all of these forms. timeUs is when the last frame
+         * was received, or when the timeout was detected.
+         */
+        void indication (Address const &a, IsoMessageT &&msg, Result r, uint32_t timeUs)
         {
                 constexpr bool simpleCallback = IsCallbackSimple<Callback>::value;
                 constexpr bool advancedCallback = IsCallbackAdvanced<Callback>::value;
                 constexpr bool advancedMethodCallback = IsCallbackAdvancedMethod<Callback>::value;
+                constexpr bool timestampedCallback = IsCallbackTimestamped<Callback>::value;
+                constexpr bool timestampedMethodCallback = IsCallbackTimestampedMethod<Callback>::value;
 
-                static_assert (simpleCallback || advancedCallback || advancedMethodCallback,
+                static_assert (simpleCallback || advancedCallback || advancedMethodCallback || timestampedCallback || timestampedMethodCallback,
                                "Wrong callback interface. Use either 'simple', 'advanced', or 'advancedMethod' callback. See the README.md for "
                                "more info.");
 
-                if constexpr (simpleCallback) {
-                        callback (msg);
+                if constexpr (timestampedCallback) {
+                        callback (a, std::move (msg), r, timeUs);
+                }
+                else if constexpr (timestampedMethodCallback) {
+                        callback.indication (a, std::move (msg), r, timeUs);
+                }
+                else if constexpr (simpleCallback) {
+                        callback (std::move (msg));
                 }
                 else if constexpr (advancedCallback) {
-                        callback (a, msg, r);
+                        callback (a, std::move (msg), r);
                 }
                 else if constexpr (advancedMethodCallback) {
-                        callback.indication (a, msg, r);
+                        callback.indication (a, std::move (msg), r);
                 }
         }
 
         /*---------------------------------------------------------------------------*/
 
         uint32_t getID (bool extended) const;
+        void initStateMachines ();
+        void eraseTransportMessage (Key k);
+        StateMachine const *findStateMachine (Address const &peer) const;
+
+        /// Flow control frames are told apart by peerKey only, so addresses with equal keys are one peer.
+        static bool isSamePeer (Address const &a, Address const &b) { return AddressEncoderT::peerKey (a) == AddressEncoderT::peerKey (b); }
+        bool hasFreeStateMachine () const;
+        etl::optional<uint32_t> nextDeadline (uint32_t nowUs) const;
+        StateMachine *findFreeStateMachine (Address const &peer);
+        bool startOrQueue (PendingTransmission &p);
+        void startQueued ();
+        StateMachine *findStateMachineForFlowFrame (Key theirKey);
+        bool isAcceptedSize (Address const &a, size_t len);
+        bool reserve (TransportMessage &m, size_t len);
         bool sendFlowFrame (const Address &outgoingAddress, FlowStatus fs = FlowStatus::CONTINUE_TO_SEND);
-        bool sendSingleFrame (const Address &a, IsoMessageT const &msg);
-        bool sendMultipleFrames (const Address &a, IsoMessageT &&msg);
+        template <typename MessageT> bool sendSingleFrame (const Address &a, MessageT const &msg);
+        static void setFrameLength (CanFrameWrapperType &canFrame, size_t len);
+        bool sendMultipleFrames (PendingTransmission &&p);
+        void receivePayload (Key k, TransportMessage &m, CanFrameWrapperType const &frame, size_t offset, size_t len);
 
 #ifndef UNIT_TEST
 private:
 #endif
 
-        etl::map<Address, TransportMessage, MAX_INTERLEAVED_ISO_MESSAGES> transportMessagesMap;
+        BufferPoolT bufferPool; /// Declared first, so the messages below give their blocks back before it's destroyed.
+        TransportMessageIndex transportMessagesMap;
+        TransportMessage singleFrameMessage; /// Reused for every single frame received, so it doesn't allocate.
+        TimerQueue<MAX_INTERLEAVED_ISO_MESSAGES> receiveTimers; /// N_Bs / N_Cr of messages being received, by their slot number.
         uint8_t blockSize{};
         uint8_t separationTime{};
+        size_t maxBurst{1};
         Callback callback;
         CanOutputInterface outputInterface;
+        mutable TimeProvider timeProvider; /// Reading the clock does not change the protocol state, hence mutable.
         ErrorHandler errorHandler;
-        StateMachine stateMachine;
+        etl::vector<StateMachine, MAX_INTERLEAVED_TX_MESSAGES> stateMachines;
+        TxQueue<PendingTransmission, TX_QUEUE_SIZE> txQueue;
+        TxQueuePolicy txQueuePolicy{TxQueuePolicy::REJECT};
+        uint32_t txQueueBlockTimeoutMs{N_A_TIMEOUT};
+        BlockHook txBlockHook{};
+        uint8_t nesting{}; /// Depth of run / onCanNewFrame / blocked send calls, see NestingGuard.
+        TxQueueStatistics txQueueStatistics{};
         Address myAddress;
+        Key myKey{}; /// Key of frames addressed to myAddress, see AddressEncoderT::localKey.
 };
 
 /*****************************************************************************/
@@ -459,223 +1043,532 @@ private:
 
 template <typename TraitsT> bool TransportProtocol<TraitsT>::send (const Address &a, IsoMessageT &&msg)
 {
-        if (msg.size () > MAX_ACCEPTED_ISO_MESSAGE_SIZE) {
+        if (!isAcceptedSize (a, msg.size ())) {
                 return false;
         }
 
-        // 6 or 7 depending on addressing used
-        const size_t SINGLE_FRAME_MAX_SIZE = 7 - int (AddressTraitsT::USING_EXTENDED);
-
         if (msg.size () <= SINGLE_FRAME_MAX_SIZE) { // Send using single Frame
                 return sendSingleFrame (a, msg);
         }
 
         // Send using multiple frames, state machine, and timing control and whatnot.
-        return sendMultipleFrames (a, std::move (msg));
+        return sendMultipleFrames (PendingTransmission{a, std::move (msg)});
 }
 
 template <typename TraitsT> bool TransportProtocol<TraitsT>::send (const Address &a, IsoMessageT const &msg)
 {
-        if (msg.size () > MAX_ACCEPTED_ISO_MESSAGE_SIZE) {
+        if (!isAcceptedSize (a, msg.size ())) {
                 return false;
         }
 
-        // 6 or 7 depending on addressing used
-        const size_t SINGLE_FRAME_MAX_SIZE = 7 - int (AddressTraitsT::USING_EXTENDED);
-
         if (msg.size () <= SINGLE_FRAME_MAX_SIZE) { // Send using single Frame
                 return sendSingleFrame (a, msg);
         }
 
+        IsoMessageT copy (msg);
+
+        // Copying can fail if the memory is limited (see BufferPool).
+        if (copy.size () != msg.size ()) {
+                return false;
+        }
+
         // Send using multiple frames, state machine, and timing control and whatnot.
-        return sendMultipleFrames (a, IsoMessageT (msg));
+        return sendMultipleFrames (PendingTransmission{a, std::move (copy)});
 }
 
-/*****************************************************************************/
-
-template <typename TraitsT> bool TransportProtocol<TraitsT>::sendSingleFrame (const Address &a, IsoMessageT const &msg)
+template <typename TraitsT> bool TransportProtocol<TraitsT>::sendBorrowed (const Address &a, etl::span<uint8_t const> msg)
 {
-        CanFrameWrapperType canFrame{0x00, true, (int (IsoNPduType::SINGLE_FRAME) << 4) | (msg.size () & 0x0f)};
-
-        if (!AddressEncoderT::toFrame (a, canFrame)) {
-                errorHandler (Status::ADDRESS_ENCODE_ERROR);
+        if (!isAcceptedSize (a, msg.size ())) {
                 return false;
         }
 
-        for (size_t i = 0; i < msg.size (); ++i) {
-                canFrame.set (i + 1, msg.at (i));
-        }
-
-        canFrame.setDlc (1 + msg.size ());
-        bool result = outputInterface (canFrame.value ());
-
-        if (!result) {
-                confirm (myAddress, Result::N_TIMEOUT_A);
-        }
-        else {
-                confirm (myAddress, Result::N_OK);
+        if (msg.size () <= SINGLE_FRAME_MAX_SIZE) { // Send using single Frame
+                return sendSingleFrame (a, msg);
         }
 
-        return result;
+        return sendMultipleFrames (PendingTransmission{a, IsoMessageT{}, msg, Producer{}, PayloadSource::BORROWED});
 }
 
 /*****************************************************************************/
 
-template <typename TraitsT> bool TransportProtocol<TraitsT>::sendMultipleFrames (const Address &a, IsoMessageT &&msg)
-{
-        if (stateMachine.getState () != StateMachine::State::DONE) {
+/**
+ * Messages longer than MAX_ACCEPTED_ISO_MESSAGE_SIZE (which, in turn, can't be longer than
+ * the 32 bit FF_DL allows) are rejected with confirm (Result::N_ERROR).
+ */
+template <typename TraitsT> bool TransportProtocol<TraitsT>::isAcceptedSize (Address const &a, size_t len)
+{
+        if (len > MAX_ACCEPTED_ISO_MESSAGE_SIZE) {
+                confirm (a, Result::N_ERROR);
+                return false;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+template <typename TraitsT>
+template <typename MessageT>
+bool TransportProtocol<TraitsT>::sendSingleFrame (const Address &a, MessageT const &msg)
+{
+        CanFrameWrapperType canFrame;
+
+        if (!AddressEncoderT::toFrame (a, canFrame)) {
+                errorHandler (Status::ADDRESS_ENCODE_ERROR);
+                return false;
+        }
+
+        constexpr size_t PCI = AddressTraitsT::N_PCI_OFSET;
+        size_t i = PCI + 1;
+
+        if (msg.size () <= AddressTraitsT::SHORT_SINGLE_FRAME_MAX_SIZE) {
+                canFrame.set (PCI, (int (IsoNPduType::SINGLE_FRAME) << 4) | (msg.size () & 0x0f));
+        }
+        else { // CAN FD escape sequence : SF_DL == 0 in the first byte, and the length in the next one.
+                canFrame.set (PCI, int (IsoNPduType::SINGLE_FRAME) << 4);
+                canFrame.set (i++, msg.size ());
+        }
+
+        for (uint8_t b : msg) {
+                canFrame.set (i++, b);
+        }
+
+        setFrameLength (canFrame, i);
+        // Single frames aren't retried : send returns false, and the caller can try again.
+        bool result = toOutputResult (outputInterface (canFrame.value ())) == OutputResult::SENT;
+
+        if (!result) {
+                confirm (a, Result::N_TIMEOUT_A);
+        }
+        else {
+                confirm (a, Result::N_OK);
+        }
+
+        return result;
+}
+
+/*****************************************************************************/
+
+/// Sets the DLC. CAN FD frames are padded up to the nearest valid length (see canFdLength).
+template <typename TraitsT> void TransportProtocol<TraitsT>::setFrameLength (CanFrameWrapperType &canFrame, size_t len)
+{
+        if constexpr (USING_FD) {
+                size_t padded = canFdLength (len);
+
+                for (size_t i = len; i < padded; ++i) {
+                        canFrame.set (i, FD_PADDING_BYTE);
+                }
+
+                len = padded;
+        }
+
+        canFrame.setDlc (len);
+}
+
+/*****************************************************************************/
+
+template <typename TraitsT> bool TransportProtocol<TraitsT>::sendMultipleFrames (PendingTransmission &&p)
+{
+        if (startOrQueue (p)) {
+                return true;
+        }
+
+        switch (txQueuePolicy) {
+        case TxQueuePolicy::DROP_OLDEST:
+                if (!txQueue.empty ()) {
+                        confirm (txQueue.front ().address, Result::N_TX_DROPPED);
+                        txQueue.popFront ();
+                        ++txQueueStatistics.dropped;
+                        return startOrQueue (p);
+                }
+                break;
+
+        case TxQueuePolicy::BLOCK: {
+                // Waiting is possible only in the caller's event loop, and not from inside of it.
+                if (txBlockHook.wait == nullptr || nesting > 0) {
+                        break;
+                }
+
+                NestingGuard guard (nesting);
+                Timer timer;
+                uint32_t timeoutUs = txQueueBlockTimeoutMs * US_PER_MS;
+                timer.start (timeoutUs, now ());
+
+                for (uint32_t nowUs = now (); !timer.isExpired (nowUs); nowUs = now ()) {
+                        uint32_t maxWaitUs = timeoutUs - timer.elapsed (nowUs);
+
+                        if (auto d = timeToNextDeadline ()) {
+                                maxWaitUs = std::min (maxWaitUs, *d);
+                        }
+
+                        txBlockHook.wait (txBlockHook.context, maxWaitUs);
+                        run ();
+
+                        if (startOrQueue (p)) {
+                                return true;
+                        }
+                }
+        } break;
+
+        default:
+                break;
+        }
+
+        ++txQueueStatistics.rejected;
+        return false;
+}
+
+/*****************************************************************************/
+
+/**
+ * Starts the transmission right away if possible, or puts the message into the queue.
+ * p is moved from only if true is returned.
+ */
+template <typename TraitsT> bool TransportProtocol<TraitsT>::startOrQueue (PendingTransmission &p)
+{
+        Address const &a = p.address;
+        bool queuedForPeer = false;
+
+        for (auto const &queued : txQueue) {
+                if (isSamePeer (queued.address, a)) {
+                        queuedForPeer = true;
+                        break;
+                }
+        }
+
+        // Messages to the same peer are sent in order.
+        if (!queuedForPeer) {
+                if (StateMachine *sm = findFreeStateMachine (a)) {
+                        sm->reset (std::move (p));
+                        return true;
+                }
+        }
+
+        if (txQueue.full ()) {
                 return false;
         }
 
-        stateMachine.reset (a, std::move (msg));
+        txQueue.push (std::move (p));
+        ++txQueueStatistics.queued;
+        txQueueStatistics.maxDepth = std::max (txQueueStatistics.maxDepth, txQueue.size ());
         return true;
 }
 
 /*****************************************************************************/
 
-template <typename TraitsT> bool TransportProtocol<TraitsT>::onCanNewFrame (const CanFrameWrapperType &frame)
+template <typename TraitsT> void TransportProtocol<TraitsT>::startQueued ()
 {
-        // Address as received in the CAN frame frame.
-        auto theirAddress = AddressEncoderT::fromFrame (frame);
+        for (auto i = txQueue.begin (); i != txQueue.end ();) {
+                if (StateMachine *sm = findFreeStateMachine (i->address)) {
+                        sm->reset (std::move (*i));
+                        i = txQueue.erase (i);
+                        continue;
+                }
+
+                ++i;
+        }
+}
+
+/*****************************************************************************/
+
+template <typename TraitsT> void TransportProtocol<TraitsT>::initStateMachines ()
+{
+        for (size_t i = 0; i < MAX_INTERLEAVED_TX_MESSAGES; ++i) {
+                stateMachines.emplace_back (*this, outputInterface);
+        }
+}
+
+/*****************************************************************************/
+
+template <typename TraitsT>
+typename TransportProtocol<TraitsT>::StateMachine const *TransportProtocol<TraitsT>::findStateMachine (Address const &peer) const
+{
+        for (auto const &sm : stateMachines) {
+                if (sm.getState () != StateMachine::State::DONE && isSamePeer (sm.getAddress (), peer)) {
+                        return &sm;
+                }
+        }
+
+        return nullptr;
+}
+
+/*****************************************************************************/
+
+template <typename TraitsT> bool TransportProtocol<TraitsT>::hasFreeStateMachine () const
+{
+        for (auto const &sm : stateMachines) {
+                if (sm.getState () == StateMachine::State::DONE) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/*****************************************************************************/
+
+/**
+ * Returns an idle state machine which can be used to send to the peer, or nullptr if there's
+ * none. Only one segmented message per peer is allowed, otherwise its flow control frames
+ * would be ambiguous.
+ */
+template <typename TraitsT>
+typename TransportProtocol<TraitsT>::StateMachine *TransportProtocol<TraitsT>::findFreeStateMachine (Address const &peer)
+{
+        StateMachine *freeStateMachine = nullptr;
+
+        for (auto &sm : stateMachines) {
+                if (sm.getState () == StateMachine::State::DONE) {
+                        if (freeStateMachine == nullptr) {
+                                freeStateMachine = &sm;
+                        }
+
+                        continue;
+                }
+
+                if (isSamePeer (sm.getAddress (), peer)) {
+                        return nullptr;
+                }
+        }
+
+        return freeStateMachine;
+}
+
+/*****************************************************************************/
+
+template <typename TraitsT>
+typename TransportProtocol<TraitsT>::StateMachine *TransportProtocol<TraitsT>::findStateMachineForFlowFrame (Key theirKey)
+{
+        for (auto &sm : stateMachines) {
+                if (sm.getState () != StateMachine::State::DONE && sm.matchesPeer (theirKey)) {
+                        return &sm;
+                }
+        }
+
+        return nullptr;
+}
+
+/*****************************************************************************/
+
+/// Removes a message being received along with its timer.
+template <typename TraitsT> void TransportProtocol<TraitsT>::eraseTransportMessage (Key k)
+{
+        if (TransportMessage *m = transportMessagesMap.find (k)) {
+                receiveTimers.cancel (transportMessagesMap.slotOf (m));
+                transportMessagesMap.erase (k);
+        }
+}
+
+/*****************************************************************************/
+
+template <typename TraitsT> bool TransportProtocol<TraitsT>::onCanNewFrame (const CanFrameWrapperType &frame, FrameBatch &batch)
+{
+        NestingGuard guard (nesting);
+
+        // Address as received in the CAN frame frame, in compact form. Full Address is decoded only when needed.
+        auto theirKey = AddressEncoderT::keyFromFrame (frame);
         Address const &outgoingAddress = myAddress;
 
+        // Valid only if this frame is the next one from the same sender. Set again below if the message continues.
+        TransportMessage *lastSession = (theirKey && batch.session != nullptr && batch.sessionKey == *theirKey) ? (batch.session) : (nullptr);
+        batch.session = nullptr;
+
+        if (!theirKey) {
+                return false;
+        }
+
+        IsoNPduType type = AddressTraitsT::getType (frame);
+
+        // Flow control frames are routed to the transmission they refer to. It can be addressed to any peer, not only myAddress.
+        if (type == IsoNPduType::FLOW_FRAME) {
+                StateMachine *stateMachine = findStateMachineForFlowFrame (*theirKey);
+
+                if (stateMachine == nullptr) {
+                        return false;
+                }
+
+                if (Status s = stateMachine->run (now (batch), &frame); s != Status::OK) {
+                        errorHandler (s);
+                }
+
+                return false;
+        }
+
         // Check if the received frame is meant for us.
-        if (!theirAddress || !AddressEncoderT::matches (*theirAddress, myAddress)) {
+        if ((*theirKey & AddressEncoderT::LOCAL_KEY_MASK) != myKey) {
                 return false;
         }
 
-        switch (AddressTraitsT::getType (frame)) {
+        switch (type) {
         case IsoNPduType::SINGLE_FRAME: {
-                TransportMessage message;
+                TransportMessage &message = singleFrameMessage;
                 int singleFrameLen = AddressTraitsT::getDataLengthS (frame);
+                uint8_t dataOffset = AddressTraitsT::N_PCI_OFSET + 1;
+
+                if (USING_FD && singleFrameLen == 0 && frame.getDlc () > 8) {
+                        // CAN FD escape sequence : the length is in the next byte.
+                        singleFrameLen = frame.get (dataOffset++);
 
+                        if (singleFrameLen <= 0 || singleFrameLen > frame.getDlc () - dataOffset) {
+                                return false;
+                        }
+                }
                 // Error situation. Such frames should be ignored according to 6.5.2.2 page 24.
-                if (singleFrameLen <= 0 || (AddressTraitsT::USING_EXTENDED && singleFrameLen > 6) || singleFrameLen > 7) {
+                else if (singleFrameLen <= 0 || singleFrameLen > int (AddressTraitsT::SHORT_SINGLE_FRAME_MAX_SIZE)) {
                         return false;
                 }
 
-                auto iter = transportMessagesMap.find (*theirAddress);
-
-                if (iter != transportMessagesMap.cend ()) { // found
+                if (transportMessagesMap.find (*theirKey) != nullptr) { // found
                         // As in 6.7.3 Table 18
-                        indication (*theirAddress, {}, Result::N_UNEXP_PDU);
+                        indication (AddressEncoderT::fromKey (*theirKey), {}, Result::N_UNEXP_PDU, now (batch));
                         // Terminate the current reception of segmented message.
-                        transportMessagesMap.erase (iter);
+                        eraseTransportMessage (*theirKey);
                         break;
                 }
 
-                uint8_t dataOffset = AddressTraitsT::N_PCI_OFSET + 1;
-                message.append (frame, dataOffset, singleFrameLen);
-                indication (*theirAddress, message.data, Result::N_OK);
+                if (!STREAMING_RECEIVE && !reserve (message, singleFrameLen)) {
+                        return false;
+                }
+
+                receivePayload (*theirKey, message, frame, dataOffset, singleFrameLen);
+                indication (AddressEncoderT::fromKey (*theirKey), std::move (message.data), Result::N_OK, now (batch));
+                message.clear ();
         } break;
 
         case IsoNPduType::FIRST_FRAME: {
-                uint16_t multiFrameRemainingLen = AddressTraitsT::getDataLengthF (frame);
+                uint32_t multiFrameRemainingLen = AddressTraitsT::getDataLengthF (frame);
+                bool escaped = false;
 
-                // Error situation. Such frames should be ignored according to ISO.
-                if (multiFrameRemainingLen < 8 || (AddressTraitsT::USING_EXTENDED && multiFrameRemainingLen < 7)) {
+                // FF_DL escape sequence (ISO 15765-2:2016) : the 12 bit FF_DL is 0, and the length follows in 4 bytes.
+                if (multiFrameRemainingLen == 0) {
+                        multiFrameRemainingLen = AddressTraitsT::getDataLengthF32 (frame);
+                        escaped = true;
+
+                        // Only messages which don't fit the 12 bits can be sent this way.
+                        if (multiFrameRemainingLen <= uint32_t (MAX_ALLOWED_ISO_MESSAGE_SIZE)) {
+                                return false;
+                        }
+                }
+
+                // RX_DL. CAN FD peers choose the frame length, and their Consecutive Frames are as long as the First one.
+                size_t rxDl = 8;
+
+                if constexpr (USING_FD) {
+                        rxDl = frame.getDlc ();
+
+                        if (rxDl < 8 || rxDl > TX_DL || canFdLength (rxDl) != rxDl) {
+                                return false;
+                        }
+                }
+
+                // Error situation (the message would fit in a Single Frame). Such frames should be ignored according to ISO.
+                if (multiFrameRemainingLen <= AddressTraitsT::singleFrameMaxSize (rxDl)) {
                         return false;
                 }
 
                 // 6.5.3.3 Error situation : too much data. Should reply with appropriate flow control frame.
-                if (multiFrameRemainingLen > MAX_ACCEPTED_ISO_MESSAGE_SIZE || multiFrameRemainingLen > MAX_ALLOWED_ISO_MESSAGE_SIZE) {
+                // In the streaming mode messages are not stored, so the size of IsoMessageT doesn't matter.
+                if (!STREAMING_RECEIVE && multiFrameRemainingLen > MAX_ACCEPTED_ISO_MESSAGE_SIZE) {
                         sendFlowFrame (outgoingAddress, FlowStatus::OVERFLOWED);
                         return false;
                 }
 
                 // incomingAddress Should be used (as a key)!
-                auto iter = transportMessagesMap.find (*theirAddress);
-
-                if (iter != transportMessagesMap.cend ()) {
+                if (transportMessagesMap.find (*theirKey) != nullptr) {
                         // As in 6.7.3 Table 18
-                        indication (*theirAddress, {}, Result::N_UNEXP_PDU);
+                        indication (AddressEncoderT::fromKey (*theirKey), {}, Result::N_UNEXP_PDU, now (batch));
                         // Terminate the current reception of segmented message.
-                        transportMessagesMap.erase (iter);
+                        eraseTransportMessage (*theirKey);
                 }
 
-                int firstFrameLen = (AddressTraitsT::USING_EXTENDED) ? (5) : (6);
+                uint32_t firstFrameLen = AddressTraitsT::firstFrameMaxSize (rxDl, escaped);
 
-                if (transportMessagesMap.full ()) {
-                        indication (*theirAddress, {}, Result::N_MESSAGE_NUM_MAX);
+                TransportMessage *newMessage = transportMessagesMap.insert (*theirKey);
+
+                if (newMessage == nullptr) {
+                        indication (AddressEncoderT::fromKey (*theirKey), {}, Result::N_MESSAGE_NUM_MAX, now (batch));
                         return false;
                 }
 
-                auto &isoMessage = transportMessagesMap[*theirAddress];
+                auto &isoMessage = *newMessage;
 
-                firstFrameIndication (*theirAddress, multiFrameRemainingLen);
+                // Whole message at once, instead of growing while consecutive frames arrive.
+                if (!STREAMING_RECEIVE && !reserve (isoMessage, multiFrameRemainingLen)) {
+                        // No memory (i.e. the BufferPool is exhausted) : as if the message was too long.
+                        eraseTransportMessage (*theirKey);
+                        sendFlowFrame (outgoingAddress, FlowStatus::OVERFLOWED);
+                        return false;
+                }
+
+                firstFrameIndication (AddressEncoderT::fromKey (*theirKey), multiFrameRemainingLen, now (batch));
 
                 isoMessage.currentSn = 1;
+                isoMessage.rxDl = rxDl;
                 isoMessage.multiFrameRemainingLen = multiFrameRemainingLen - firstFrameLen;
-                isoMessage.timer.start (N_BS_TIMEOUT);
+                receiveTimers.schedule (transportMessagesMap.slotOf (newMessage), now (batch) + N_BS_TIMEOUT * US_PER_MS);
                 isoMessage.timeoutReason = Result::N_TIMEOUT_BS;
-                uint8_t dataOffset = AddressTraitsT::N_PCI_OFSET + 2;
-                isoMessage.append (frame, dataOffset, firstFrameLen);
+
+                receivePayload (*theirKey, isoMessage, frame, AddressTraitsT::firstFrameDataOffset (escaped), firstFrameLen);
 
                 // Send Flow Control
                 if (!sendFlowFrame (outgoingAddress, FlowStatus::CONTINUE_TO_SEND)) {
-                        indication (*theirAddress, {}, Result::N_ERROR);
+                        indication (AddressEncoderT::fromKey (*theirKey), {}, Result::N_ERROR, now (batch));
                         // Terminate the current reception of segmented message.
-                        transportMessagesMap.erase (transportMessagesMap.find (*theirAddress));
+                        eraseTransportMessage (*theirKey);
                 }
 
                 return true;
         } break;
 
         case IsoNPduType::CONSECUTIVE_FRAME: {
-                auto iter = transportMessagesMap.find (*theirAddress);
+                TransportMessage *found = (lastSession != nullptr) ? (lastSession) : (transportMessagesMap.find (*theirKey));
 
-                if (iter == transportMessagesMap.cend ()) {
+                if (found == nullptr) {
                         // As in 6.7.3 Table 18 - ignore
                         return false;
                 }
 
-                auto &transportMessage = iter->second;
-                transportMessage.timer.start (N_CR_TIMEOUT);
+                auto &transportMessage = *found;
+                receiveTimers.schedule (transportMessagesMap.slotOf (found), now (batch) + N_CR_TIMEOUT * US_PER_MS);
                 transportMessage.timeoutReason = Result::N_TIMEOUT_CR;
 
                 if (AddressTraitsT::getSerialNumber (frame) != transportMessage.currentSn) {
                         // 6.5.4.3 SN error handling
-                        indication (*theirAddress, {}, Result::N_WRONG_SN);
+                        indication (AddressEncoderT::fromKey (*theirKey), {}, Result::N_WRONG_SN, now (batch));
                         return false;
                 }
 
                 ++(transportMessage.currentSn);
                 transportMessage.currentSn %= 16;
-                int maxConsecutiveFrameLen = (AddressTraitsT::USING_EXTENDED) ? (6) : (7);
-                int consecutiveFrameLen = std::min (maxConsecutiveFrameLen, transportMessage.multiFrameRemainingLen);
+                uint32_t maxConsecutiveFrameLen = AddressTraitsT::consecutiveFrameMaxSize (transportMessage.rxDl);
+                uint32_t consecutiveFrameLen = std::min (maxConsecutiveFrameLen, transportMessage.multiFrameRemainingLen);
                 transportMessage.multiFrameRemainingLen -= consecutiveFrameLen;
 #if 0                
                 fmt::print ("Bytes left : {}\n", isoMessage->multiFrameRemainingLen);
 #endif
 
-                uint8_t dataOffset = AddressTraitsT::N_PCI_OFSET + 1;
-                transportMessage.append (frame, dataOffset, consecutiveFrameLen);
+                receivePayload (*theirKey, transportMessage, frame, AddressTraitsT::CONSECUTIVE_FRAME_DATA_OFFSET, consecutiveFrameLen);
 
                 // Send flow control frame.
                 if (blockSize > 0 && ++transportMessage.consecutiveFramesReceived >= blockSize) {
                         transportMessage.consecutiveFramesReceived = 0;
 
                         if (!sendFlowFrame (outgoingAddress, FlowStatus::CONTINUE_TO_SEND)) {
-                                indication (*theirAddress, {}, Result::N_ERROR);
+                                indication (AddressEncoderT::fromKey (*theirKey), {}, Result::N_ERROR, now (batch));
                                 // Terminate the current reception of segmented message.
-                                transportMessagesMap.erase (transportMessagesMap.find (*theirAddress));
+                                eraseTransportMessage (*theirKey);
+                                return false;
                         }
                 }
 
                 if (transportMessage.multiFrameRemainingLen) {
+                        batch.sessionKey = *theirKey;
+                        batch.session = found;
                         return true;
                 }
 
-                indication (*theirAddress, transportMessage.data, Result::N_OK);
-                transportMessagesMap.erase (iter);
-
-        } break;
-
-        case IsoNPduType::FLOW_FRAME: {
-                if (Status s = stateMachine.run (&frame); s != Status::OK) {
-                        errorHandler (s);
-                        return false;
-                }
+                indication (AddressEncoderT::fromKey (*theirKey), std::move (transportMessage.data), Result::N_OK, now (batch));
+                eraseTransportMessage (*theirKey);
 
         } break;
 
@@ -690,26 +1583,75 @@ template <typename TraitsT> bool TransportProtocol<TraitsT>::onCanNewFrame (cons
 
 template <typename TraitsT> void TransportProtocol<TraitsT>::run ()
 {
+        NestingGuard guard (nesting);
+
+        // The clock is read once, and only the expired timers are visited.
+        uint32_t nowUs = now ();
+
         // Check for timeouts between CAN frames while receiving.
-        for (auto i = transportMessagesMap.begin (); i != transportMessagesMap.end ();) {
-                auto &tpMsg = i->second;
-
-                if (tpMsg.timer.isExpired ()) {
-                        indication (i->first, {}, i->second.timeoutReason);
-                        auto j = i;
-                        ++i;
-                        transportMessagesMap.erase (j);
-                        continue;
+        receiveTimers.expire (nowUs, [this, nowUs] (auto slot) {
+                Key k = transportMessagesMap.keyAt (slot);
+                indication (AddressEncoderT::fromKey (k), {}, transportMessagesMap.valueAt (slot).timeoutReason, nowUs);
+                transportMessagesMap.erase (k);
+        });
+
+        // Messages from the queue take the state machines which got free.
+        startQueued ();
+
+        // Run state machines if any to perform transmission.
+        for (auto &sm : stateMachines) {
+                if (Status s = sm.run (nowUs); s != Status::OK) {
+                        errorHandler (s);
                 }
+        }
+}
 
-                ++i;
+/*****************************************************************************/
+
+template <typename TraitsT> etl::optional<uint32_t> TransportProtocol<TraitsT>::nextDeadline (uint32_t nowUs) const
+{
+        etl::optional<uint32_t> deadline;
+
+        auto consider = [&deadline] (uint32_t d) {
+                // Wrap around safe d < *deadline.
+                if (!deadline || int32_t (d - *deadline) < 0) {
+                        deadline = d;
+                }
+        };
+
+        if (!receiveTimers.empty ()) {
+                consider (receiveTimers.nextDeadline ());
         }
 
-        // Run state machine(s) if any to perform transmission.
-        if (Status s = stateMachine.run (); s != Status::OK) {
-                errorHandler (s);
-                return;
+        for (auto const &sm : stateMachines) {
+                if (auto d = sm.nextDeadline (nowUs)) {
+                        consider (*d);
+                }
         }
+
+        // Queued messages are started by run as soon as there's a state machine for them.
+        if (hasFreeStateMachine ()) {
+                for (auto const &p : txQueue) {
+                        if (findStateMachine (p.address) == nullptr) {
+                                consider (nowUs);
+                                break;
+                        }
+                }
+        }
+
+        return deadline;
+}
+
+/*****************************************************************************/
+
+/// Makes room for len bytes of a message being received, in this protocol's pool if the messages are pooled.
+template <typename TraitsT> bool TransportProtocol<TraitsT>::reserve (TransportMessage &m, size_t len)
+{
+        if constexpr (POOLED_MESSAGES) {
+                m.data.setPool (bufferPool);
+        }
+
+        return m.reserve (len);
 }
 
 /*****************************************************************************/
@@ -726,9 +1668,9 @@ template <typename TraitsT> bool TransportProtocol<TraitsT>::sendFlowFrame (Addr
         fcCanFrame.set (AddressTraitsT::N_PCI_OFSET + 0, (uint8_t (IsoNPduType::FLOW_FRAME) << 4) | uint8_t (fs));
         fcCanFrame.set (AddressTraitsT::N_PCI_OFSET + 1, blockSize);      // BS
         fcCanFrame.set (AddressTraitsT::N_PCI_OFSET + 2, separationTime); // Stmin
-        fcCanFrame.setDlc (3 + AddressTraitsT::N_PCI_OFSET);
+        fcCanFrame.setDlc (AddressTraitsT::FLOW_CONTROL_FRAME_SIZE);
 
-        if (!outputInterface (fcCanFrame.value ())) {
+        if (toOutputResult (outputInterface (fcCanFrame.value ())) != OutputResult::SENT) {
                 errorHandler (Status::SEND_FAILED);
                 return false;
         }
@@ -738,11 +1680,49 @@ template <typename TraitsT> bool TransportProtocol<TraitsT>::sendFlowFrame (Addr
 
 /*****************************************************************************/
 
+/**
+ * Stores len bytes of the frame's payload (starting at offset) in the message or, in the
+ * streaming mode, passes them to callback.onChunk right away.
+ */
+template <typename TraitsT>
+void TransportProtocol<TraitsT>::receivePayload (Key k, TransportMessage &m, CanFrameWrapperType const &frame, size_t offset, size_t len)
+{
+        if constexpr (STREAMING_RECEIVE) {
+                if constexpr (HasFrameData<CanFrameWrapperType>::value) {
+                        callback.onChunk (AddressEncoderT::fromKey (k), m.bytesReceived, etl::span<uint8_t const> (frame.data () + offset, len));
+                }
+                else {
+                        etl::array<uint8_t, TX_DL> chunk{};
+
+                        for (size_t i = 0; i < len; ++i) {
+                                chunk[i] = frame.get (i + offset);
+                        }
+
+                        callback.onChunk (AddressEncoderT::fromKey (k), m.bytesReceived, etl::span<uint8_t const> (chunk.data (), len));
+                }
+
+                m.bytesReceived += len;
+        }
+        else {
+                m.append (frame, offset, len);
+        }
+}
+
+/*****************************************************************************/
+
 template <typename TraitsT>
 int TransportProtocol<TraitsT>::TransportMessage::append (CanFrameWrapperType const &frame, size_t offset, size_t len)
 {
-        for (size_t inputIndex = 0; inputIndex < len; ++inputIndex) {
-                data.insert (data.end (), frame.get (inputIndex + offset));
+        if constexpr (HasFrameData<CanFrameWrapperType>::value && HasRangeInsert<IsoMessageT>::value) {
+                // One bounded copy per frame.
+                Expects (offset + len <= TX_DL);
+                uint8_t const *first = frame.data () + offset;
+                data.insert (data.end (), first, first + len);
+        }
+        else {
+                for (size_t inputIndex = 0; inputIndex < len; ++inputIndex) {
+                        data.insert (data.end (), frame.get (inputIndex + offset));
+                }
         }
 
         return len;
@@ -750,13 +1730,102 @@ int TransportProtocol<TraitsT>::TransportMessage::append (CanFrameWrapperType co
 
 /*****************************************************************************/
 
-template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::run (CanFrameWrapperType const *frame)
+template <typename TraitsT> size_t TransportProtocol<TraitsT>::StateMachine::payloadSize () const
+{
+        switch (source) {
+        case PayloadSource::BORROWED:
+                return borrowed.size ();
+
+        case PayloadSource::PRODUCED:
+                return producer.size;
+
+        default:
+                return message.size ();
+        }
+}
+
+/*****************************************************************************/
+
+/**
+ * Puts len bytes of the message, starting at bytesSent, into the canFrame at frameOffset.
+ * Returns false if the producer didn't deliver them. The producer is asked only for bytes
+ * it hasn't delivered yet, so it sees every offset once and in order, even if frames
+ * have to be sent again (see frameNotSent).
+ */
+template <typename TraitsT>
+bool TransportProtocol<TraitsT>::StateMachine::writePayload (CanFrameWrapperType &canFrame, size_t frameOffset, size_t len)
+{
+        switch (source) {
+        case PayloadSource::BORROWED:
+                for (size_t i = 0; i < len; ++i) {
+                        canFrame.set (i + frameOffset, borrowed[i + bytesSent]);
+                }
+                break;
+
+        case PayloadSource::PRODUCED: {
+                size_t offset = bytesSent - producedFrom;
+
+                if (size_t have = produced.size () - offset; have < len) {
+                        size_t missing = len - have;
+                        produced.resize (produced.size () + missing);
+
+                        if (producer.read (producer.context, bytesSent + have, etl::span<uint8_t> (produced.data () + produced.size () - missing, missing))
+                            != missing) {
+                                return false;
+                        }
+                }
+
+                for (size_t i = 0; i < len; ++i) {
+                        canFrame.set (i + frameOffset, produced[offset + i]);
+                }
+        } break;
+
+        default:
+                for (size_t i = 0; i < len; ++i) {
+                        canFrame.set (i + frameOffset, message.at (i + bytesSent));
+                }
+                break;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+/// Frames up to bytesSent were taken by the output interface, so their bytes from the producer aren't needed anymore.
+template <typename TraitsT> void TransportProtocol<TraitsT>::StateMachine::dropAcceptedPayload ()
+{
+        size_t n = std::min (bytesSent - producedFrom, produced.size ());
+        std::copy (produced.begin () + n, produced.end (), produced.begin ());
+        produced.resize (produced.size () - n);
+        producedFrom = bytesSent;
+}
+
+/*****************************************************************************/
+
+template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::run (uint32_t nowUs, CanFrameWrapperType const *frame)
 {
         if (state == State::DONE) {
+                // The message isn't needed anymore. This gives the memory back if it's pooled.
+                message.clear ();
+                source = PayloadSource::OWNED;
+                borrowed = {};
+                producer = {};
+                produced.clear ();
                 return Status::OK;
         }
 
-        if (state != State::IDLE && state != State::SEND_FIRST_FRAME && bsCrTimer.isExpired ()) {
+        // Time doesn't go back for the timers : a flow control frame with a timestamp (skewed, or
+        // reordered) earlier than the timers were started counts as received just now.
+        if (lastRunUs && int32_t (nowUs - *lastRunUs) < 0) {
+                nowUs = *lastRunUs;
+        }
+        else {
+                lastRunUs = nowUs;
+        }
+
+        // While the output interface asks to retry, N_As applies instead (see frameNotSent).
+        if (state != State::IDLE && state != State::SEND_FIRST_FRAME && !retrying && bsCrTimer.isExpired (nowUs)) {
                 if (state == State::RECEIVE_BS_FLOW_CONTROL_FRAME || state == State::RECEIVE_FIRST_FLOW_CONTROL_FRAME) {
                         tp.confirm (myAddress, Result::N_TIMEOUT_BS);
                 }
@@ -767,8 +1836,7 @@ template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::run
                 state = State::DONE;
         }
 
-        IsoMessageT const &message = this->message;
-        uint16_t isoMessageSize = message.size ();
+        size_t isoMessageSize = payloadSize ();
         using Traits = AddressTraits<AddressEncoderT>;
 
         switch (state) {
@@ -777,37 +1845,59 @@ template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::run
                 break;
 
         case State::SEND_FIRST_FRAME: {
+                if (!separationTimer.isExpired (nowUs)) { // Retry interval.
+                        break;
+                }
 
-                CanFrameWrapperType canFrame (0x00, false, (int (IsoNPduType::FIRST_FRAME) << 4) | (isoMessageSize & 0xf00) >> 8,
-                                              (isoMessageSize & 0x0ff));
+                CanFrameWrapperType canFrame;
 
                 if (!AddressEncoderT::toFrame (myAddress, canFrame)) {
                         return Status::ADDRESS_ENCODE_ERROR;
                 }
 
-                int toSend = std::min<int> (isoMessageSize, 6);
+                constexpr size_t PCI = Traits::N_PCI_OFSET;
+                bool escaped = isoMessageSize > size_t (MAX_ALLOWED_ISO_MESSAGE_SIZE);
 
-                for (int i = 0; i < toSend; ++i) {
-                        canFrame.set (i + 2, message.at (i));
+                if (!escaped) {
+                        canFrame.set (PCI, (int (IsoNPduType::FIRST_FRAME) << 4) | (isoMessageSize & 0xf00) >> 8);
+                        canFrame.set (PCI + 1, isoMessageSize & 0x0ff);
+                }
+                else { // FF_DL escape sequence : 0 in the 12 bits, and 32 bit length (big endian) after that.
+                        canFrame.set (PCI, int (IsoNPduType::FIRST_FRAME) << 4);
+                        canFrame.set (PCI + 1, 0);
+
+                        for (size_t i = 0; i < 4; ++i) {
+                                canFrame.set (PCI + 2 + i, (isoMessageSize >> (24 - 8 * i)) & 0xff);
+                        }
                 }
 
-                canFrame.setDlc (2 + toSend);
+                size_t dataOffset = Traits::firstFrameDataOffset (escaped);
+                size_t toSend = std::min<size_t> (
+                        isoMessageSize, (escaped) ? (TxGeometry::ESCAPED_FIRST_FRAME_MAX_SIZE) : (TxGeometry::FIRST_FRAME_MAX_SIZE));
 
-                if (!outputInterface (canFrame.value ())) {
-                        tp.confirm (myAddress, Result::N_TIMEOUT_A); // TODO is it correct Result::?
+                if (!writePayload (canFrame, dataOffset, toSend)) {
+                        tp.confirm (myAddress, Result::N_ERROR);
                         state = State::DONE;
                         break;
                 }
 
+                setFrameLength (canFrame, dataOffset + toSend);
+
+                if (OutputResult r = toOutputResult (outputInterface (canFrame.value ())); r != OutputResult::SENT) {
+                        frameNotSent (nowUs, r);
+                        break;
+                }
+
+                retrying = false;
                 tp.confirm (myAddress, Result::N_OK);
                 state = State::RECEIVE_FIRST_FLOW_CONTROL_FRAME;
                 bytesSent += toSend;
-                bsCrTimer.start (N_BS_TIMEOUT);
+                bsCrTimer.start (N_BS_TIMEOUT * US_PER_MS, nowUs);
         } break;
 
         case State::RECEIVE_BS_FLOW_CONTROL_FRAME:
         case State::RECEIVE_FIRST_FLOW_CONTROL_FRAME: {
-                if (!separationTimer.isExpired ()) {
+                if (!separationTimer.isExpired (nowUs)) {
                         break;
                 }
 
@@ -816,9 +1906,9 @@ template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::run
                 }
 
                 // Address as received in the CAN frame.
-                auto theirAddress = AddressEncoderT::fromFrame (*frame);
+                auto theirKey = AddressEncoderT::keyFromFrame (*frame);
 
-                if (!theirAddress || !AddressEncoderT::matches (*theirAddress, myAddress)) {
+                if (!theirKey || !matchesPeer (*theirKey)) {
                         break;
                 }
 
@@ -831,22 +1921,22 @@ template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::run
                 FlowStatus fs = Traits::getFlowStatus (*frame);
 
                 if (fs != FlowStatus::CONTINUE_TO_SEND && fs != FlowStatus::WAIT && fs != FlowStatus::OVERFLOWED) {
-                        tp.confirm (*theirAddress, Result::N_INVALID_FS); // 6.5.5.3
-                        state = State::DONE;                              // abort
+                        tp.confirm (AddressEncoderT::fromKey (*theirKey), Result::N_INVALID_FS); // 6.5.5.3
+                        state = State::DONE;                                                     // abort
                 }
 
                 if (fs == FlowStatus::OVERFLOWED) {
-                        tp.confirm (*theirAddress, Result::N_BUFFER_OVFLW);
+                        tp.confirm (AddressEncoderT::fromKey (*theirKey), Result::N_BUFFER_OVFLW);
                         state = State::DONE; // abort
                 }
 
                 if (fs == FlowStatus::WAIT) {
-                        bsCrTimer.start (N_BS_TIMEOUT);
+                        bsCrTimer.start (N_BS_TIMEOUT * US_PER_MS, nowUs);
                         ++waitFrameNumber;
 
                         if (waitFrameNumber >= MAX_WAIT_FRAME_NUMBER) { // In case of MAX_WAIT_FRAME_NUMBER == 0 message will be aborted
                                                                         // immediately, which is fine according to the ISO.
-                                tp.confirm (*theirAddress, Result::N_WFT_OVRN);
+                                tp.confirm (AddressEncoderT::fromKey (*theirKey), Result::N_WFT_OVRN);
                                 state = State::DONE; // abort
                         }
 
@@ -854,8 +1944,8 @@ template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::run
                 }
 
                 if (state == State::RECEIVE_FIRST_FLOW_CONTROL_FRAME) {
-                        receivedBlockSize = frame->get (1); // 6.5.5.4 page 21
-                        receivedSeparationTimeUs = frame->get (2);
+                        receivedBlockSize = Traits::getBlockSize (*frame); // 6.5.5.4 page 21
+                        receivedSeparationTimeUs = Traits::getSeparationTime (*frame);
 
                         if (receivedSeparationTimeUs >= 0 && receivedSeparationTimeUs <= 0x7f) {
                                 receivedSeparationTimeUs *= 1000; // Convert to µs
@@ -869,63 +1959,222 @@ template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::run
                 }
 
                 waitFrameNumber = 0;
-                separationTimer.start (0); // Separation timer is started later with proper timeout calculated here.
+                separationTimer.start (0, nowUs); // Separation timer is started later with proper timeout calculated here.
                 state = State::SEND_CONSECUTIVE_FRAME;
-                bsCrTimer.start (N_CR_TIMEOUT);
+                bsCrTimer.start (N_CR_TIMEOUT * US_PER_MS, nowUs);
         } break;
 
-        case State::SEND_CONSECUTIVE_FRAME: {
-                if (!separationTimer.isExpired ()) {
-                        break;
+        case State::SEND_CONSECUTIVE_FRAME:
+                return sendConsecutiveFrames (nowUs, isoMessageSize);
+
+        default:
+                break;
+        }
+
+        return Status::OK;
+}
+
+/*****************************************************************************/
+
+/**
+ * Sends as many Consecutive Frames as STmin, BS, maxBurst and the output interface (see
+ * txCapacity) allow. A batched output interface gets them all at once.
+ */
+template <typename TraitsT> Status TransportProtocol<TraitsT>::StateMachine::sendConsecutiveFrames (uint32_t nowUs, size_t isoMessageSize)
+{
+        size_t limit = tp.maxBurst;
+
+        if constexpr (HasTxCapacity<CanOutputInterface>::value) {
+                limit = std::min<size_t> (limit, outputInterface.txCapacity ());
+
+                // No room at all : checked again after the retry interval, as if the output interface asked for a retry.
+                if (limit == 0) {
+                        if (separationTimer.isExpired (nowUs)) {
+                                frameNotSent (nowUs, OutputResult::RETRY);
+                        }
+
+                        return Status::OK;
                 }
+        }
 
-                CanFrameWrapperType canFrame (0x00, true, (int (IsoNPduType::CONSECUTIVE_FRAME) << 4) | sequenceNumber);
+        if constexpr (HasBatchedOutput<CanOutputInterface>::value) {
+                etl::vector<CanFrame, MAX_TX_BATCH_SIZE> batch;
+                etl::vector<Progress, MAX_TX_BATCH_SIZE> before;
+                limit = std::min<size_t> (limit, MAX_TX_BATCH_SIZE);
+                dropAcceptedPayload ();
 
-                if (!AddressEncoderT::toFrame (myAddress, canFrame)) {
-                        return Status::ADDRESS_ENCODE_ERROR;
+                while (batch.size () < limit && state == State::SEND_CONSECUTIVE_FRAME && separationTimer.isExpired (nowUs)) {
+                        CanFrameWrapperType canFrame;
+                        size_t toSend{};
+                        Progress p = progress ();
+
+                        if (Status s = buildConsecutiveFrame (canFrame, isoMessageSize, toSend); s != Status::OK || state == State::DONE) {
+                                return s; // Nothing is sent if the message can't be completed.
+                        }
+
+                        batch.push_back (canFrame.value ());
+                        before.push_back (p);
+                        consecutiveFrameSent (nowUs, toSend, isoMessageSize);
                 }
 
-                ++sequenceNumber;
-                sequenceNumber %= 16;
+                if (batch.empty ()) {
+                        return Status::OK;
+                }
+
+                // Frames which weren't accepted are sent again later, starting from the first of them (unless they failed).
+                if (BatchOutputResult r = toBatchOutputResult (outputInterface.sendBatch (etl::span<CanFrame const> (batch.data (), batch.size ())));
+                    r.accepted < batch.size ()) {
+                        size_t accepted = r.accepted;
+                        Progress const &p = before[accepted];
+                        state = p.state;
+                        bytesSent = p.bytesSent;
+                        blocksSent = p.blocksSent;
+                        sequenceNumber = p.sequenceNumber;
+                        separationTimer = p.separationTimer;
+                        bsCrTimer = p.bsCrTimer;
+
+                        if (accepted > 0) {
+                                retrying = false; // Progress was made, so N_As starts anew.
+                        }
 
-                int toSend = std::min<int> (isoMessageSize - bytesSent, 7);
-                for (int i = 0; i < toSend; ++i) {
-                        canFrame.set (i + 1, message.at (i + bytesSent));
+                        frameNotSent (nowUs, (r.rest == OutputResult::FAILED) ? (OutputResult::FAILED) : (OutputResult::RETRY));
                 }
+                else {
+                        retrying = false;
+                }
+        }
+        else {
+                for (size_t i = 0; i < limit && state == State::SEND_CONSECUTIVE_FRAME && separationTimer.isExpired (nowUs); ++i) {
+                        CanFrameWrapperType canFrame;
+                        size_t toSend{};
+                        dropAcceptedPayload ();
 
-                canFrame.setDlc (1 + toSend);
+                        if (Status s = buildConsecutiveFrame (canFrame, isoMessageSize, toSend); s != Status::OK || state == State::DONE) {
+                                return s;
+                        }
 
-                if (!outputInterface (canFrame.value ())) {
-                        tp.confirm (myAddress, Result::N_TIMEOUT_A);
-                        state = State::DONE;
-                        break;
+                        if (OutputResult r = toOutputResult (outputInterface (canFrame.value ())); r != OutputResult::SENT) {
+                                frameNotSent (nowUs, r);
+                                break;
+                        }
+
+                        retrying = false;
+                        consecutiveFrameSent (nowUs, toSend, isoMessageSize);
                 }
+        }
 
-                bytesSent += toSend;
+        return Status::OK;
+}
 
-                if (bytesSent >= message.size ()) {
-                        state = State::DONE;
-                        break;
+/*****************************************************************************/
+
+/// Puts the next Consecutive Frame (toSend bytes of the payload) into canFrame. The transmission is aborted (DONE) if the producer fails.
+template <typename TraitsT>
+Status TransportProtocol<TraitsT>::StateMachine::buildConsecutiveFrame (CanFrameWrapperType &canFrame, size_t isoMessageSize, size_t &toSend)
+{
+        using Traits = AddressTraits<AddressEncoderT>;
+
+        if (!AddressEncoderT::toFrame (myAddress, canFrame)) {
+                return Status::ADDRESS_ENCODE_ERROR;
+        }
+
+        canFrame.set (Traits::N_PCI_OFSET, (int (IsoNPduType::CONSECUTIVE_FRAME) << 4) | sequenceNumber);
+        toSend = std::min<size_t> (isoMessageSize - bytesSent, TxGeometry::CONSECUTIVE_FRAME_MAX_SIZE);
+
+        if (!writePayload (canFrame, Traits::CONSECUTIVE_FRAME_DATA_OFFSET, toSend)) {
+                tp.confirm (myAddress, Result::N_ERROR);
+                state = State::DONE;
+                return Status::OK;
+        }
+
+        setFrameLength (canFrame, Traits::CONSECUTIVE_FRAME_DATA_OFFSET + toSend);
+        return Status::OK;
+}
+
+/*****************************************************************************/
+
+/// Moves past a Consecutive Frame which was sent : to the next one, the flow control frame which ends a block, or DONE.
+template <typename TraitsT>
+void TransportProtocol<TraitsT>::StateMachine::consecutiveFrameSent (uint32_t nowUs, size_t toSend, size_t isoMessageSize)
+{
+        ++sequenceNumber;
+        sequenceNumber %= 16;
+        bytesSent += toSend;
+
+        if (bytesSent >= isoMessageSize) {
+                state = State::DONE;
+                return;
+        }
+
+        if (receivedBlockSize && ++blocksSent >= receivedBlockSize) {
+                blocksSent = 0;
+                state = State::RECEIVE_BS_FLOW_CONTROL_FRAME;
+                bsCrTimer.start (N_BS_TIMEOUT * US_PER_MS, nowUs);
+                return;
+        }
+
+        separationTimer.start (receivedSeparationTimeUs, nowUs);
+        bsCrTimer.start (N_CR_TIMEOUT * US_PER_MS, nowUs);
+}
+
+/*****************************************************************************/
+
+/**
+ * The output interface didn't take a frame (First or Consecutive). It's sent again after
+ * TX_RETRY_INTERVAL_US if the interface asked for it, unless it keeps asking for longer
+ * than N_As. Returns true if it's going to be retried, and false if the transmission
+ * was aborted.
+ */
+template <typename TraitsT> bool TransportProtocol<TraitsT>::StateMachine::frameNotSent (uint32_t nowUs, OutputResult r)
+{
+        if (r == OutputResult::RETRY) {
+                if (!retrying) {
+                        retrying = true;
+                        nAsTimer.start (N_A_TIMEOUT * US_PER_MS, nowUs);
                 }
 
-                if (receivedBlockSize && ++blocksSent >= receivedBlockSize) {
-                        state = State::RECEIVE_BS_FLOW_CONTROL_FRAME;
-                        bsCrTimer.start (N_BS_TIMEOUT);
-                        break;
+                if (!nAsTimer.isExpired (nowUs)) {
+                        separationTimer.start (TX_RETRY_INTERVAL_US, nowUs);
+                        return true;
                 }
+        }
 
-                // TODO separationTimeUs should be in 100µs units. Now i have 1ms resolution, so f1-f9 STmin are rounded to 0
-                separationTimer.start (receivedSeparationTimeUs / 1000);
-                bsCrTimer.start (N_CR_TIMEOUT);
-                break;
+        tp.confirm (myAddress, Result::N_TIMEOUT_A);
+        state = State::DONE;
+        retrying = false;
+        return false;
+}
 
-        } break;
+/*****************************************************************************/
 
-        default:
-                break;
+template <typename TraitsT>
+etl::optional<uint32_t> TransportProtocol<TraitsT>::StateMachine::nextDeadline (uint32_t nowUs) const
+{
+        switch (state) {
+        case State::IDLE:
+                return nowUs;
+
+        case State::SEND_FIRST_FRAME:
+                return (separationTimer.isExpired (nowUs)) ? (nowUs) : (separationTimer.getDeadline ());
+
+        case State::RECEIVE_BS_FLOW_CONTROL_FRAME:
+        case State::RECEIVE_FIRST_FLOW_CONTROL_FRAME:
+                return bsCrTimer.getDeadline (); // N_Bs
+
+        case State::SEND_CONSECUTIVE_FRAME: {
+                uint32_t st = separationTimer.getDeadline ();
+
+                if (retrying) {
+                        return st;
+                }
+
+                uint32_t cr = bsCrTimer.getDeadline ();
+                return (int32_t (st - cr) < 0) ? (st) : (cr);
         }
 
-        return Status::OK;
+        default:
+                return {};
+        }
 }
 
 } // namespace tp
@@ -0,0 +1,69 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#pragma once
+#include "CppCompat.h"
+
+namespace tp {
+
+/**
+ * Fixed capacity FIFO of messages waiting for a free transmission state machine.
+ * Backed by etl::vector so no dynamic allocation takes place. Elements can be
+ * removed from the middle, because a message to an idle peer is allowed to overtake
+ * messages waiting for a busy one.
+ */
+template <typename T, size_t N> class TxQueue {
+public:
+        using iterator = typename etl::vector<T, N>::iterator;
+        using const_iterator = typename etl::vector<T, N>::const_iterator;
+
+        bool empty () const { return data.empty (); }
+        bool full () const { return data.full (); }
+        size_t size () const { return data.size (); }
+        static constexpr size_t capacity () { return N; }
+
+        void push (T &&t) { data.push_back (std::move (t)); }
+        T &front () { return data.front (); }
+        void popFront () { data.erase (data.begin ()); }
+
+        iterator begin () { return data.begin (); }
+        iterator end () { return data.end (); }
+        const_iterator begin () const { return data.begin (); }
+        const_iterator end () const { return data.end (); }
+        iterator erase (iterator i) { return data.erase (i); }
+
+private:
+        etl::vector<T, N> data;
+};
+
+/**
+ * Zero sized queue (the default). Every message which can't be sent immediately
+ * is rejected.
+ */
+template <typename T> class TxQueue<T, 0> {
+public:
+        using iterator = T *;
+        using const_iterator = T const *;
+
+        bool empty () const { return true; }
+        bool full () const { return true; }
+        size_t size () const { return 0; }
+        static constexpr size_t capacity () { return 0; }
+
+        void push (T && /* t */) {}
+        T &front () { return *begin (); }
+        void popFront () {}
+
+        iterator begin () { return nullptr; }
+        iterator end () { return nullptr; }
+        const_iterator begin () const { return nullptr; }
+        const_iterator end () const { return nullptr; }
+        iterator erase (iterator i) { return i; }
+};
+
+} // namespace tp
@@ -61,6 +61,9 @@ public:
         uint8_t get (size_t i) const { return gsl::at (frame.data, i); }
         void set (size_t i, uint8_t b) { gsl::at (frame.data, i) = b; }
 
+        /// Whole data field (8 bytes, regardless of the DLC). Optional : lets the protocol copy the payload at once instead of byte by byte.
+        uint8_t const *data () const { return frame.data; }
+
 private:
         can_frame frame{};
 };
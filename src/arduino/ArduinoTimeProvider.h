@@ -13,9 +13,12 @@ namespace tp {
 
 /**
  * @brief The ArduinoTimeProvider struct
+ * µs resolution, so sub-millisecond STmin values are honored. micros () wraps around
+ * every ~71 minutes which is handled by the library.
  */
 struct ArduinoTimeProvider {
-        long operator() () const { return millis (); }
+        static constexpr uint32_t TICKS_PER_SECOND = 1000000;
+        unsigned long operator() () const { return micros (); }
 };
 
 } // namespace tp
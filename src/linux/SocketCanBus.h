@@ -0,0 +1,572 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#pragma once
+#include "Address.h"
+#include "CppCompat.h"
+#include "LinuxCanFrame.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <iterator>
+#include <cstring>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Max number of frames read with one recvmmsg, or written with one sendmmsg call.
+ */
+#if !defined(SOCKET_CAN_BATCH_SIZE)
+#define SOCKET_CAN_BATCH_SIZE 32
+#endif
+
+namespace tp {
+
+/**
+ * Event loop for a TransportProtocol on a SocketCAN (CAN_RAW) socket. Waits in epoll_pwait2
+ * until a frame arrives or the next protocol deadline passes (see nextDeadline), reads all
+ * the pending frames with recvmmsg and passes them to onCanNewFrames, and sends bursts of
+ * consecutive frames with sendmmsg (see Output). CanFrameT is either can_frame, or
+ * canfd_frame which turns CAN_RAW_FD_FRAMES on.
+ *
+ * Usage :
+ *
+ * SocketCanBus<> bus;
+ * bus.open ("can0");
+ * auto tp = create<can_frame> (Address{0x12, 0x89}, callback, bus.output ());
+ * bus.run (tp);
+ *
+ * Unless setFilters is called, the socket gets the CAN_RAW_FILTER of tp's own address (see
+ * localFilter in Address.h), and of the peers tp sends segmented messages to, so the kernel
+ * drops frames which are not for us (see autoFilters).
+ *
+ * Sockets opened with open have SO_TIMESTAMPNS on, and the frames are passed to
+ * onCanNewFrames with the time they were received at by the kernel (converted to the time
+ * base of tp.now).
+ *
+ * The wait has 1µs resolution, so sub-millisecond STmin values (0xF1-0xF9) are kept. Kernels
+ * older than 5.11 have no epoll_pwait2, and the loop falls back to epoll_wait, which rounds the
+ * timeout up to whole milliseconds.
+ *
+ * Apart from stop, methods are meant to be called from the thread running the loop.
+ */
+template <typename CanFrameT = can_frame> class SocketCanBus {
+public:
+        static_assert (std::is_same<CanFrameT, can_frame>::value || std::is_same<CanFrameT, canfd_frame>::value,
+                       "SocketCanBus works with can_frame or canfd_frame.");
+
+        static constexpr bool USING_FD = std::is_same<CanFrameT, canfd_frame>::value;
+        static constexpr size_t BATCH_SIZE = SOCKET_CAN_BATCH_SIZE;
+
+        /**
+         * Output interface for the TransportProtocol. Refers to the bus, which has to outlive
+         * the protocol object.
+         */
+        class Output {
+        public:
+                explicit Output (SocketCanBus *b = nullptr) : bus (b) {}
+
+                OutputResult operator() (CanFrameT const &frame) { return bus->send (frame); }
+                BatchOutputResult sendBatch (etl::span<CanFrameT const> frames) { return bus->sendBatch (frames); }
+
+        private:
+                SocketCanBus *bus;
+        };
+
+        SocketCanBus () = default;
+        ~SocketCanBus () { close (); }
+
+        SocketCanBus (SocketCanBus const &) = delete;
+        SocketCanBus &operator= (SocketCanBus const &) = delete;
+        SocketCanBus (SocketCanBus &&) = delete;
+        SocketCanBus &operator= (SocketCanBus &&) = delete;
+
+        /**
+         * Opens a CAN_RAW socket bound to the interface (i.e. "can0", "vcan0" or "slcan0").
+         * Returns false on failure, errno tells why.
+         */
+        bool open (char const *interfaceName);
+
+        /**
+         * Runs the loop on an already open socket (of any kind delivering one frame per datagram),
+         * and takes its ownership. Lets the caller set the socket up on its own, and lets the
+         * loop be tested without a CAN interface (see socketpair).
+         */
+        bool attach (int fd);
+
+        void close ();
+        bool isOpen () const { return socketFd >= 0; }
+        int getFd () const { return socketFd; }
+
+        Output output () { return Output{this}; }
+
+        /// Writes one frame. RETRY if the TX queue is full (ENOBUFS or EAGAIN), FAILED on other errors.
+        OutputResult send (CanFrameT const &frame);
+
+        /**
+         * Writes frames with as few sendmmsg calls as possible. Returns how many of them were
+         * accepted, and whether the protocol should send the rest again later (RETRY, the TX
+         * queue is full) or give up (FAILED, like send does on other errors).
+         */
+        BatchOutputResult sendBatch (etl::span<CanFrameT const> frames);
+
+        /**
+         * Sets CAN_RAW_FILTER : the kernel drops frames which don't pass any of the filters before
+         * they are copied to user space. Turns the automatic filters (see runOnce) off. When
+         * sending to addresses other than our own, their localFilter has to be passed as well,
+         * or the flow control frames won't get through. No filters means no frames at all.
+         */
+        bool setFilters (etl::span<IdFilter const> filters);
+
+        /**
+         * The filters runOnce sets : localFilter of tp's own address, and of every peer tp is
+         * sending a segmented message to (or has one queued for), so their flow control frames
+         * get through. Duplicates are skipped.
+         */
+        template <typename TP> static void autoFilters (TP const &tp, std::vector<IdFilter> &filters);
+
+        /// IdFilter in the CAN_RAW_FILTER format. Remote frames are rejected.
+        static can_filter toCanFilter (IdFilter const &f);
+
+        /**
+         * Reads all the frames waiting in the socket (without blocking) and passes them to
+         * tp.onCanNewFrames, at most BATCH_SIZE at a time, with their timestamps if the socket
+         * has SO_TIMESTAMPNS on. Returns false on a read error other than EAGAIN or ENETDOWN
+         * (interface down, which is transient).
+         */
+        template <typename TP> bool receive (TP &tp);
+
+        /**
+         * One iteration of the loop : updates the filters (see autoFilters, unless setFilters was
+         * called, or the socket is not a CAN one), tp.run, then wait until either a frame arrives, the next
+         * deadline of tp passes, maxWaitMs passes (-1 means no limit), or stop is called.
+         * Returns false on error.
+         */
+        template <typename TP> bool runOnce (TP &tp, int maxWaitMs = -1);
+
+        /// Calls runOnce until stop is called or an error occurs. Returns false in the latter case.
+        template <typename TP> bool run (TP &tp);
+
+        /// Makes run return (right away, if it's called before run). Can be called from other threads, or from the callbacks.
+        void stop ();
+
+private:
+        static constexpr size_t FRAME_SIZE = sizeof (CanFrameT); // CAN_MTU or CANFD_MTU
+
+        /// Checks if the address encoder provides localFilter.
+        template <typename T, typename = void> struct HasLocalFilter : public etl::false_type {
+        };
+
+        template <typename T>
+        struct HasLocalFilter<T, typename etl::enable_if<true, decltype ((void)(T::localFilter (Address{})))>::type> : public etl::true_type {
+        };
+
+        /// Room for one SCM_TIMESTAMPNS message.
+        static constexpr size_t CONTROL_SIZE = CMSG_SPACE (sizeof (timespec));
+
+        template <typename TP> void applyAutoFilters (TP const &tp);
+        static uint32_t ageUs (msghdr const &msg, timespec const &realNow);
+        int wait (epoll_event *events, int maxEvents, etl::optional<uint32_t> timeoutUs);
+
+        /// RETRY if a write failed because the TX queue is full (ENOBUFS or EAGAIN), FAILED otherwise.
+        static OutputResult errnoToOutputResult ()
+        {
+                return (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? (OutputResult::RETRY)
+                                                                                                       : (OutputResult::FAILED);
+        }
+
+        bool applyFilters (etl::span<IdFilter const> filters);
+
+        int socketFd{-1};
+        int epollFd{-1};
+        int stopFd{-1};
+        std::atomic<bool> stopRequested{false};
+        bool canSocket{};
+        bool timestamps{}; /// SO_TIMESTAMPNS is on.
+        bool preciseWait{true}; /// epoll_pwait2 is available.
+        bool autoFilter{true};
+        bool autoFiltersSet{};
+        std::vector<IdFilter> currentFilters; /// Set by applyAutoFilters.
+        std::vector<IdFilter> wantedFilters;
+
+        CanFrameT rxFrames[BATCH_SIZE]{};
+        iovec rxIov[BATCH_SIZE]{};
+        mmsghdr rxMsgs[BATCH_SIZE]{};
+        alignas (cmsghdr) char rxControl[BATCH_SIZE][CONTROL_SIZE]{};
+        uint32_t rxTimesUs[BATCH_SIZE]{};
+};
+
+/*****************************************************************************/
+
+template <typename CanFrameT> bool SocketCanBus<CanFrameT>::open (char const *interfaceName)
+{
+        int fd = ::socket (PF_CAN, SOCK_RAW | SOCK_CLOEXEC, CAN_RAW);
+
+        if (fd < 0) {
+                return false;
+        }
+
+        if constexpr (USING_FD) {
+                int enable = 1;
+
+                if (setsockopt (fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof (enable)) < 0) {
+                        ::close (fd);
+                        return false;
+                }
+        }
+
+        // Not fatal : the frames get the time they are processed at.
+        int enable = 1;
+        setsockopt (fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof (enable));
+
+        sockaddr_can addr{};
+        addr.can_family = AF_CAN;
+        addr.can_ifindex = int (if_nametoindex (interfaceName));
+
+        if (addr.can_ifindex == 0 || bind (fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr)) < 0) {
+                ::close (fd);
+                return false;
+        }
+
+        return attach (fd);
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> bool SocketCanBus<CanFrameT>::attach (int fd)
+{
+        close ();
+        socketFd = fd;
+
+        int domain{};
+        socklen_t len = sizeof (domain);
+        canSocket = getsockopt (fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_CAN;
+        autoFiltersSet = false;
+
+        int timestampsOn{};
+        len = sizeof (timestampsOn);
+        timestamps = getsockopt (fd, SOL_SOCKET, SO_TIMESTAMPNS, &timestampsOn, &len) == 0 && timestampsOn != 0;
+        epollFd = epoll_create1 (EPOLL_CLOEXEC);
+        stopFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (epollFd < 0 || stopFd < 0) {
+                close ();
+                return false;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = socketFd;
+
+        epoll_event stopEv{};
+        stopEv.events = EPOLLIN;
+        stopEv.data.fd = stopFd;
+
+        if (epoll_ctl (epollFd, EPOLL_CTL_ADD, socketFd, &ev) < 0 || epoll_ctl (epollFd, EPOLL_CTL_ADD, stopFd, &stopEv) < 0) {
+                close ();
+                return false;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> void SocketCanBus<CanFrameT>::close ()
+{
+        for (int *fd : {&stopFd, &epollFd, &socketFd}) {
+                if (*fd >= 0) {
+                        ::close (*fd);
+                        *fd = -1;
+                }
+        }
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> bool SocketCanBus<CanFrameT>::setFilters (etl::span<IdFilter const> filters)
+{
+        autoFilter = false;
+        return applyFilters (filters);
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> bool SocketCanBus<CanFrameT>::applyFilters (etl::span<IdFilter const> filters)
+{
+        std::vector<can_filter> canFilters;
+        std::transform (filters.begin (), filters.end (), std::back_inserter (canFilters), toCanFilter);
+        return setsockopt (socketFd, SOL_CAN_RAW, CAN_RAW_FILTER, canFilters.data (), socklen_t (canFilters.size () * sizeof (can_filter)))
+                == 0;
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> can_filter SocketCanBus<CanFrameT>::toCanFilter (IdFilter const &f)
+{
+        can_filter cf{};
+        cf.can_id = (f.extended) ? (f.id | CAN_EFF_FLAG) : (f.id);
+        cf.can_mask = f.mask | CAN_EFF_FLAG | CAN_RTR_FLAG;
+        return cf;
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> template <typename TP> void SocketCanBus<CanFrameT>::autoFilters (TP const &tp, std::vector<IdFilter> &filters)
+{
+        using AddressEncoderT = typename TP::AddressEncoderT;
+        filters.clear ();
+
+        if constexpr (HasLocalFilter<AddressEncoderT>::value) {
+                filters.push_back (AddressEncoderT::localFilter (tp.getMyAddress ()));
+
+                tp.forEachTxAddress ([&filters] (Address const &a) {
+                        IdFilter f = AddressEncoderT::localFilter (a);
+
+                        if (std::find (filters.begin (), filters.end (), f) == filters.end ()) {
+                                filters.push_back (f);
+                        }
+                });
+        }
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> template <typename TP> void SocketCanBus<CanFrameT>::applyAutoFilters (TP const &tp)
+{
+        if (!autoFilter || !canSocket) {
+                return;
+        }
+
+        autoFilters (tp, wantedFilters);
+
+        // Set only when they change. If it fails, all the frames are received, as without them.
+        if (wantedFilters.empty () || (autoFiltersSet && wantedFilters == currentFilters)) {
+                return;
+        }
+
+        applyFilters (etl::span<IdFilter const> (wantedFilters.data (), wantedFilters.size ()));
+        currentFilters.swap (wantedFilters);
+        autoFiltersSet = true;
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> OutputResult SocketCanBus<CanFrameT>::send (CanFrameT const &frame)
+{
+        if (::send (socketFd, &frame, FRAME_SIZE, MSG_DONTWAIT | MSG_NOSIGNAL) == ssize_t (FRAME_SIZE)) {
+                return OutputResult::SENT;
+        }
+
+        return errnoToOutputResult ();
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> BatchOutputResult SocketCanBus<CanFrameT>::sendBatch (etl::span<CanFrameT const> frames)
+{
+        size_t sent = 0;
+
+        while (sent < frames.size ()) {
+                iovec iov[BATCH_SIZE]{};
+                mmsghdr msgs[BATCH_SIZE]{};
+                size_t chunk = std::min (BATCH_SIZE, frames.size () - sent);
+
+                for (size_t i = 0; i < chunk; ++i) {
+                        iov[i].iov_base = const_cast<CanFrameT *> (&frames[sent + i]);
+                        iov[i].iov_len = FRAME_SIZE;
+                        msgs[i].msg_hdr.msg_iov = &iov[i];
+                        msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                int ret = sendmmsg (socketFd, msgs, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+                if (ret < 0) {
+                        return {sent, errnoToOutputResult ()};
+                }
+
+                sent += size_t (ret);
+
+                if (size_t (ret) < chunk) {
+                        break; // The TX queue got full.
+                }
+        }
+
+        return {sent, OutputResult::RETRY};
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> template <typename TP> bool SocketCanBus<CanFrameT>::receive (TP &tp)
+{
+        while (true) {
+                // recvmmsg may modify these.
+                for (size_t i = 0; i < BATCH_SIZE; ++i) {
+                        rxIov[i].iov_base = &rxFrames[i];
+                        rxIov[i].iov_len = FRAME_SIZE;
+                        rxMsgs[i].msg_hdr = msghdr{};
+                        rxMsgs[i].msg_hdr.msg_iov = &rxIov[i];
+                        rxMsgs[i].msg_hdr.msg_iovlen = 1;
+
+                        if (timestamps) {
+                                rxMsgs[i].msg_hdr.msg_control = rxControl[i];
+                                rxMsgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+                        }
+                }
+
+                int ret = recvmmsg (socketFd, rxMsgs, BATCH_SIZE, MSG_DONTWAIT, nullptr);
+
+                if (ret < 0) {
+                        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENETDOWN;
+                }
+
+                if (timestamps) {
+                        // The timestamps are CLOCK_REALTIME, and tp may use any clock. What is converted is their age.
+                        uint32_t nowUs = tp.now ();
+                        timespec realNow{};
+                        clock_gettime (CLOCK_REALTIME, &realNow);
+
+                        for (int i = 0; i < ret; ++i) {
+                                rxTimesUs[i] = nowUs - ageUs (rxMsgs[i].msg_hdr, realNow);
+                        }
+
+                        tp.onCanNewFrames (etl::span<CanFrameT const> (rxFrames, size_t (ret)),
+                                           etl::span<uint32_t const> (rxTimesUs, size_t (ret)));
+                }
+                else {
+                        tp.onCanNewFrames (etl::span<CanFrameT const> (rxFrames, size_t (ret)));
+                }
+
+                if (size_t (ret) < BATCH_SIZE) {
+                        return true;
+                }
+        }
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> uint32_t SocketCanBus<CanFrameT>::ageUs (msghdr const &msg, timespec const &realNow)
+{
+        for (cmsghdr const *c = CMSG_FIRSTHDR (&msg); c != nullptr; c = CMSG_NXTHDR (const_cast<msghdr *> (&msg), const_cast<cmsghdr *> (c))) {
+                if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS) {
+                        continue;
+                }
+
+                timespec stamp{};
+                memcpy (&stamp, CMSG_DATA (c), sizeof (stamp));
+                int64_t age = (int64_t (realNow.tv_sec) - stamp.tv_sec) * 1000000 + (int64_t (realNow.tv_nsec) - stamp.tv_nsec) / 1000;
+
+                // The realtime clock may have been set back in the meantime.
+                return (age > 0) ? (uint32_t (std::min<int64_t> (age, INT32_MAX))) : (0);
+        }
+
+        return 0;
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> template <typename TP> bool SocketCanBus<CanFrameT>::runOnce (TP &tp, int maxWaitMs)
+{
+        applyAutoFilters (tp);
+        tp.run ();
+
+        etl::optional<uint32_t> timeoutUs;
+
+        if (maxWaitMs >= 0) {
+                timeoutUs = uint32_t (std::min<uint64_t> (uint64_t (maxWaitMs) * 1000, UINT32_MAX));
+        }
+
+        if (auto us = tp.timeToNextDeadline ()) {
+                timeoutUs = (timeoutUs) ? (std::min (*timeoutUs, *us)) : (*us);
+        }
+
+        epoll_event events[2]{};
+        int ret = wait (events, 2, timeoutUs);
+
+        if (ret < 0) {
+                return errno == EINTR;
+        }
+
+        for (int i = 0; i < ret; ++i) {
+                if (events[i].data.fd == stopFd) {
+                        uint64_t unused{};
+                        (void)!::read (stopFd, &unused, sizeof (unused));
+                }
+                else if (!receive (tp)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+/**
+ * epoll_pwait2 if the kernel has it, otherwise epoll_wait with the timeout rounded up to
+ * milliseconds. No timeoutUs means no limit.
+ */
+template <typename CanFrameT> int SocketCanBus<CanFrameT>::wait (epoll_event *events, int maxEvents, etl::optional<uint32_t> timeoutUs)
+{
+#if defined(SYS_epoll_pwait2)
+        if (preciseWait) {
+                timespec ts{};
+
+                if (timeoutUs) {
+                        ts.tv_sec = time_t (*timeoutUs / 1000000);
+                        ts.tv_nsec = long (*timeoutUs % 1000000) * 1000;
+                }
+
+                // Called directly, as glibc has the wrapper only since 2.35.
+                int ret = int (syscall (SYS_epoll_pwait2, epollFd, events, maxEvents, (timeoutUs) ? (&ts) : (nullptr), nullptr, 0));
+
+                if (ret >= 0 || errno != ENOSYS) {
+                        return ret;
+                }
+
+                preciseWait = false;
+        }
+#endif
+
+        int timeoutMs = (timeoutUs) ? (int (std::min<uint64_t> ((uint64_t (*timeoutUs) + 999) / 1000, INT_MAX))) : (-1);
+        return epoll_wait (epollFd, events, maxEvents, timeoutMs);
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> template <typename TP> bool SocketCanBus<CanFrameT>::run (TP &tp)
+{
+        while (!stopRequested) {
+                if (!runOnce (tp)) {
+                        return false;
+                }
+        }
+
+        stopRequested = false;
+        return true;
+}
+
+/*****************************************************************************/
+
+template <typename CanFrameT> void SocketCanBus<CanFrameT>::stop ()
+{
+        stopRequested = true;
+        uint64_t one = 1;
+        (void)!::write (stopFd, &one, sizeof (one));
+}
+
+} // namespace tp
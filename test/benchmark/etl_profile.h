@@ -0,0 +1,15 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#pragma once
+#define ETL_LOG_ERRORS
+#define ETL_VERBOSE_ERRORS
+#define ETL_CHECK_PUSH_POP
+
+#include "etl/profiles/cpp17.h"
+
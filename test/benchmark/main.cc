@@ -0,0 +1,362 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "LinuxTransportProtocol.h"
+#include <chrono>
+#include <cstdio>
+#include <etl/map.h>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+/*
+ * Receive session lookup : the cost of finding the session a consecutive frame belongs
+ * to, with 4, 64 and 256 sessions open at the same time. Compares an ordered map (what
+ * was used before), the hash index and the direct index.
+ *
+ * Reassembly : the cost of receiving a 4095 byte message when the payload is copied
+ * from every frame at once (the wrapper provides data ()) and byte by byte.
+ *
+ * Ingestion : frames per second received with onCanNewFrame (one by one) and with
+ * onCanNewFrames (batches of 32, as recvmmsg would return them), with 8 senders whose
+ * frames come in runs of 4.
+ *
+ * Simulation : many sender / receiver pairs exchanging messages with STmin = 1ms on a
+ * simulated clock. The clock jumps straight to the next deadline, so the simulation runs
+ * much faster than the wall clock.
+ */
+
+using namespace tp;
+using Clock = std::chrono::steady_clock;
+
+/// Strict weak ordering, for the etl::map baseline.
+struct AddressLess {
+        bool operator() (Address const &a, Address const &b) const
+        {
+                return std::make_tuple (a.getTxId (), a.getRxId (), a.getSourceAddress (), a.getTargetAddress (), a.getNetworkAddressExtension ())
+                        < std::make_tuple (b.getTxId (), b.getRxId (), b.getSourceAddress (), b.getTargetAddress (),
+                                           b.getNetworkAddressExtension ());
+        }
+};
+
+template <size_t N> struct MapIndex {
+        int *find (Address const &k)
+        {
+                auto i = map.find (k);
+                return (i == map.end ()) ? (nullptr) : (&i->second);
+        }
+
+        int *insert (Address const &k) { return &map[k]; }
+
+        etl::map<Address, int, N, AddressLess> map;
+};
+
+constexpr size_t ITERATIONS = 10000000;
+
+using Encoder = NormalFixed29AddressEncoder;
+
+/// Peers in NormalFixed29 : N_SA = i, N_TA = 0xf1. Full address, as the map used to store.
+Address peerAddress (size_t i) { return Address (0, 0, uint8_t (i), 0xf1); }
+
+/// The same peers, as the key the encoder produces.
+Encoder::Key peerKey (size_t i) { return Encoder::peerKey (Address (0, 0, 0xf1, uint8_t (i))); }
+
+/// Returns ns per lookup.
+template <typename IndexT, size_t N, typename KeyFun> double benchmarkIndex (KeyFun keyFun)
+{
+        auto index = std::make_unique<IndexT> ();
+        etl::array<decltype (keyFun (0)), N> keys;
+
+        for (size_t i = 0; i < N; ++i) {
+                keys[i] = keyFun (i);
+                *index->insert (keys[i]) = int (i);
+        }
+
+        volatile int sink = 0;
+        auto start = Clock::now ();
+
+        for (size_t i = 0; i < ITERATIONS; ++i) {
+                // Stride through the sessions, like frames from many senders interleaved on the bus.
+                sink = sink + *index->find (keys[(i * 7) % N]);
+        }
+
+        return std::chrono::duration<double, std::nano> (Clock::now () - start).count () / ITERATIONS;
+}
+
+/// Returns ns per onCanNewFrame (consecutive frame).
+template <SessionIndexType INDEX, size_t N> double benchmarkProtocol ()
+{
+        auto indication = [] (auto const & /* isoMessage */) {};
+        auto output = [] (auto const & /* canFrame */) { return true; };
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Encoder,
+                                                             decltype (output), ChronoTimeProvider, InfiniteLoop, decltype (indication), N,
+                                                             1, 0, INDEX>>;
+
+        auto tp = std::make_unique<TP> (Address (0, 0, 0xf1, 0x00), indication, output);
+
+        // 4095 bytes = FF + 585 CFs per session.
+        constexpr size_t CF_PER_MESSAGE = 585;
+        size_t frames = 0;
+        Clock::duration total{};
+
+        while (frames < ITERATIONS / 10) {
+                for (size_t i = 0; i < N; ++i) {
+                        tp->onCanNewFrame (CanFrame (0x18daf100 | i, true, 0x1f, 0xff, 0, 0, 0, 0, 0, 0));
+                }
+
+                auto start = Clock::now ();
+
+                for (size_t sn = 1; sn <= CF_PER_MESSAGE; ++sn) {
+                        for (size_t i = 0; i < N; ++i) {
+                                tp->onCanNewFrame (CanFrame (0x18daf100 | i, true, 0x20 | (sn & 0x0f), 0, 0, 0, 0, 0, 0, 0));
+                        }
+                }
+
+                total += Clock::now () - start;
+                frames += CF_PER_MESSAGE * N;
+        }
+
+        return std::chrono::duration<double, std::nano> (total).count () / frames;
+}
+
+template <size_t N> void run ()
+{
+        printf ("%4zu sessions | etl::map %6.1f ns | hash %6.1f ns | direct %6.1f ns || onCanNewFrame hash %6.1f ns | direct %6.1f ns\n", N,
+                benchmarkIndex<MapIndex<N>, N> (peerAddress), benchmarkIndex<HashSessionIndex<Encoder::Key, int, N, KeyHash>, N> (peerKey),
+                benchmarkIndex<DirectSessionIndex<Encoder::Key, int, N, Encoder>, N> (peerKey),
+                benchmarkProtocol<SessionIndexType::HASH, N> (), benchmarkProtocol<SessionIndexType::DIRECT, N> ());
+}
+
+/****************************************************************************/
+
+/// A frame whose wrapper does not provide data (), so the payload is copied byte by byte.
+struct ByteOnlyFrame {
+        CanFrame frame;
+};
+
+namespace tp {
+template <> class CanFrameWrapper<ByteOnlyFrame> {
+public:
+        CanFrameWrapper () = default;
+        explicit CanFrameWrapper (ByteOnlyFrame const &cf) : frame (cf.frame) {}
+        template <typename... T> CanFrameWrapper (uint32_t id, bool extended, T... data) : frame (id, extended, data...) {}
+
+        ByteOnlyFrame value () const { return {frame.value ()}; }
+
+        uint32_t getId () const { return frame.getId (); }
+        void setId (uint32_t i) { frame.setId (i); }
+
+        bool isExtended () const { return frame.isExtended (); }
+        void setExtended (bool b) { frame.setExtended (b); }
+
+        uint8_t getDlc () const { return frame.getDlc (); }
+        void setDlc (uint8_t d) { frame.setDlc (d); }
+
+        uint8_t get (size_t i) const { return frame.get (i); }
+        void set (size_t i, uint8_t b) { frame.set (i, b); }
+
+private:
+        CanFrameWrapper<CanFrame> frame;
+};
+} // namespace tp
+
+/// Returns µs per 4095 byte message.
+template <typename FrameT, typename IsoMessageT> double benchmarkReassembly ()
+{
+        size_t received = 0;
+        auto indication = [&received] (auto const & /* isoMessage */) { ++received; };
+        auto output = [] (auto const & /* canFrame */) { return true; };
+
+        using TP = TransportProtocol<TransportProtocolTraits<FrameT, IsoMessageT, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             decltype (output), ChronoTimeProvider, InfiniteLoop, decltype (indication), 1>>;
+
+        auto tp = std::make_unique<TP> (Address (0x89, 0x12), indication, output);
+
+        std::vector<FrameT> frames;
+        frames.push_back (FrameT{CanFrame (0x89, true, 0x1f, 0xff, 0, 0, 0, 0, 0, 0)});
+
+        for (size_t sn = 1; sn <= 585; ++sn) {
+                frames.push_back (FrameT{CanFrame (0x89, true, 0x20 | (sn & 0x0f), 0, 0, 0, 0, 0, 0, 0)});
+        }
+
+        constexpr size_t MESSAGES = 20000;
+        auto start = Clock::now ();
+
+        for (size_t i = 0; i < MESSAGES; ++i) {
+                for (FrameT const &f : frames) {
+                        tp->onCanNewFrame (f);
+                }
+        }
+
+        auto total = Clock::now () - start;
+
+        if (received != MESSAGES) {
+                printf ("Reassembly error\n");
+        }
+
+        return std::chrono::duration<double, std::micro> (total).count () / MESSAGES;
+}
+
+void reassembly ()
+{
+        printf ("Reassembly 4095 B | std::vector bulk %6.2f µs | byte by byte %6.2f µs || etl::vector bulk %6.2f µs | byte by byte %6.2f µs\n",
+                benchmarkReassembly<CanFrame, IsoMessage> (), benchmarkReassembly<ByteOnlyFrame, IsoMessage> (),
+                benchmarkReassembly<CanFrame, etl::vector<uint8_t, MAX_ALLOWED_ISO_MESSAGE_SIZE>> (),
+                benchmarkReassembly<ByteOnlyFrame, etl::vector<uint8_t, MAX_ALLOWED_ISO_MESSAGE_SIZE>> ());
+}
+
+/****************************************************************************/
+
+/// Returns millions of frames per second.
+template <bool BATCH> double benchmarkIngestion ()
+{
+        constexpr size_t SENDERS = 8;
+        constexpr size_t RUN = 4;
+        constexpr size_t BATCH_SIZE = 32;
+        constexpr size_t ROUNDS = 2000;
+
+        size_t received = 0;
+        auto indication = [&received] (auto const & /* isoMessage */) { ++received; };
+        auto output = [] (auto const & /* canFrame */) { return true; };
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, NormalFixed29AddressEncoder,
+                                                             decltype (output), ChronoTimeProvider, InfiniteLoop, decltype (indication), SENDERS>>;
+
+        auto tp = std::make_unique<TP> (Address (0, 0, 0x22, 0x00), indication, output);
+
+        // 4095 bytes from every sender : First Frames, and then runs of Consecutive Frames from each of them in turn.
+        std::vector<CanFrame> frames;
+
+        for (uint32_t s = 0; s < SENDERS; ++s) {
+                frames.push_back (CanFrame (0x18da2200 | s, true, 0x1f, 0xff, 0, 0, 0, 0, 0, 0));
+        }
+
+        for (size_t sn = 1; sn <= 585; sn += RUN) {
+                for (uint32_t s = 0; s < SENDERS; ++s) {
+                        for (size_t i = sn; i < sn + RUN && i <= 585; ++i) {
+                                frames.push_back (CanFrame (0x18da2200 | s, true, 0x20 | (i & 0x0f), 0, 0, 0, 0, 0, 0, 0));
+                        }
+                }
+        }
+
+        auto start = Clock::now ();
+
+        for (size_t r = 0; r < ROUNDS; ++r) {
+                if constexpr (BATCH) {
+                        for (size_t i = 0; i < frames.size (); i += BATCH_SIZE) {
+                                tp->onCanNewFrames (etl::span<CanFrame const> (&frames[i], std::min (BATCH_SIZE, frames.size () - i)));
+                        }
+                }
+                else {
+                        for (CanFrame const &f : frames) {
+                                tp->onCanNewFrame (f);
+                        }
+                }
+        }
+
+        auto total = Clock::now () - start;
+
+        if (received != ROUNDS * SENDERS) {
+                printf ("Ingestion error\n");
+        }
+
+        return double (ROUNDS * frames.size ()) / std::chrono::duration<double, std::micro> (total).count ();
+}
+
+void ingestion ()
+{
+        printf ("Ingestion | onCanNewFrame %6.2f Mframes/s | onCanNewFrames %6.2f Mframes/s\n", benchmarkIngestion<false> (),
+                benchmarkIngestion<true> ());
+}
+
+/****************************************************************************/
+
+/// Shared by all the simulated nodes.
+struct SimulatedClock {
+        static constexpr uint32_t TICKS_PER_SECOND = 1000000;
+        uint32_t operator() () const { return *time; }
+        uint32_t const *time;
+};
+
+void simulation (size_t pairs)
+{
+        uint32_t simTime = 0;
+        size_t received = 0;
+        std::vector<CanFrame> bus;
+
+        auto output = [&bus] (auto const &canFrame) {
+                bus.push_back (canFrame);
+                return true;
+        };
+
+        auto indication = [&received] (auto const & /* isoMessage */) { ++received; };
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             decltype (output), SimulatedClock, InfiniteLoop, decltype (indication), 1>>;
+
+        std::vector<std::unique_ptr<TP>> nodes;
+
+        for (uint32_t i = 0; i < pairs; ++i) {
+                // Sender 2i and receiver 2i+1.
+                nodes.push_back (std::make_unique<TP> (Address (0x1000 + 2 * i, 0x1000 + 2 * i + 1), indication, output, SimulatedClock{&simTime}));
+                nodes.push_back (std::make_unique<TP> (Address (0x1000 + 2 * i + 1, 0x1000 + 2 * i), indication, output, SimulatedClock{&simTime}));
+                nodes.back ()->setSeparationTime (1);
+                nodes[2 * i]->send (std::vector<uint8_t> (MAX_ALLOWED_ISO_MESSAGE_SIZE));
+        }
+
+        auto start = Clock::now ();
+
+        while (received < pairs) {
+                for (auto &n : nodes) {
+                        n->run ();
+                }
+
+                // Every frame lands in every node, as on a real bus.
+                while (!bus.empty ()) {
+                        auto frames = std::move (bus);
+                        bus.clear ();
+
+                        for (CanFrame const &f : frames) {
+                                for (auto &n : nodes) {
+                                        n->onCanNewFrame (f);
+                                }
+                        }
+                }
+
+                etl::optional<uint32_t> sleep;
+
+                for (auto &n : nodes) {
+                        if (auto d = n->timeToNextDeadline (); d && (!sleep || *d < *sleep)) {
+                                sleep = d;
+                        }
+                }
+
+                if (sleep) {
+                        simTime += *sleep;
+                }
+        }
+
+        double wall = std::chrono::duration<double> (Clock::now () - start).count ();
+        printf ("%4zu pairs | simulated %6.3f s | wall %6.3f s\n", pairs, simTime / 1e6, wall);
+}
+
+/****************************************************************************/
+
+int main ()
+{
+        run<4> ();
+        run<64> ();
+        run<256> ();
+
+        reassembly ();
+        ingestion ();
+
+        simulation (10);
+        simulation (100);
+}
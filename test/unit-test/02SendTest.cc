@@ -7,8 +7,11 @@
  ****************************************************************************/
 
 #include "LinuxTransportProtocol.h"
+#include <algorithm>
+#include <array>
 #include <catch2/catch.hpp>
 #include <etl/vector.h>
+#include <numeric>
 #include <unistd.h>
 
 using namespace tp;
@@ -345,3 +348,357 @@ TEST_CASE ("tx 4096B ETL", "[send]")
 
         REQUIRE (calledTimes == 2);
 }
+
+/****************************************************************************/
+
+/**
+ * Borrowed messages are read from the caller's buffer while being sent.
+ */
+TEST_CASE ("tx borrowed", "[send]")
+{
+        std::vector<CanFrame> framesFromR;
+        std::vector<CanFrame> framesFromT;
+        std::vector<std::vector<uint8_t>> received;
+
+        auto tpR = create (
+                Address (0x89, 0x12), [&received] (auto const &isoMessage) { received.push_back (isoMessage); },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        auto tpT = create (
+                Address (0x12, 0x89), [] (auto const & /*unused*/) {},
+                [&framesFromT] (auto const &canFrame) {
+                        framesFromT.push_back (canFrame);
+                        return true;
+                });
+
+        auto exchange = [&] {
+                tpT.run ();
+                for (CanFrame &f : framesFromT) {
+                        tpR.onCanNewFrame (f);
+                }
+                framesFromT.clear ();
+
+                tpR.run ();
+                for (CanFrame &f : framesFromR) {
+                        tpT.onCanNewFrame (f);
+                }
+                framesFromR.clear ();
+        };
+
+        uint8_t single[] = {1, 2, 3};
+        REQUIRE (tpT.sendBorrowed (single));
+        REQUIRE (framesFromT.size () == 1);
+        exchange ();
+
+        std::array<uint8_t, 20> buffer{};
+        std::iota (buffer.begin (), buffer.end (), 0);
+        REQUIRE (tpT.sendBorrowed (buffer));
+
+        // First Frame with the bytes 0 - 5.
+        exchange ();
+        exchange ();
+        REQUIRE (received.size () == 1);
+
+        // Not sent yet, so the change is seen by the receiver.
+        buffer[19] = 0xff;
+
+        while (tpT.isSending ()) {
+                exchange ();
+        }
+
+        REQUIRE (received.size () == 2);
+        REQUIRE (received[0] == std::vector<uint8_t>{1, 2, 3});
+        REQUIRE (received[1].size () == 20);
+        REQUIRE (received[1][18] == 18);
+        REQUIRE (received[1][19] == 0xff);
+
+        // Too long.
+        std::vector<uint8_t> tooLong (4096);
+        REQUIRE (!tpT.sendBorrowed (tooLong));
+}
+
+/**
+ * Borrowed messages wait in the queue (without being copied) like the others.
+ */
+TEST_CASE ("tx borrowed queued", "[send]")
+{
+        std::vector<CanFrame> framesFromT;
+        std::vector<uint8_t> confirmed;
+        std::vector<uint32_t> receivedLengths;
+
+        auto tpR = create (
+                Address (0x89, 0x12), [&receivedLengths] (auto const &isoMessage) { receivedLengths.push_back (isoMessage.size ()); },
+                [] (auto const & /* canFrame */) { return true; });
+
+        auto tpT = create (
+                Address (0x12, 0x89), [] (auto const & /*unused*/) {},
+                [&framesFromT] (auto const &canFrame) {
+                        framesFromT.push_back (canFrame);
+                        return true;
+                });
+
+        // create () gives 4 state machines (one per peer) and a queue of 4.
+        std::array<uint8_t, 30> a{};
+        std::array<uint8_t, 40> b{};
+        REQUIRE (tpT.sendBorrowed (a));
+        REQUIRE (tpT.sendBorrowed (b)); // Same peer : waits in the queue.
+        REQUIRE (tpT.txQueue.size () == 1);
+
+        while (tpT.isSending ()) {
+                tpT.run ();
+
+                for (CanFrame &f : framesFromT) {
+                        tpR.onCanNewFrame (f);
+                }
+
+                framesFromT.clear ();
+
+                // Flow control from the receiver : CTS, BS = 0, STmin = 0.
+                tpT.onCanNewFrame (CanFrame (0x12, true, 0x30, 0, 0));
+        }
+
+        REQUIRE (receivedLengths == std::vector<uint32_t>{30, 40});
+}
+
+/**
+ * A borrowed buffer which waits in the queue behind busy state machines has to stay
+ * valid, so isSending reports it until it's sent.
+ */
+TEST_CASE ("tx borrowed behind busy state machines", "[send]")
+{
+        std::vector<CanFrame> framesFromR;
+        std::vector<CanFrame> framesFromT;
+        std::vector<std::vector<uint8_t>> received;
+
+        auto tpR = create (
+                Address (0x89, 0x12), [&received] (auto const &isoMessage) { received.push_back (isoMessage); },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        auto tpT = create (
+                Address (0x12, 0x89), [] (auto const & /*unused*/) {},
+                [&framesFromT] (auto const &canFrame) {
+                        framesFromT.push_back (canFrame);
+                        return true;
+                });
+
+        // All 4 state machines are taken by other peers.
+        std::array<uint8_t, 30> others{};
+
+        for (uint8_t i = 0; i < 4; ++i) {
+                REQUIRE (tpT.sendBorrowed (Address (0x20 + i, 0x90 + i), others));
+        }
+
+        Address a (0x12, 0x89);
+        std::array<uint8_t, 30> buffer{};
+        std::iota (buffer.begin (), buffer.end (), 0);
+        REQUIRE (tpT.sendBorrowed (a, buffer));
+        REQUIRE (tpT.getTxQueueStatistics ().depth == 1);
+        REQUIRE (tpT.isSending (a));
+
+        while (tpT.isSending (a)) {
+                REQUIRE (received.empty ());
+                tpT.run ();
+                for (CanFrame &f : framesFromT) {
+                        if (f.id == 0x89) {
+                                tpR.onCanNewFrame (f);
+                        }
+                }
+                framesFromT.clear ();
+
+                tpR.run ();
+                for (CanFrame &f : framesFromR) {
+                        tpT.onCanNewFrame (f);
+                }
+                framesFromR.clear ();
+
+                // The other peers answer with flow control as well.
+                for (uint8_t i = 0; i < 4; ++i) {
+                        tpT.onCanNewFrame (CanFrame (0x20 + i, true, 0x30, 0, 0));
+                }
+        }
+
+        // The buffer was needed until the very end.
+        REQUIRE (received.size () == 1);
+        REQUIRE (std::equal (buffer.begin (), buffer.end (), received[0].begin (), received[0].end ()));
+}
+
+/****************************************************************************/
+
+/**
+ * Streamed messages are generated frame by frame while being sent.
+ */
+TEST_CASE ("tx streamed", "[send]")
+{
+        std::vector<CanFrame> framesFromR;
+        std::vector<CanFrame> framesFromT;
+        std::vector<std::vector<uint8_t>> received;
+        std::vector<Result> confirmed;
+
+        struct Callback {
+                void indication (Address const & /* a */, std::vector<uint8_t> const & /* msg */, Result /* r */) {}
+                void confirm (Address const & /* a */, Result r) { confirmed->push_back (r); }
+                std::vector<Result> *confirmed;
+        };
+
+        auto tpR = create (
+                Address (0x89, 0x12), [&received] (auto const &isoMessage) { received.push_back (isoMessage); },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        auto tpT = create (Address (0x12, 0x89), Callback{&confirmed}, [&framesFromT] (auto const &canFrame) {
+                framesFromT.push_back (canFrame);
+                return true;
+        });
+
+        auto exchange = [&] {
+                while (tpT.isSending ()) {
+                        tpT.run ();
+                        for (CanFrame &f : framesFromT) {
+                                tpR.onCanNewFrame (f);
+                        }
+                        framesFromT.clear ();
+
+                        tpR.run ();
+                        for (CanFrame &f : framesFromR) {
+                                tpT.onCanNewFrame (f);
+                        }
+                        framesFromR.clear ();
+                }
+        };
+
+        // Generates i * 3 for every byte, and records what was asked for.
+        std::vector<std::pair<size_t, size_t>> calls;
+        auto producer = [&calls] (size_t offset, etl::span<uint8_t> out) {
+                calls.emplace_back (offset, out.size ());
+
+                for (size_t i = 0; i < out.size (); ++i) {
+                        out[i] = uint8_t ((offset + i) * 3);
+                }
+
+                return out.size ();
+        };
+
+        REQUIRE (tpT.sendStreamed (100, producer));
+        exchange ();
+
+        REQUIRE (received.size () == 1);
+        REQUIRE (received[0].size () == 100);
+
+        for (size_t i = 0; i < 100; ++i) {
+                REQUIRE (received[0][i] == uint8_t (i * 3));
+        }
+
+        // First Frame, then 13 full consecutive frames and the last one with 3 bytes.
+        REQUIRE (calls.size () == 15);
+        REQUIRE (calls.front () == std::make_pair (size_t (0), size_t (6)));
+        REQUIRE (calls[1] == std::make_pair (size_t (6), size_t (7)));
+        REQUIRE (calls.back () == std::make_pair (size_t (97), size_t (3)));
+
+        // Short ones go in a single frame.
+        REQUIRE (tpT.sendStreamed (5, producer));
+        tpR.onCanNewFrame (framesFromT.back ());
+        framesFromT.clear ();
+        REQUIRE (received.size () == 2);
+        REQUIRE (received[1] == std::vector<uint8_t>{0, 3, 6, 9, 12});
+
+        // A producer which gives up aborts the transmission.
+        auto failing = [] (size_t offset, etl::span<uint8_t> out) { return (offset < 20) ? (out.size ()) : (size_t (0)); };
+        confirmed.clear ();
+        REQUIRE (tpT.sendStreamed (50, failing));
+        exchange ();
+        REQUIRE (received.size () == 2);
+        REQUIRE (confirmed.back () == Result::N_ERROR);
+}
+
+/**
+ * The producer of a queued message is needed until isSending (a) returns false, and not a
+ * moment longer.
+ */
+TEST_CASE ("tx streamed behind busy state machines", "[send]")
+{
+        std::vector<CanFrame> framesFromR;
+        std::vector<CanFrame> framesFromT;
+        std::vector<std::vector<uint8_t>> received;
+
+        auto tpR = create (
+                Address (0x89, 0x12), [&received] (auto const &isoMessage) { received.push_back (isoMessage); },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        auto tpT = create (
+                Address (0x12, 0x89), [] (auto const & /*unused*/) {},
+                [&framesFromT] (auto const &canFrame) {
+                        framesFromT.push_back (canFrame);
+                        return true;
+                });
+
+        std::array<uint8_t, 30> others{};
+
+        for (uint8_t i = 0; i < 4; ++i) {
+                REQUIRE (tpT.sendBorrowed (Address (0x20 + i, 0x90 + i), others));
+        }
+
+        size_t calls = 0;
+        auto producer = [&calls] (size_t offset, etl::span<uint8_t> out) {
+                ++calls;
+
+                for (size_t i = 0; i < out.size (); ++i) {
+                        out[i] = uint8_t (offset + i);
+                }
+
+                return out.size ();
+        };
+
+        Address a (0x12, 0x89);
+        REQUIRE (tpT.sendStreamed (a, 30, producer));
+        REQUIRE (tpT.getTxQueueStatistics ().depth == 1);
+        REQUIRE (tpT.isSending (a));
+        REQUIRE (calls == 0);
+
+        auto exchange = [&] {
+                tpT.run ();
+                for (CanFrame &f : framesFromT) {
+                        if (f.id == 0x89) {
+                                tpR.onCanNewFrame (f);
+                        }
+                }
+                framesFromT.clear ();
+
+                tpR.run ();
+                for (CanFrame &f : framesFromR) {
+                        tpT.onCanNewFrame (f);
+                }
+                framesFromR.clear ();
+
+                for (uint8_t i = 0; i < 4; ++i) {
+                        tpT.onCanNewFrame (CanFrame (0x20 + i, true, 0x30, 0, 0));
+                }
+        };
+
+        while (tpT.isSending (a)) {
+                exchange ();
+        }
+
+        // First Frame and 4 Consecutive Frames.
+        REQUIRE (calls == 5);
+        REQUIRE (received.size () == 1);
+        REQUIRE (received[0].size () == 30);
+        REQUIRE (received[0][29] == 29);
+
+        // The producer could be destroyed now.
+        while (tpT.isSending ()) {
+                exchange ();
+        }
+
+        REQUIRE (calls == 5);
+}
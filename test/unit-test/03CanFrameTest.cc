@@ -8,6 +8,8 @@
 
 #include "LinuxTransportProtocol.h"
 #include <catch2/catch.hpp>
+#include <numeric>
+#include <vector>
 
 using namespace tp;
 
@@ -16,3 +18,77 @@ TEST_CASE ("instantiate", "[canFrame]")
         CanFrame cf{0x00, true};
         REQUIRE (cf.dlc == 0);
 }
+
+/*****************************************************************************/
+
+/// A frame whose wrapper does not provide data (), so the payload is copied byte by byte.
+struct ByteOnlyFrame {
+        CanFrame frame;
+};
+
+namespace tp {
+template <> class CanFrameWrapper<ByteOnlyFrame> {
+public:
+        CanFrameWrapper () = default;
+        explicit CanFrameWrapper (ByteOnlyFrame const &cf) : frame (cf.frame) {}
+        template <typename... T> CanFrameWrapper (uint32_t id, bool extended, T... data) : frame (id, extended, data...) {}
+
+        ByteOnlyFrame value () const { return {frame.value ()}; }
+
+        uint32_t getId () const { return frame.getId (); }
+        void setId (uint32_t i) { frame.setId (i); }
+
+        bool isExtended () const { return frame.isExtended (); }
+        void setExtended (bool b) { frame.setExtended (b); }
+
+        uint8_t getDlc () const { return frame.getDlc (); }
+        void setDlc (uint8_t d) { frame.setDlc (d); }
+
+        uint8_t get (size_t i) const { return frame.get (i); }
+        void set (size_t i, uint8_t b) { frame.set (i, b); }
+
+private:
+        CanFrameWrapper<CanFrame> frame;
+};
+} // namespace tp
+
+/**
+ * Bulk (data ()) and byte by byte payload copying give the same messages.
+ */
+TEST_CASE ("Contiguous append", "[canFrame]")
+{
+        auto receive = [] (auto frameTag, auto const &frames) {
+                using Frame = decltype (frameTag);
+                std::vector<uint8_t> result;
+                auto tp = create<Frame> (
+                        Address (0x89, 0x12), [&result] (auto const &isoMessage) { result = isoMessage; },
+                        [] (auto const & /* canFrame */) { return true; });
+
+                for (CanFrame const &f : frames) {
+                        tp.onCanNewFrame (Frame{f});
+                }
+
+                return result;
+        };
+
+        auto callback = [] (auto const & /* isoMessage */) {};
+        auto output = [] (auto const & /* canFrame */) { return true; };
+        using TP = decltype (create<CanFrame> (Address{}, callback, output));
+        static_assert (TP::HasFrameData<CanFrameWrapper<CanFrame>>::value);
+        static_assert (!TP::HasFrameData<CanFrameWrapper<ByteOnlyFrame>>::value);
+        static_assert (TP::HasRangeInsert<IsoMessage>::value);
+
+        std::vector<CanFrame> frames{CanFrame (0x89, true, 0x10, 20, 0, 1, 2, 3, 4, 5), CanFrame (0x89, true, 0x21, 6, 7, 8, 9, 10, 11, 12),
+                                     CanFrame (0x89, true, 0x22, 13, 14, 15, 16, 17, 18, 19)};
+
+        std::vector<uint8_t> expected (20);
+        std::iota (expected.begin (), expected.end (), 0);
+
+        REQUIRE (receive (CanFrame{}, frames) == expected);
+        REQUIRE (receive (ByteOnlyFrame{}, frames) == expected);
+
+        // Single frame.
+        std::vector<CanFrame> single{CanFrame (0x89, true, 0x03, 0xaa, 0xbb, 0xcc)};
+        REQUIRE (receive (CanFrame{}, single) == std::vector<uint8_t>{0xaa, 0xbb, 0xcc});
+        REQUIRE (receive (ByteOnlyFrame{}, single) == std::vector<uint8_t>{0xaa, 0xbb, 0xcc});
+}
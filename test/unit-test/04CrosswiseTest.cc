@@ -274,3 +274,173 @@ TEST_CASE ("cross full-duplex 4095B", "[crosswise]")
 
         REQUIRE (called == 2);
 }
+
+/**
+ * Longer than 4095 bytes : the First Frame uses the 32 bit FF_DL, and the sequence number
+ * wraps around many times. Blocks of 4 frames.
+ */
+TEST_CASE ("cross FF_DL escape 100000B", "[crosswise]")
+{
+        constexpr size_t LEN = 100000;
+        std::vector<CanFrame> framesFromR;
+        std::vector<CanFrame> framesFromT;
+        std::vector<uint8_t> received;
+        uint32_t announced{};
+
+        struct Callback {
+                void indication (Address const & /* a */, std::vector<uint8_t> const &msg, Result /* r */) { *received = msg; }
+                void firstFrameIndication (Address const & /* a */, uint32_t len) { *announced = len; }
+
+                std::vector<uint8_t> *received;
+                uint32_t *announced;
+        };
+
+        auto tpR = create<CanFrame, Normal29AddressEncoder, std::vector<uint8_t>, LEN> (
+                Address (0x89, 0x12), Callback{&received, &announced}, [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        tpR.setBlockSize (4);
+
+        auto tpT = create<CanFrame, Normal29AddressEncoder, std::vector<uint8_t>, LEN> (
+                Address (0x12, 0x89), [] (auto const & /*unused*/) {},
+                [&framesFromT] (auto const &canFrame) {
+                        framesFromT.push_back (canFrame);
+                        return true;
+                });
+
+        std::vector<uint8_t> payload (LEN);
+        for (size_t i = 0; i < LEN; ++i) {
+                payload[i] = uint8_t (i * 7);
+        }
+
+        REQUIRE (tpT.send (payload));
+        tpT.run ();
+        tpT.run ();
+
+        // 0x10 0x00 and 100000 as 32 bit big endian.
+        REQUIRE (framesFromT.size () == 1);
+        CanFrame const &ff = framesFromT.front ();
+        REQUIRE (ff.dlc == 8);
+        REQUIRE (ff.data[0] == 0x10);
+        REQUIRE (ff.data[1] == 0x00);
+        REQUIRE (ff.data[2] == 0x00);
+        REQUIRE (ff.data[3] == 0x01);
+        REQUIRE (ff.data[4] == 0x86);
+        REQUIRE (ff.data[5] == 0xa0);
+
+        size_t flowFrames{};
+
+        while (tpT.isSending ()) {
+                tpT.run ();
+                for (CanFrame &f : framesFromT) {
+                        tpR.onCanNewFrame (f);
+                }
+                framesFromT.clear ();
+
+                tpR.run ();
+                for (CanFrame &f : framesFromR) {
+                        tpT.onCanNewFrame (f);
+                        ++flowFrames;
+                }
+                framesFromR.clear ();
+        }
+
+        REQUIRE (announced == LEN);
+        REQUIRE (received == payload);
+
+        // 2 bytes in the First Frame, and 7 in each of the Consecutive ones.
+        REQUIRE (flowFrames == 1 + (LEN - 2 + 6) / 7 / 4);
+}
+
+TEST_CASE ("FF_DL escape with a short length", "[crosswise]")
+{
+        bool called = false;
+        auto tpR = create (Address (0x89, 0x12), [&called] (auto const & /* isoMessage */) { called = true; });
+
+        // 4095 fits in 12 bits, so the escape sequence is an error.
+        REQUIRE (!tpR.onCanNewFrame (CanFrame (0x89, true, 0x10, 0x00, 0x00, 0x00, 0x0f, 0xff, 0, 1)));
+        REQUIRE (tpR.transportMessagesMap.empty ());
+        REQUIRE (!called);
+}
+
+/**
+ * Messages which don't fit MAX_MESSAGE_SIZE (and so, the 32 bit FF_DL) are rejected, not truncated.
+ */
+TEST_CASE ("Message too long", "[crosswise]")
+{
+        std::vector<Result> confirmed;
+        std::vector<CanFrame> framesFromT;
+
+        struct Callback {
+                void indication (Address const & /* a */, std::vector<uint8_t> const & /* msg */, Result /* r */) {}
+                void confirm (Address const & /* a */, Result r) { confirmed->push_back (r); }
+                std::vector<Result> *confirmed;
+        };
+
+        auto output = [&framesFromT] (auto const &canFrame) {
+                framesFromT.push_back (canFrame);
+                return true;
+        };
+
+        auto producer = [] (size_t /* offset */, etl::span<uint8_t> out) { return out.size (); };
+
+        {
+                auto tpT = create (Address (0x12, 0x89), Callback{&confirmed}, output);
+                REQUIRE (!tpT.send (std::vector<uint8_t> (4096)));
+                REQUIRE (!tpT.sendStreamed (4096, producer));
+                REQUIRE (confirmed == std::vector<Result>{Result::N_ERROR, Result::N_ERROR});
+        }
+
+        // The longest message the FF_DL can describe is accepted, and one byte more is not.
+        if constexpr (sizeof (size_t) > sizeof (uint32_t)) {
+                confirmed.clear ();
+                auto tpT = create<CanFrame, Normal29AddressEncoder, std::vector<uint8_t>, MAX_ESCAPED_ISO_MESSAGE_SIZE> (
+                        Address (0x12, 0x89), Callback{&confirmed}, output);
+
+                REQUIRE (!tpT.sendStreamed (size_t (MAX_ESCAPED_ISO_MESSAGE_SIZE) + 1, producer));
+                REQUIRE (confirmed == std::vector<Result>{Result::N_ERROR});
+                REQUIRE (framesFromT.empty ());
+
+                REQUIRE (tpT.sendStreamed (MAX_ESCAPED_ISO_MESSAGE_SIZE, producer));
+                tpT.run ();
+                tpT.run ();
+
+                REQUIRE (framesFromT.size () == 1);
+                CanFrame const &ff = framesFromT.front ();
+                REQUIRE (ff.data[0] == 0x10);
+                REQUIRE (ff.data[1] == 0x00);
+                REQUIRE (ff.data[2] == 0xff);
+                REQUIRE (ff.data[3] == 0xff);
+                REQUIRE (ff.data[4] == 0xff);
+                REQUIRE (ff.data[5] == 0xff);
+        }
+}
+
+/**
+ * Frames from 2 senders, interleaved, passed in one batch.
+ */
+TEST_CASE ("rx batch", "[crosswise]")
+{
+        std::vector<std::vector<uint8_t>> received;
+        auto tp = create<CanFrame, NormalFixed29AddressEncoder> (
+                Address (0, 0, 0x22, 0x00), [&received] (auto const &isoMessage) { received.push_back (isoMessage); },
+                [] (auto const & /* canFrame */) { return true; });
+
+        // 27 bytes from 0x11 and 0x12 : First Frame and 3 Consecutive Frames each.
+        std::vector<CanFrame> frames{
+                CanFrame (0x18da2211, true, 0x10, 27, 1, 1, 1, 1, 1, 1), CanFrame (0x18da2212, true, 0x10, 27, 2, 2, 2, 2, 2, 2),
+                CanFrame (0x18da2211, true, 0x21, 1, 1, 1, 1, 1, 1, 1),  CanFrame (0x18da2211, true, 0x22, 1, 1, 1, 1, 1, 1, 1),
+                CanFrame (0x18da2212, true, 0x21, 2, 2, 2, 2, 2, 2, 2),  CanFrame (0x18da2212, true, 0x22, 2, 2, 2, 2, 2, 2, 2),
+                CanFrame (0x18da2212, true, 0x23, 2, 2, 2, 2, 2, 2, 2),  CanFrame (0x18da2211, true, 0x23, 1, 1, 1, 1, 1, 1, 1),
+        };
+
+        tp.onCanNewFrames (etl::span<CanFrame const> (frames.data (), frames.size ()));
+
+        REQUIRE (received.size () == 2);
+        REQUIRE (received[0] == std::vector<uint8_t> (27, 2));
+        REQUIRE (received[1] == std::vector<uint8_t> (27, 1));
+        REQUIRE (tp.transportMessagesMap.empty ());
+        REQUIRE (tp.receiveTimers.empty ());
+}
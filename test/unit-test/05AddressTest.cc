@@ -8,7 +8,7 @@
 
 #include "LinuxTransportProtocol.h"
 #include <catch2/catch.hpp>
-
+#include <vector>
 
 using namespace tp;
 
@@ -539,3 +539,203 @@ TEST_CASE ("Mixed29bits decode", "[address]")
                 REQUIRE (!a);
         }
 }
+
+/**
+ * Keys have to give the same results as the full addresses. Frame is sent to "to", and
+ * then received by "ours" and "other". The latter should differ in one of the fields.
+ */
+template <typename Encoder> void checkKeys (Address const &to, Address const &ours, Address const &other)
+{
+        CanFrameWrapper<CanFrame> cfw{CanFrame ()};
+        cfw.setDlc (1);
+        REQUIRE (Encoder::toFrame (to, cfw));
+
+        auto k = Encoder::keyFromFrame (cfw);
+        auto a = Encoder::fromFrame (cfw);
+        REQUIRE (k);
+        REQUIRE (a);
+        REQUIRE (Encoder::fromKey (*k) == *a);
+
+        for (Address const &r : {ours, other}) {
+                REQUIRE (((*k & Encoder::LOCAL_KEY_MASK) == Encoder::localKey (r)) == Encoder::matches (*a, r));
+                REQUIRE (((*k & Encoder::PEER_KEY_MASK) == Encoder::peerKey (r)) == Encoder::matchesPeer (*a, r));
+        }
+
+        REQUIRE ((*k & Encoder::LOCAL_KEY_MASK) == Encoder::localKey (ours));
+        REQUIRE ((*k & Encoder::PEER_KEY_MASK) == Encoder::peerKey (ours));
+}
+
+TEST_CASE ("Address keys", "[address]")
+{
+        checkKeys<Normal11AddressEncoder> (Address (0x21, 0x12), Address (0x12, 0x21), Address (0x13, 0x21));
+        checkKeys<Normal29AddressEncoder> (Address (0x21, 0x12345), Address (0x12345, 0x21), Address (0x12346, 0x21));
+        checkKeys<NormalFixed29AddressEncoder> (Address (0, 0, 0x11, 0x22), Address (0, 0, 0x22, 0x11), Address (0, 0, 0x22, 0x33));
+        checkKeys<NormalFixed29AddressEncoder> (Address (0, 0, 0x11, 0x22, Address::MessageType::DIAGNOSTICS,
+                                                         Address::TargetAddressType::FUNCTIONAL),
+                                                Address (0, 0, 0x22, 0x11), Address (0, 0, 0x23, 0x11));
+        checkKeys<Extended11AddressEncoder> (Address (0, 0x123, 0x00, 0x44), Address (0x123, 0, 0x44, 0x00), Address (0x123, 0, 0x45, 0x00));
+        checkKeys<Extended29AddressEncoder> (Address (0, 0x1234567, 0x00, 0x44), Address (0x1234567, 0, 0x44, 0x00),
+                                             Address (0x1234568, 0, 0x44, 0x00));
+        checkKeys<Mixed11AddressEncoder> (Address (0, 0x123, 0x00, 0x00, 0x55), Address (0x123, 0, 0x00, 0x00, 0x55),
+                                          Address (0x123, 0, 0x00, 0x00, 0x56));
+        checkKeys<Mixed29AddressEncoder> (Address (0, 0, 0x11, 0x22, 0x33, Address::MessageType::REMOTE_DIAGNOSTICS,
+                                                   Address::TargetAddressType::FUNCTIONAL),
+                                          Address (0, 0, 0x22, 0x11, 0x33), Address (0, 0, 0x22, 0x11, 0x34));
+        checkKeys<Mixed29AddressEncoder> (Address (0, 0, 0x11, 0x22, 0x33), Address (0, 0, 0x22, 0x11, 0x33), Address (0, 0, 0x22, 0x12, 0x33));
+}
+
+/*****************************************************************************/
+
+TEST_CASE ("Frame geometry", "[address]")
+{
+        using Normal = AddressTraits<Normal29AddressEncoder>;
+        using Extended = AddressTraits<Extended29AddressEncoder>;
+
+        static_assert (Normal::Geometry<8>::SINGLE_FRAME_MAX_SIZE == 7);
+        static_assert (Normal::Geometry<8>::FIRST_FRAME_MAX_SIZE == 6);
+        static_assert (Normal::Geometry<8>::ESCAPED_FIRST_FRAME_MAX_SIZE == 2);
+        static_assert (Normal::Geometry<8>::CONSECUTIVE_FRAME_MAX_SIZE == 7);
+        static_assert (Normal::FLOW_CONTROL_FRAME_SIZE == 3);
+
+        static_assert (Extended::Geometry<8>::SINGLE_FRAME_MAX_SIZE == 6);
+        static_assert (Extended::Geometry<8>::FIRST_FRAME_MAX_SIZE == 5);
+        static_assert (Extended::Geometry<8>::CONSECUTIVE_FRAME_MAX_SIZE == 6);
+        static_assert (Extended::FLOW_CONTROL_FRAME_SIZE == 4);
+
+        static_assert (Normal::Geometry<64>::SINGLE_FRAME_MAX_SIZE == 62);
+        static_assert (Normal::Geometry<64>::FIRST_FRAME_MAX_SIZE == 62);
+        static_assert (Normal::Geometry<64>::CONSECUTIVE_FRAME_MAX_SIZE == 63);
+        static_assert (Extended::Geometry<64>::SINGLE_FRAME_MAX_SIZE == 61);
+        static_assert (Extended::Geometry<64>::ESCAPED_FIRST_FRAME_MAX_SIZE == 57);
+        static_assert (Extended::Geometry<64>::CONSECUTIVE_FRAME_MAX_SIZE == 62);
+
+        REQUIRE (Extended::singleFrameMaxSize (12) == 9);
+        REQUIRE (Extended::firstFrameMaxSize (16) == 13);
+}
+
+/**
+ * Sends len bytes from a to b (in blocks of 2 Consecutive Frames) and returns the frames sent by a.
+ */
+template <typename Encoder, typename FrameT> std::vector<FrameT> roundTrip (Address const &a, Address const &b, size_t len)
+{
+        std::vector<FrameT> framesFromR;
+        std::vector<FrameT> framesFromT;
+        std::vector<FrameT> sent;
+        std::vector<uint8_t> received;
+
+        auto tpR = create<FrameT, Encoder> (
+                b, [&received] (auto const &isoMessage) { received = isoMessage; },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        tpR.setBlockSize (2);
+
+        auto tpT = create<FrameT, Encoder> (
+                a, [] (auto const & /*unused*/) {},
+                [&framesFromT] (auto const &canFrame) {
+                        framesFromT.push_back (canFrame);
+                        return true;
+                });
+
+        std::vector<uint8_t> payload (len);
+        for (size_t i = 0; i < len; ++i) {
+                payload[i] = uint8_t (i + 1);
+        }
+
+        REQUIRE (tpT.send (payload));
+
+        do {
+                tpT.run ();
+                for (FrameT &f : framesFromT) {
+                        REQUIRE (Encoder::localFilter (b).accepts (f.id, f.extended));
+                        tpR.onCanNewFrame (f);
+                        sent.push_back (f);
+                }
+                framesFromT.clear ();
+
+                tpR.run ();
+                for (FrameT &f : framesFromR) {
+                        REQUIRE (Encoder::localFilter (a).accepts (f.id, f.extended));
+                        tpT.onCanNewFrame (f);
+                }
+                framesFromR.clear ();
+        } while (tpT.isSending ());
+
+        REQUIRE (received == payload);
+        return sent;
+}
+
+TEST_CASE ("Extended and mixed addressing transmission", "[address]")
+{
+        Address const ext1 (0x100, 0x200, 0x11, 0x22);
+        Address const ext2 (0x200, 0x100, 0x22, 0x11);
+
+        // 6 bytes in a Single Frame, after the N_TA.
+        auto sf = roundTrip<Extended29AddressEncoder, CanFrame> (ext1, ext2, 6);
+        REQUIRE (sf.size () == 1);
+        REQUIRE (sf[0].dlc == 8);
+        REQUIRE (sf[0].data[0] == 0x22);
+        REQUIRE (sf[0].data[1] == 0x06);
+        REQUIRE (sf[0].data[2] == 1);
+
+        // 5 bytes in the First Frame and 6 in the Consecutive ones.
+        auto mf = roundTrip<Extended29AddressEncoder, CanFrame> (ext1, ext2, 30);
+        REQUIRE (mf.size () == 1 + 5);
+        REQUIRE (mf[0].data[0] == 0x22);
+        REQUIRE (mf[0].data[1] == 0x10);
+        REQUIRE (mf[0].data[2] == 30);
+        REQUIRE (mf[0].data[3] == 1);
+        REQUIRE (mf[1].data[0] == 0x22);
+        REQUIRE (mf[1].data[1] == 0x21);
+        REQUIRE (mf[1].data[2] == 6);
+        REQUIRE (mf[5].dlc == 2 + 1);
+
+        roundTrip<Extended11AddressEncoder, CanFrame> (Address (0x100, 0x200, 0x11, 0x22), Address (0x200, 0x100, 0x22, 0x11), 100);
+        roundTrip<Mixed11AddressEncoder, CanFrame> (Address (0x100, 0x200, 0, 0, 0x55), Address (0x200, 0x100, 0, 0, 0x55), 100);
+        roundTrip<Mixed29AddressEncoder, CanFrame> (Address (0, 0, 0x11, 0x22, 0x33), Address (0, 0, 0x22, 0x11, 0x33), 100);
+
+        // CAN FD : 61 bytes in the Single Frame, 61 + 62 + ... in the segmented one.
+        REQUIRE (roundTrip<Extended29AddressEncoder, CanFdFrame> (ext1, ext2, 61).size () == 1);
+        auto fd = roundTrip<Extended29AddressEncoder, CanFdFrame> (ext1, ext2, 200);
+        REQUIRE (fd.size () == 4);
+        REQUIRE (fd[0].dlc == 64);
+        REQUIRE (fd[3].dlc == 20); // 200 - 61 - 2 * 62 = 15 bytes, N_TA and PCI padded to 20.
+}
+
+/*****************************************************************************/
+
+TEST_CASE ("Local filters", "[address]")
+{
+        auto n11 = Normal11AddressEncoder::localFilter (Address (0x123, 0x456));
+        REQUIRE (n11.accepts (0x123, false));
+        REQUIRE (!n11.accepts (0x124, false));
+        REQUIRE (!n11.accepts (0x123, true));
+
+        auto n29 = Normal29AddressEncoder::localFilter (Address (0x123456, 0x654321));
+        REQUIRE (n29.accepts (0x123456, true));
+        REQUIRE (!n29.accepts (0x123457, true));
+        REQUIRE (!n29.accepts (0x456, false));
+
+        // N_TA has to be our N_SA, N_SA and N_TAtype can be anything.
+        auto nf29 = NormalFixed29AddressEncoder::localFilter (Address (0, 0, 0x22, 0x11));
+        REQUIRE (nf29.id == 0x18da2200);
+        REQUIRE (nf29.mask == 0x1ffeff00);
+        REQUIRE (nf29.accepts (0x18da2211, true));
+        REQUIRE (nf29.accepts (0x18da22f1, true));
+        REQUIRE (nf29.accepts (0x18db2233, true));
+        REQUIRE (!nf29.accepts (0x18da2322, true));
+        REQUIRE (!nf29.accepts (0x18ea2211, true));
+
+        // First data byte (N_TA or N_AE) is not checked.
+        REQUIRE (Extended11AddressEncoder::localFilter (Address (0x123, 0x456, 0xaa, 0x55)).accepts (0x123, false));
+        REQUIRE (Extended29AddressEncoder::localFilter (Address (0x123456, 0x654321, 0xaa, 0x55)).accepts (0x123456, true));
+        REQUIRE (Mixed11AddressEncoder::localFilter (Address (0x123, 0x456, 0, 0, 0x99)).accepts (0x123, false));
+
+        auto m29 = Mixed29AddressEncoder::localFilter (Address (0, 0, 0x22, 0x11, 0x99));
+        REQUIRE (m29.accepts (0x18ce2211, true));
+        REQUIRE (m29.accepts (0x18cd2211, true));
+        REQUIRE (!m29.accepts (0x18ce2311, true));
+        REQUIRE (!m29.accepts (0x18da2211, true));
+}
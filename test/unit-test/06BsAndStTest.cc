@@ -119,3 +119,576 @@ TEST_CASE ("SeparationTime test", "[address]")
 
         REQUIRE (called == 2);
 }
+
+namespace {
+uint32_t fakeTimeUs{};
+}
+
+struct FakeUsTimeProvider {
+        static constexpr uint32_t TICKS_PER_SECOND = 1000000;
+        uint32_t operator() () const { return fakeTimeUs; }
+};
+
+/**
+ * STmin 0xf1 - 0xf9 means 100 - 900µs, and has to be honored exactly, not rounded to 0 or 1ms.
+ */
+TEST_CASE ("Sub millisecond separation time", "[address]")
+{
+        std::vector<CanFrame> frames;
+        auto output = [&frames] (auto const &canFrame) {
+                frames.push_back (canFrame);
+                return true;
+        };
+        auto callback = [] (auto const & /* isoMessage */) {};
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             decltype (output), FakeUsTimeProvider, InfiniteLoop, decltype (callback), 1>>;
+
+        TP tp{Address (0x10, 0x20), callback, output};
+        fakeTimeUs = 1000000;
+
+        REQUIRE (tp.send (std::vector<uint8_t> (27))); // First frame + 3 consecutive frames.
+        tp.run ();
+        tp.run ();
+        REQUIRE (frames.size () == 1); // First frame.
+
+        tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0xf3)); // STmin = 300µs
+        tp.run ();
+        REQUIRE (frames.size () == 2); // First consecutive frame goes right away.
+        REQUIRE (*tp.timeToNextDeadline () == 300);
+
+        fakeTimeUs += 299;
+        tp.run ();
+        REQUIRE (frames.size () == 2);
+
+        fakeTimeUs += 1;
+        tp.run ();
+        REQUIRE (frames.size () == 3);
+
+        fakeTimeUs += 300;
+        tp.run ();
+        REQUIRE (frames.size () == 4);
+        REQUIRE (!tp.isSending ());
+}
+
+/**
+ * Output interface with a limited number of TX mailboxes.
+ */
+struct MailboxOutput {
+        bool operator() (CanFrame const &f)
+        {
+                frames->push_back (f);
+                --*freeMailboxes;
+                return true;
+        }
+
+        size_t txCapacity () const { return *freeMailboxes; }
+
+        std::vector<CanFrame> *frames;
+        size_t *freeMailboxes;
+};
+
+TEST_CASE ("Burst", "[address]")
+{
+        std::vector<CanFrame> frames;
+        size_t freeMailboxes = 1000;
+        auto callback = [] (auto const & /* isoMessage */) {};
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             MailboxOutput, FakeUsTimeProvider, InfiniteLoop, decltype (callback), 1>>;
+
+        TP tp{Address (0x10, 0x20), callback, MailboxOutput{&frames, &freeMailboxes}};
+        tp.setMaxBurst (100);
+        fakeTimeUs = 1000000;
+
+        auto start = [&] (uint8_t bs, uint8_t stMin) {
+                frames.clear ();
+                REQUIRE (tp.send (std::vector<uint8_t> (104))); // First frame + 14 consecutive frames.
+                tp.run ();
+                tp.run ();
+                REQUIRE (frames.size () == 1);
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, bs, stMin));
+        };
+
+        SECTION ("STmin 0, BS 0")
+        {
+                start (0, 0);
+                tp.run ();
+                REQUIRE (frames.size () == 15);
+                REQUIRE (!tp.isSending ());
+        }
+
+        SECTION ("Block size")
+        {
+                start (4, 0);
+                tp.run ();
+                REQUIRE (frames.size () == 5);
+                tp.run ();
+                REQUIRE (frames.size () == 5); // Waits for the flow control frame.
+
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 4, 0));
+                tp.run ();
+                REQUIRE (frames.size () == 9);
+        }
+
+        SECTION ("STmin is honored")
+        {
+                start (0, 1);
+                tp.run ();
+                REQUIRE (frames.size () == 2);
+                tp.run ();
+                REQUIRE (frames.size () == 2);
+
+                fakeTimeUs += 1000;
+                tp.run ();
+                REQUIRE (frames.size () == 3);
+        }
+
+        SECTION ("TX capacity")
+        {
+                start (0, 0);
+                freeMailboxes = 3;
+                tp.run ();
+                REQUIRE (frames.size () == 4);
+                tp.run ();
+                REQUIRE (frames.size () == 4);
+
+                // Asked again after the retry interval.
+                freeMailboxes = 1000;
+                fakeTimeUs += TX_RETRY_INTERVAL_US;
+                tp.run ();
+                REQUIRE (frames.size () == 15);
+        }
+
+        SECTION ("No TX capacity")
+        {
+                start (0, 0);
+                freeMailboxes = 0;
+                tp.run ();
+                REQUIRE (frames.size () == 1);
+
+                // An event loop can sleep instead of calling run over and over.
+                REQUIRE (tp.timeToNextDeadline () == TX_RETRY_INTERVAL_US);
+                fakeTimeUs += TX_RETRY_INTERVAL_US / 2;
+                tp.run ();
+                REQUIRE (tp.timeToNextDeadline () == TX_RETRY_INTERVAL_US / 2);
+
+                freeMailboxes = 2;
+                fakeTimeUs += TX_RETRY_INTERVAL_US / 2;
+                tp.run ();
+                REQUIRE (frames.size () == 3);
+
+                // No room for N_As : the transmission is aborted.
+                tp.run ();
+
+                for (uint32_t i = 0; i <= N_A_TIMEOUT * US_PER_MS / TX_RETRY_INTERVAL_US && tp.isSending (); ++i) {
+                        REQUIRE (tp.timeToNextDeadline () == TX_RETRY_INTERVAL_US);
+                        fakeTimeUs += TX_RETRY_INTERVAL_US;
+                        tp.run ();
+                }
+
+                REQUIRE (!tp.isSending ());
+                REQUIRE (frames.size () == 3);
+        }
+}
+
+/**
+ * Output interface which sends many frames at once.
+ */
+struct BatchOutput {
+        bool operator() (CanFrame const &f)
+        {
+                frames->push_back (f);
+                return true;
+        }
+
+        size_t sendBatch (etl::span<CanFrame const> batch)
+        {
+                size_t n = std::min (batch.size (), accept);
+                frames->insert (frames->end (), batch.begin (), batch.begin () + n);
+                batchSizes->push_back (batch.size ());
+                return n;
+        }
+
+        std::vector<CanFrame> *frames;
+        std::vector<size_t> *batchSizes;
+        size_t accept = 1000;
+};
+
+TEST_CASE ("Batched output", "[address]")
+{
+        std::vector<CanFrame> frames;
+        std::vector<size_t> batchSizes;
+        std::vector<Result> confirmed;
+
+        struct Callback {
+                void indication (Address const & /* a */, IsoMessage const & /* msg */, Result /* r */) {}
+                void confirm (Address const & /* a */, Result r) { confirmed->push_back (r); }
+                std::vector<Result> *confirmed;
+        };
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             BatchOutput, FakeUsTimeProvider, InfiniteLoop, Callback, 1>>;
+
+        TP tp{Address (0x10, 0x20), Callback{&confirmed}, BatchOutput{&frames, &batchSizes}};
+        tp.setMaxBurst (100);
+
+        REQUIRE (tp.send (std::vector<uint8_t> (104))); // First frame + 14 consecutive frames.
+        tp.run ();
+        tp.run ();
+        REQUIRE (frames.size () == 1);
+
+        SECTION ("Whole message")
+        {
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0));
+                tp.run ();
+                REQUIRE (batchSizes == std::vector<size_t>{14});
+                REQUIRE (frames.size () == 15);
+                REQUIRE (frames.back ().data[0] == 0x2e);
+                REQUIRE (!tp.isSending ());
+        }
+
+        SECTION ("Blocks")
+        {
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 8, 0));
+                tp.run ();
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 8, 0));
+                tp.run ();
+                REQUIRE (batchSizes == std::vector<size_t>{8, 6});
+                REQUIRE (!tp.isSending ());
+        }
+
+        SECTION ("Not accepted")
+        {
+                // The rest is sent again after TX_RETRY_INTERVAL_US.
+                tp.outputInterface.accept = 3;
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0));
+                tp.run ();
+                REQUIRE (frames.size () == 4);
+                REQUIRE (tp.isSending ());
+                REQUIRE (tp.timeToNextDeadline () == TX_RETRY_INTERVAL_US);
+
+                tp.outputInterface.accept = 1000;
+                tp.run ();
+                REQUIRE (frames.size () == 4);
+
+                fakeTimeUs += TX_RETRY_INTERVAL_US;
+                tp.run ();
+                REQUIRE (batchSizes == std::vector<size_t>{14, 11});
+                REQUIRE (frames.size () == 15);
+                REQUIRE (frames[4].data[0] == 0x24);
+                REQUIRE (frames.back ().data[0] == 0x2e);
+                REQUIRE (confirmed.back () == Result::N_OK);
+                REQUIRE (!tp.isSending ());
+        }
+
+        SECTION ("Not accepted for N_As")
+        {
+                tp.outputInterface.accept = 0;
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0));
+
+                for (uint32_t t = 0; t < N_A_TIMEOUT * US_PER_MS; t += TX_RETRY_INTERVAL_US) {
+                        tp.run ();
+                        REQUIRE (tp.isSending ());
+                        fakeTimeUs += TX_RETRY_INTERVAL_US;
+                }
+
+                tp.run ();
+                REQUIRE (frames.size () == 1);
+                REQUIRE (confirmed.back () == Result::N_TIMEOUT_A);
+                REQUIRE (!tp.isSending ());
+        }
+}
+
+/**
+ * Batched output which can tell that the frames it didn't accept failed.
+ */
+struct FailingBatchOutput : public BatchOutput {
+        BatchOutputResult sendBatch (etl::span<CanFrame const> batch)
+        {
+                return {BatchOutput::sendBatch (batch), (fail) ? (OutputResult::FAILED) : (OutputResult::RETRY)};
+        }
+
+        bool fail{};
+};
+
+TEST_CASE ("Batched output failure", "[address]")
+{
+        std::vector<CanFrame> frames;
+        std::vector<size_t> batchSizes;
+        std::vector<Result> confirmed;
+
+        struct Callback {
+                void indication (Address const & /* a */, IsoMessage const & /* msg */, Result /* r */) {}
+                void confirm (Address const & /* a */, Result r) { confirmed->push_back (r); }
+                std::vector<Result> *confirmed;
+        };
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             FailingBatchOutput, FakeUsTimeProvider, InfiniteLoop, Callback, 1>>;
+
+        TP tp{Address (0x10, 0x20), Callback{&confirmed}, FailingBatchOutput{{&frames, &batchSizes}}};
+        tp.setMaxBurst (100);
+
+        REQUIRE (tp.send (std::vector<uint8_t> (104)));
+        tp.run ();
+        tp.run ();
+        REQUIRE (frames.size () == 1);
+
+        SECTION ("Retried")
+        {
+                tp.outputInterface.accept = 3;
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0));
+                tp.run ();
+                REQUIRE (frames.size () == 4);
+                REQUIRE (tp.isSending ());
+                REQUIRE (tp.timeToNextDeadline () == TX_RETRY_INTERVAL_US);
+        }
+
+        SECTION ("Failed")
+        {
+                // No waiting for N_As.
+                tp.outputInterface.accept = 3;
+                tp.outputInterface.fail = true;
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0));
+                tp.run ();
+                REQUIRE (frames.size () == 4);
+                REQUIRE (confirmed.back () == Result::N_TIMEOUT_A);
+                REQUIRE (!tp.isSending ());
+        }
+}
+
+/*****************************************************************************/
+
+/**
+ * Output interface returning OutputResult. The first rejected frames ask for a retry.
+ */
+struct BackpressureOutput {
+        OutputResult operator() (CanFrame const &f)
+        {
+                if (*retries > 0) {
+                        --*retries;
+                        return OutputResult::RETRY;
+                }
+
+                if (*fail) {
+                        return OutputResult::FAILED;
+                }
+
+                frames->push_back (f);
+                return OutputResult::SENT;
+        }
+
+        std::vector<CanFrame> *frames;
+        int *retries;
+        bool *fail;
+};
+
+TEST_CASE ("Output backpressure", "[address]")
+{
+        std::vector<CanFrame> frames;
+        std::vector<Result> confirmed;
+        int retries{};
+        bool fail{};
+
+        struct Callback {
+                void indication (Address const & /* a */, IsoMessage const & /* msg */, Result /* r */) {}
+                void confirm (Address const & /* a */, Result r) { confirmed->push_back (r); }
+                std::vector<Result> *confirmed;
+        };
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             BackpressureOutput, FakeUsTimeProvider, InfiniteLoop, Callback, 1>>;
+
+        TP tp{Address (0x10, 0x20), Callback{&confirmed}, BackpressureOutput{&frames, &retries, &fail}};
+        tp.setMaxBurst (100);
+        fakeTimeUs = 1000000;
+
+        REQUIRE (tp.send (std::vector<uint8_t> (104))); // First frame + 14 consecutive frames.
+        tp.run ();
+
+        SECTION ("First frame")
+        {
+                retries = 2;
+                tp.run ();
+                tp.run ();
+                REQUIRE (frames.empty ());
+
+                fakeTimeUs += TX_RETRY_INTERVAL_US;
+                tp.run ();
+                REQUIRE (frames.empty ());
+
+                fakeTimeUs += TX_RETRY_INTERVAL_US;
+                tp.run ();
+                REQUIRE (frames.size () == 1);
+                REQUIRE (confirmed == std::vector<Result>{Result::N_OK});
+        }
+
+        SECTION ("Consecutive frames")
+        {
+                tp.setMaxBurst (1);
+                tp.run ();
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0));
+                fakeTimeUs += 1000 * US_PER_MS;
+
+                // Every one of them is retried once. The first one for almost N_As, past the N_Cr started by the flow control frame.
+                for (size_t i = 0; i < 14; ++i) {
+                        retries = 1;
+                        tp.run ();
+                        REQUIRE (frames.size () == 1 + i);
+                        fakeTimeUs += (i == 0) ? (N_A_TIMEOUT * US_PER_MS - 1) : (TX_RETRY_INTERVAL_US);
+                        tp.run ();
+                        REQUIRE (frames.size () == 2 + i);
+                }
+
+                REQUIRE (frames[1].data[0] == 0x21);
+                REQUIRE (frames[2].data[0] == 0x22);
+                REQUIRE (confirmed.back () == Result::N_OK);
+                REQUIRE (!tp.isSending ());
+        }
+
+        SECTION ("Failed")
+        {
+                fail = true;
+                tp.run ();
+                REQUIRE (frames.empty ());
+                REQUIRE (confirmed == std::vector<Result>{Result::N_TIMEOUT_A});
+                REQUIRE (!tp.isSending ());
+        }
+
+        SECTION ("Single frame")
+        {
+                tp.run ();
+                retries = 1;
+                REQUIRE (!tp.send (std::vector<uint8_t> (3)));
+                REQUIRE (confirmed.back () == Result::N_TIMEOUT_A);
+                REQUIRE (tp.send (std::vector<uint8_t> (3)));
+        }
+}
+
+/*****************************************************************************/
+
+/**
+ * Producer of (offset * 3) bytes, which has to be asked for every offset once, in order
+ * (like a compressor would).
+ */
+struct OrderedProducer {
+        size_t operator() (size_t offset, etl::span<uint8_t> out)
+        {
+                REQUIRE (offset == next);
+
+                for (size_t i = 0; i < out.size (); ++i) {
+                        out[i] = uint8_t ((offset + i) * 3);
+                }
+
+                next += out.size ();
+                return out.size ();
+        }
+
+        size_t next{};
+};
+
+/// Payload of a message sent as a First Frame and Consecutive Frames (Normal29, classic CAN).
+static std::vector<uint8_t> payloadOf (std::vector<CanFrame> const &frames)
+{
+        std::vector<uint8_t> payload;
+
+        for (size_t i = 0; i < frames.size (); ++i) {
+                size_t offset = (i == 0) ? (2) : (1);
+                payload.insert (payload.end (), frames[i].data.begin () + offset, frames[i].data.begin () + frames[i].dlc);
+        }
+
+        return payload;
+}
+
+TEST_CASE ("Streamed output retries", "[address]")
+{
+        std::vector<CanFrame> frames;
+        std::vector<Result> confirmed;
+        OrderedProducer producer;
+
+        std::vector<uint8_t> expected (104);
+
+        for (size_t i = 0; i < expected.size (); ++i) {
+                expected[i] = uint8_t (i * 3);
+        }
+
+        struct Callback {
+                void indication (Address const & /* a */, IsoMessage const & /* msg */, Result /* r */) {}
+                void confirm (Address const & /* a */, Result r) { confirmed->push_back (r); }
+                std::vector<Result> *confirmed;
+        };
+
+        fakeTimeUs = 1000000;
+
+        SECTION ("Retry")
+        {
+                int retries{};
+                bool fail{};
+
+                using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                                     BackpressureOutput, FakeUsTimeProvider, InfiniteLoop, Callback, 1>>;
+
+                TP tp{Address (0x10, 0x20), Callback{&confirmed}, BackpressureOutput{&frames, &retries, &fail}};
+                REQUIRE (tp.sendStreamed (expected.size (), producer));
+                tp.run ();
+
+                // The First Frame and every Consecutive Frame are retried once.
+                retries = 1;
+                tp.run ();
+                REQUIRE (frames.empty ());
+                fakeTimeUs += TX_RETRY_INTERVAL_US;
+                tp.run ();
+                REQUIRE (frames.size () == 1);
+
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0));
+
+                while (tp.isSending ()) {
+                        retries = 1;
+                        tp.run ();
+                        fakeTimeUs += TX_RETRY_INTERVAL_US;
+                        tp.run ();
+                }
+
+                REQUIRE (frames.size () == 15);
+                REQUIRE (payloadOf (frames) == expected);
+                REQUIRE (producer.next == expected.size ());
+                REQUIRE (confirmed.back () == Result::N_OK);
+        }
+
+        SECTION ("Partial batch")
+        {
+                std::vector<size_t> batchSizes;
+
+                using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                                     BatchOutput, FakeUsTimeProvider, InfiniteLoop, Callback, 1>>;
+
+                TP tp{Address (0x10, 0x20), Callback{&confirmed}, BatchOutput{&frames, &batchSizes}};
+                tp.setMaxBurst (100);
+                REQUIRE (tp.sendStreamed (expected.size (), producer));
+                tp.run ();
+                tp.run ();
+                REQUIRE (frames.size () == 1);
+
+                // 3 of 14, then 5 of the remaining 11 are accepted.
+                tp.outputInterface.accept = 3;
+                tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 0));
+                tp.run ();
+                REQUIRE (frames.size () == 4);
+
+                tp.outputInterface.accept = 5;
+                fakeTimeUs += TX_RETRY_INTERVAL_US;
+                tp.run ();
+                REQUIRE (frames.size () == 9);
+
+                tp.outputInterface.accept = 1000;
+                fakeTimeUs += TX_RETRY_INTERVAL_US;
+                tp.run ();
+
+                REQUIRE (batchSizes == std::vector<size_t>{14, 11, 6});
+                REQUIRE (payloadOf (frames) == expected);
+                REQUIRE (producer.next == expected.size ());
+                REQUIRE (confirmed.back () == Result::N_OK);
+                REQUIRE (!tp.isSending ());
+        }
+}
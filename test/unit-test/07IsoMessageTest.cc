@@ -221,3 +221,66 @@ TEST_CASE ("etl::vector 16B", "[isoMessage]")
 
         REQUIRE (called);
 }
+
+/*****************************************************************************/
+
+namespace {
+size_t allocations{};
+}
+
+/// Counts the allocations of the IsoMessage's buffer.
+template <typename T> struct CountingAllocator : public std::allocator<T> {
+        using value_type = T;
+
+        CountingAllocator () = default;
+        template <typename U> CountingAllocator (CountingAllocator<U> const & /* a */) {}
+
+        template <typename U> struct rebind {
+                using other = CountingAllocator<U>;
+        };
+
+        T *allocate (size_t n)
+        {
+                ++allocations;
+                return std::allocator<T>{}.allocate (n);
+        }
+
+        void deallocate (T *p, size_t n) { std::allocator<T>{}.deallocate (p, n); }
+};
+
+/**
+ * The First Frame reserves the whole buffer at once, and the buffers are reused by
+ * subsequent messages, so in the steady state receiving doesn't allocate.
+ */
+TEST_CASE ("Receive buffer reuse", "[isoMessage]")
+{
+        using CountingMessage = std::vector<uint8_t, CountingAllocator<uint8_t>>;
+        size_t received = 0;
+
+        auto tp = create<CanFrame, Normal29AddressEncoder, CountingMessage> (
+                Address (0x89, 0x12), [&received] (auto const & /* isoMessage */) { ++received; },
+                [] (auto const & /* canFrame */) { return true; });
+
+        auto receive = [&tp] {
+                // 100 bytes : FF + 14 CFs.
+                tp.onCanNewFrame (CanFrame (0x89, true, 0x10, 100, 0, 1, 2, 3, 4, 5));
+
+                for (int sn = 1; sn <= 14; ++sn) {
+                        tp.onCanNewFrame (CanFrame (0x89, true, 0x20 | (sn & 0x0f), 0, 1, 2, 3, 4, 5, 6));
+                }
+
+                tp.onCanNewFrame (CanFrame (0x89, true, 0x03, 0xaa, 0xbb, 0xcc));
+        };
+
+        allocations = 0;
+        receive ();
+        REQUIRE (received == 2);
+        REQUIRE (allocations == 2); // One for the whole segmented message, one for the single frame.
+
+        for (int i = 0; i < 10; ++i) {
+                receive ();
+        }
+
+        REQUIRE (received == 22);
+        REQUIRE (allocations == 2);
+}
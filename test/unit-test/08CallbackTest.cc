@@ -9,6 +9,8 @@
 #include "LinuxTransportProtocol.h"
 #include <catch2/catch.hpp>
 #include <etl/vector.h>
+#include <numeric>
+#include <vector>
 
 using namespace tp;
 
@@ -254,3 +256,291 @@ TEST_CASE ("First Frame callback", "[callbacks]")
 
         REQUIRE (called == 12);
 }
+
+/*****************************************************************************/
+
+namespace {
+int copies{};
+}
+
+/// std::vector which counts its copies.
+struct CopyCountingMessage : public std::vector<uint8_t> {
+        using std::vector<uint8_t>::vector;
+        CopyCountingMessage () = default;
+        CopyCountingMessage (CopyCountingMessage const &m) : std::vector<uint8_t> (m) { ++copies; }
+        CopyCountingMessage (CopyCountingMessage &&m) noexcept = default;
+        CopyCountingMessage &operator= (CopyCountingMessage const &m)
+        {
+                std::vector<uint8_t>::operator= (m);
+                ++copies;
+                return *this;
+        }
+        CopyCountingMessage &operator= (CopyCountingMessage &&m) noexcept = default;
+};
+
+/**
+ * Callbacks taking the message by rvalue reference get the buffer the protocol assembled.
+ */
+TEST_CASE ("Moving callback", "[callbacks]")
+{
+        std::vector<CopyCountingMessage> kept;
+        kept.reserve (4);
+
+        auto tpR = create<CanFrame, Normal29AddressEncoder, CopyCountingMessage> (
+                Address (0x89, 0x67),
+                [&kept] (Address const & /* address */, CopyCountingMessage &&isoMessage, Result result) {
+                        if (result == Result::N_OK) {
+                                kept.push_back (std::move (isoMessage));
+                        }
+                },
+                [] (auto const & /* canFrame */) { return true; });
+
+        copies = 0;
+
+        // Single frame.
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x02, 0xaa, 0xbb));
+
+        // Segmented.
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x10, 10, 0, 1, 2, 3, 4, 5));
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x21, 6, 7, 8, 9));
+
+        REQUIRE (kept.size () == 2);
+        REQUIRE (kept[0] == CopyCountingMessage{0xaa, 0xbb});
+        REQUIRE (kept[1] == CopyCountingMessage{0, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+        REQUIRE (copies == 0);
+
+        // The session buffer went with the message, and the next one starts empty.
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x10, 8, 0, 1, 2, 3, 4, 5));
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x21, 6, 7));
+        REQUIRE (kept.size () == 3);
+        REQUIRE (kept[2] == CopyCountingMessage{0, 1, 2, 3, 4, 5, 6, 7});
+        REQUIRE (copies == 0);
+}
+
+TEST_CASE ("Moving method callback", "[callbacks]")
+{
+        struct MovingCallback {
+                void indication (Address const & /* address */, CopyCountingMessage &&isoMessage, Result /* result */)
+                {
+                        kept->push_back (std::move (isoMessage));
+                }
+
+                std::vector<CopyCountingMessage> *kept;
+        };
+
+        std::vector<CopyCountingMessage> kept;
+        kept.reserve (4);
+
+        auto tpR = create<CanFrame, Normal29AddressEncoder, CopyCountingMessage> (Address (0x89, 0x67), MovingCallback{&kept},
+                                                                                 [] (auto const & /* canFrame */) { return true; });
+
+        copies = 0;
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x10, 9, 0, 1, 2, 3, 4, 5));
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x21, 6, 7, 8));
+
+        REQUIRE (kept.size () == 1);
+        REQUIRE (kept[0].size () == 9);
+        REQUIRE (copies == 0);
+}
+
+/*****************************************************************************/
+
+/**
+ * With onChunk the message is passed in pieces as the frames arrive, so it can be longer
+ * than the IsoMessage (here at most 16 bytes).
+ */
+TEST_CASE ("Streaming receive", "[callbacks]")
+{
+        struct StreamingCallback {
+                void onChunk (Address const &a, size_t offset, etl::span<uint8_t const> chunk)
+                {
+                        REQUIRE (a.getTxId () == 0x89);
+                        REQUIRE (offset == assembled->size ());
+                        assembled->insert (assembled->end (), chunk.begin (), chunk.end ());
+                        ++*chunks;
+                }
+
+                void indication (Address const & /* a */, etl::vector<uint8_t, 16> const &isoMessage, Result r)
+                {
+                        REQUIRE (isoMessage.empty ());
+                        results->push_back (r);
+                }
+
+                std::vector<uint8_t> *assembled;
+                int *chunks;
+                std::vector<Result> *results;
+        };
+
+        std::vector<uint8_t> assembled;
+        int chunks{};
+        std::vector<Result> results;
+
+        auto tpR = create<CanFrame, Normal29AddressEncoder, etl::vector<uint8_t, 16>, 16> (
+                Address (0x89, 0x12), StreamingCallback{&assembled, &chunks, &results}, [] (auto const & /* canFrame */) { return true; });
+
+        // 20 bytes : FF + 2 CFs.
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x10, 20, 0, 1, 2, 3, 4, 5));
+        REQUIRE (chunks == 1);
+        REQUIRE (results.empty ());
+
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x21, 6, 7, 8, 9, 10, 11, 12));
+        REQUIRE (chunks == 2);
+        REQUIRE (assembled.size () == 13);
+
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x22, 13, 14, 15, 16, 17, 18, 19));
+        REQUIRE (chunks == 3);
+        REQUIRE (results == std::vector<Result>{Result::N_OK});
+
+        std::vector<uint8_t> expected (20);
+        std::iota (expected.begin (), expected.end (), 0);
+        REQUIRE (assembled == expected);
+
+        // Single frames come as one chunk too.
+        assembled.clear ();
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x02, 0xaa, 0xbb));
+        REQUIRE (assembled == std::vector<uint8_t>{0xaa, 0xbb});
+        REQUIRE (results.size () == 2);
+
+        // Errors are reported as usual.
+        assembled.clear ();
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x10, 20, 0, 1, 2, 3, 4, 5));
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x23, 6, 7, 8, 9, 10, 11, 12));
+        REQUIRE (results.back () == Result::N_WRONG_SN);
+}
+
+/*****************************************************************************/
+
+namespace {
+uint32_t clockUs{};
+
+struct ClockUs {
+        static constexpr uint32_t TICKS_PER_SECOND = 1000000;
+        uint32_t operator() () const { return clockUs; }
+};
+} // namespace
+
+/**
+ * Frames with a receive timestamp : the timeouts count from it, and the callbacks get it.
+ */
+TEST_CASE ("Timestamped callback", "[callbacks]")
+{
+        struct TimestampedCallback {
+                void indication (Address const & /* address */, std::vector<uint8_t> const &isoMessage, Result result, uint32_t timeUs)
+                {
+                        messages->push_back (isoMessage);
+                        results->push_back (result);
+                        times->push_back (timeUs);
+                }
+
+                void firstFrameIndication (Address const & /* address */, uint32_t /* len */, uint32_t rxTimeUs) { times->push_back (rxTimeUs); }
+
+                std::vector<std::vector<uint8_t>> *messages;
+                std::vector<Result> *results;
+                std::vector<uint32_t> *times;
+        };
+
+        std::vector<std::vector<uint8_t>> messages;
+        std::vector<Result> results;
+        std::vector<uint32_t> times;
+
+        auto output = [] (auto const & /* canFrame */) { return true; };
+        auto tpR = create<CanFrame, Normal29AddressEncoder, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, decltype (output), ClockUs> (
+                Address (0x89, 0x12), TimestampedCallback{&messages, &results, &times}, output);
+
+        clockUs = 5000000;
+        CanFrame ff (0x89, true, 0x10, 20, 0, 1, 2, 3, 4, 5);
+        CanFrame cf1 (0x89, true, 0x21, 6, 7, 8, 9, 10, 11, 12);
+        CanFrame cf2 (0x89, true, 0x22, 13, 14, 15, 16, 17, 18, 19);
+
+        // Received 100ms before they are processed.
+        tpR.onCanNewFrame (ff, 4900000);
+        REQUIRE (times == std::vector<uint32_t>{4900000});
+        tpR.onCanNewFrame (cf1, 4950000);
+
+        // N_Cr counts from the reception of the consecutive frame.
+        clockUs = 4950000 + N_CR_TIMEOUT * 1000 - 1;
+        tpR.run ();
+        REQUIRE (results.empty ());
+
+        ++clockUs;
+        tpR.run ();
+        REQUIRE (results == std::vector<Result>{Result::N_TIMEOUT_CR});
+        REQUIRE (times.back () == clockUs);
+
+        // The time of the last frame is passed with the message.
+        CanFrame const frames[] = {ff, cf1, cf2};
+        uint32_t const rxTimes[] = {6000000, 6000100, 6000200};
+        tpR.onCanNewFrames (etl::span<CanFrame const> (frames, 3), etl::span<uint32_t const> (rxTimes, 3));
+
+        std::vector<uint8_t> expected (20);
+        std::iota (expected.begin (), expected.end (), 0);
+        REQUIRE (results.back () == Result::N_OK);
+        REQUIRE (messages.back () == expected);
+        REQUIRE (times.back () == 6000200);
+
+        // Lambda with 4 parameters. Without a timestamp, it's when the frame got processed.
+        uint32_t lambdaTime{};
+        auto tpL = create<CanFrame, Normal29AddressEncoder, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, decltype (output), ClockUs> (
+                Address (0x89, 0x12), [&lambdaTime] (Address const & /* a */, auto const & /* msg */, Result /* r */, uint32_t t) { lambdaTime = t; },
+                output);
+
+        tpL.onCanNewFrame (CanFrame (0x89, true, 0x01, 0xaa), 1234);
+        REQUIRE (lambdaTime == 1234);
+        tpL.onCanNewFrame (CanFrame (0x89, true, 0x01, 0xaa));
+        REQUIRE (lambdaTime == clockUs);
+}
+
+/**
+ * A flow control frame timestamped (skewed, or reordered) before the timers of the transmission
+ * were started doesn't make them look expired.
+ */
+TEST_CASE ("Timestamp earlier than the timer start", "[callbacks]")
+{
+        std::vector<CanFrame> frames;
+        std::vector<Result> confirmed;
+
+        struct Callback {
+                void indication (Address const & /* a */, std::vector<uint8_t> const & /* msg */, Result /* r */) {}
+                void confirm (Address const & /* a */, Result r) { confirmed->push_back (r); }
+                std::vector<Result> *confirmed;
+        };
+
+        auto output = [&frames] (auto const &canFrame) {
+                frames.push_back (canFrame);
+                return true;
+        };
+
+        auto tpT = create<CanFrame, Normal29AddressEncoder, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, decltype (output), ClockUs> (
+                Address (0x12, 0x89), Callback{&confirmed}, output);
+
+        // Near the wrap around of the µs clock.
+        clockUs = 0xffffff00;
+        REQUIRE (tpT.send (std::vector<uint8_t> (20)));
+        tpT.run ();
+        tpT.run ();
+        REQUIRE (frames.size () == 1);
+        REQUIRE (confirmed == std::vector<Result>{Result::N_OK});
+
+        clockUs += 0x200;
+        tpT.onCanNewFrame (CanFrame (0x12, true, 0x30, 0, 0), 0xffffff00 - 10);
+        REQUIRE (confirmed == std::vector<Result>{Result::N_OK}); // No N_TIMEOUT_BS.
+
+        while (tpT.isSending ()) {
+                tpT.run ();
+        }
+
+        REQUIRE (frames.size () == 3);
+        REQUIRE (confirmed == std::vector<Result>{Result::N_OK});
+
+        using Timer = decltype (tpT)::Timer;
+        Timer t;
+        REQUIRE (t.isExpired (0));
+        REQUIRE (t.isExpired (0x80000000));
+
+        t.start (1000, 0xffffff00);
+        REQUIRE (!t.isExpired (0xffffff00 - 1));
+        REQUIRE (t.elapsed (0xffffff00 - 1) == 0);
+        REQUIRE (!t.isExpired (0xffffff00 + 999));
+        REQUIRE (t.isExpired (0xffffff00 + 1000));
+        REQUIRE (t.elapsed (0xffffff00 + 1000) == 1000);
+}
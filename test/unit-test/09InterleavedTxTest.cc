@@ -0,0 +1,163 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "LinuxTransportProtocol.h"
+#include <catch2/catch.hpp>
+#include <vector>
+
+using namespace tp;
+
+/**
+ * One transmitter (a gateway) sends segmented messages to two ECUs at the same time.
+ * All the frames land on the same "bus" i.e. every node sees every frame.
+ */
+TEST_CASE ("Interleaved tx to 2 peers", "[interleavedTx]")
+{
+        std::vector<CanFrame> bus;
+        int calledA = 0;
+        int calledB = 0;
+
+        auto busOutput = [&bus] (auto const &canFrame) {
+                bus.push_back (canFrame);
+                return true;
+        };
+
+        auto ecuA = create (
+                Address (0x31, 0x30),
+                [&calledA] (auto const &isoMessage) {
+                        ++calledA;
+                        REQUIRE (isoMessage.size () == 64);
+                        REQUIRE (isoMessage[63] == 0xaa);
+                },
+                busOutput);
+
+        auto ecuB = create (
+                Address (0x41, 0x40),
+                [&calledB] (auto const &isoMessage) {
+                        ++calledB;
+                        REQUIRE (isoMessage.size () == 100);
+                        REQUIRE (isoMessage[99] == 0xbb);
+                },
+                busOutput);
+
+        auto gateway = create (Address (0x10, 0x20), [] (auto const & /* isoMessage */) {}, busOutput);
+
+        std::vector<uint8_t> messageA (64, 0xaa);
+        std::vector<uint8_t> messageB (100, 0xbb);
+
+        REQUIRE (gateway.send (Address (0x30, 0x31), messageA));
+        REQUIRE (gateway.send (Address (0x40, 0x41), messageB));
+        REQUIRE (gateway.isSending (Address (0x30, 0x31)));
+        REQUIRE (gateway.isSending (Address (0x40, 0x41)));
+
+        // Second segmented message to the same peer has to wait in the queue until the first one is done.
+        REQUIRE (gateway.send (Address (0x30, 0x31), messageA));
+        REQUIRE (gateway.getTxQueueStatistics ().depth == 1);
+
+        while (gateway.isSending ()) {
+                gateway.run ();
+                ecuA.run ();
+                ecuB.run ();
+
+                auto frames = std::move (bus);
+                bus.clear ();
+
+                for (CanFrame &f : frames) {
+                        gateway.onCanNewFrame (f);
+                        ecuA.onCanNewFrame (f);
+                        ecuB.onCanNewFrame (f);
+                }
+        }
+
+        REQUIRE (calledA == 2);
+        REQUIRE (calledB == 1);
+}
+
+/**
+ * In NormalFixed29 the flow control frames from all the ECUs have the same target
+ * address (that of the gateway) so they have to be told apart by the source address.
+ */
+TEST_CASE ("Interleaved tx NormalFixed29", "[interleavedTx]")
+{
+        std::vector<CanFrame> bus;
+        int called = 0;
+
+        auto busOutput = [&bus] (auto const &canFrame) {
+                bus.push_back (canFrame);
+                return true;
+        };
+
+        auto indication = [&called] (auto const &isoMessage) {
+                ++called;
+                REQUIRE (isoMessage.size () == 32);
+        };
+
+        auto ecuA = create<CanFrame, NormalFixed29AddressEncoder> (Address (0, 0, 0xa1, 0xf1), indication, busOutput);
+        auto ecuB = create<CanFrame, NormalFixed29AddressEncoder> (Address (0, 0, 0xb1, 0xf1), indication, busOutput);
+        auto gateway = create<CanFrame, NormalFixed29AddressEncoder> (
+                Address (0, 0, 0xf1, 0x00), [] (auto const & /* isoMessage */) {}, busOutput);
+
+        REQUIRE (gateway.send (Address (0, 0, 0xf1, 0xa1), std::vector<uint8_t> (32)));
+        REQUIRE (gateway.send (Address (0, 0, 0xf1, 0xb1), std::vector<uint8_t> (32)));
+
+        while (gateway.isSending ()) {
+                gateway.run ();
+
+                auto frames = std::move (bus);
+                bus.clear ();
+
+                for (CanFrame &f : frames) {
+                        gateway.onCanNewFrame (f);
+                        ecuA.onCanNewFrame (f);
+                        ecuB.onCanNewFrame (f);
+                }
+        }
+
+        REQUIRE (called == 2);
+}
+
+/**
+ * NormalFixed29 ignores the rx and tx ids, so addresses which differ only there are the
+ * same peer. Their flow control frames can't be told apart, so they are sent one by one.
+ */
+TEST_CASE ("Interleaved tx same peer key", "[interleavedTx]")
+{
+        auto gateway = create<CanFrame, NormalFixed29AddressEncoder> (
+                Address (0, 0, 0xf1, 0x00), [] (auto const & /* isoMessage */) {}, [] (auto const & /* canFrame */) { return true; });
+
+        Address a (0x01, 0x02, 0xf1, 0xa1);
+        Address b (0x03, 0x04, 0xf1, 0xa1);
+        REQUIRE (!(a == b));
+
+        REQUIRE (gateway.send (a, std::vector<uint8_t> (32)));
+        REQUIRE (gateway.isSending (b));
+
+        REQUIRE (gateway.send (b, std::vector<uint8_t> (32)));
+        REQUIRE (gateway.getTxQueueStatistics ().depth == 1);
+
+        // Still waits for the first one to finish.
+        gateway.run ();
+        REQUIRE (gateway.getTxQueueStatistics ().depth == 1);
+}
+
+TEST_CASE ("Interleaved tx pool exhausted", "[interleavedTx]")
+{
+        auto gateway = create (
+                Address (0x10, 0x20), [] (auto const & /* isoMessage */) {}, [] (auto const & /* canFrame */) { return true; });
+
+        constexpr size_t POOL_SIZE = decltype (gateway)::MAX_INTERLEAVED_TX_MESSAGES + decltype (gateway)::TX_QUEUE_SIZE;
+
+        for (size_t i = 0; i < POOL_SIZE; ++i) {
+                REQUIRE (gateway.send (Address (0x30 + i, 0x40 + i), std::vector<uint8_t> (16)));
+        }
+
+        REQUIRE (!gateway.send (Address (0x50, 0x60), std::vector<uint8_t> (16)));
+
+        // Single frames do not need a state machine.
+        REQUIRE (gateway.send (Address (0x50, 0x60), std::vector<uint8_t> (4)));
+}
@@ -0,0 +1,229 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "LinuxTransportProtocol.h"
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <vector>
+
+using namespace tp;
+
+/// Single transmission state machine, and a short transmit queue.
+template <size_t TX_QUEUE_SIZE, typename CallbackT, typename CanOutputInterfaceT>
+auto createQueued (Address const &myAddress, CallbackT callback, CanOutputInterfaceT outputInterface)
+{
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             CanOutputInterfaceT, ChronoTimeProvider, InfiniteLoop, CallbackT, 4, 1,
+                                                             TX_QUEUE_SIZE>>;
+
+        return TP{myAddress, callback, outputInterface};
+}
+
+class ConfirmCounter {
+public:
+        explicit ConfirmCounter (std::vector<Result> &r) : results{r} {}
+        void indication (Address const & /* address */, std::vector<uint8_t> const & /* isoMessage */, Result /* result */) {}
+        void confirm (Address const & /* address */, Result result) { results.push_back (result); }
+
+private:
+        std::vector<Result> &results;
+};
+
+TEST_CASE ("TxQueue reject", "[txQueue]")
+{
+        auto tp = createQueued<1> (
+                Address (0x10, 0x20), [] (auto const & /* isoMessage */) {}, [] (auto const & /* canFrame */) { return true; });
+
+        REQUIRE (tp.send (std::vector<uint8_t> (16))); // Goes directly to the state machine.
+        REQUIRE (tp.send (std::vector<uint8_t> (16))); // Waits in the queue.
+        REQUIRE (!tp.send (std::vector<uint8_t> (16)));
+
+        auto stats = tp.getTxQueueStatistics ();
+        REQUIRE (stats.depth == 1);
+        REQUIRE (stats.maxDepth == 1);
+        REQUIRE (stats.queued == 1);
+        REQUIRE (stats.rejected == 1);
+        REQUIRE (stats.dropped == 0);
+}
+
+TEST_CASE ("TxQueue drop oldest", "[txQueue]")
+{
+        std::vector<Result> results;
+        auto tp = createQueued<2> (Address (0x10, 0x20), ConfirmCounter (results), [] (auto const & /* canFrame */) { return true; });
+        tp.setTxQueuePolicy (TxQueuePolicy::DROP_OLDEST);
+
+        REQUIRE (tp.send (std::vector<uint8_t> (16)));
+        REQUIRE (tp.send (std::vector<uint8_t> (17)));
+        REQUIRE (tp.send (std::vector<uint8_t> (18)));
+        REQUIRE (tp.send (std::vector<uint8_t> (19)));
+
+        REQUIRE (results.size () == 1);
+        REQUIRE (results.front () == Result::N_TX_DROPPED);
+
+        // The one with 17 bytes was dropped.
+        REQUIRE (tp.txQueue.front ().message.size () == 18);
+
+        auto stats = tp.getTxQueueStatistics ();
+        REQUIRE (stats.depth == 2);
+        REQUIRE (stats.queued == 3);
+        REQUIRE (stats.dropped == 1);
+        REQUIRE (stats.rejected == 0);
+}
+
+TEST_CASE ("TxQueue block", "[txQueue]")
+{
+        auto noFrames = [] (uint32_t /* maxWaitUs */) {};
+
+        /*
+         * The peer never responds with a flow control frame, so the first message blocks
+         * the state machine for N_Bs, and the blocking send gives up after the timeout.
+         */
+        {
+                auto tp = createQueued<1> (
+                        Address (0x10, 0x20), [] (auto const & /* isoMessage */) {}, [] (auto const & /* canFrame */) { return true; });
+                tp.setTxQueuePolicy (TxQueuePolicy::BLOCK, 20);
+                tp.setTxBlockHook (noFrames);
+
+                REQUIRE (tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (!tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (tp.getTxQueueStatistics ().rejected == 1);
+        }
+
+        /*
+         * CAN frames can't be sent, so transmissions are aborted quickly which makes room in
+         * the queue while send is blocked.
+         */
+        {
+                std::vector<Result> results;
+                auto tp = createQueued<1> (Address (0x10, 0x20), ConfirmCounter (results), [] (auto const & /* canFrame */) { return false; });
+                tp.setTxQueuePolicy (TxQueuePolicy::BLOCK, 1000);
+                tp.setTxBlockHook (noFrames);
+
+                REQUIRE (tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (tp.getTxQueueStatistics ().rejected == 0);
+                REQUIRE (results.size () == 1);
+                REQUIRE (results.front () == Result::N_TIMEOUT_A);
+        }
+
+        /*
+         * Without a hook there's no way to get the flow control frames, so send doesn't wait.
+         */
+        {
+                auto tp = createQueued<1> (
+                        Address (0x10, 0x20), [] (auto const & /* isoMessage */) {}, [] (auto const & /* canFrame */) { return true; });
+                tp.setTxQueuePolicy (TxQueuePolicy::BLOCK, 1000);
+
+                auto start = std::chrono::steady_clock::now ();
+                REQUIRE (tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (!tp.send (std::vector<uint8_t> (16)));
+                REQUIRE (std::chrono::steady_clock::now () - start < std::chrono::milliseconds (500));
+        }
+}
+
+TEST_CASE ("TxQueue block with a peer", "[txQueue]")
+{
+        std::vector<CanFrame> framesFromR;
+        std::vector<CanFrame> framesFromT;
+        std::vector<size_t> sizes;
+        std::vector<Result> results;
+
+        auto tpR = create (
+                Address (0x12, 0x89), [&sizes] (auto const &isoMessage) { sizes.push_back (isoMessage.size ()); },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        auto tpT = createQueued<1> (Address (0x89, 0x12), ConfirmCounter (results), [&framesFromT] (auto const &canFrame) {
+                framesFromT.push_back (canFrame);
+                return true;
+        });
+
+        // One iteration of the event loop : the peer answers with flow control frames.
+        size_t hookCalls = 0;
+        auto hook = [&] (uint32_t /* maxWaitUs */) {
+                ++hookCalls;
+
+                for (CanFrame &f : framesFromT) {
+                        tpR.onCanNewFrame (f);
+                }
+                framesFromT.clear ();
+
+                tpR.run ();
+                for (CanFrame &f : framesFromR) {
+                        tpT.onCanNewFrame (f);
+                }
+                framesFromR.clear ();
+        };
+
+        tpT.setTxQueuePolicy (TxQueuePolicy::BLOCK, 1000);
+        tpT.setTxBlockHook (hook);
+
+        REQUIRE (tpT.send (std::vector<uint8_t> (10)));
+        REQUIRE (tpT.send (std::vector<uint8_t> (11)));
+        REQUIRE (hookCalls == 0);
+
+        // Blocks until the first message is sent, and the second one moves out of the queue.
+        REQUIRE (tpT.send (std::vector<uint8_t> (12)));
+        REQUIRE (hookCalls > 0);
+        REQUIRE (sizes == std::vector<size_t>{10});
+        REQUIRE (tpT.getTxQueueStatistics ().rejected == 0);
+
+        while (tpT.isSending ()) {
+                tpT.run ();
+                hook (0);
+        }
+
+        REQUIRE (sizes == std::vector<size_t>{10, 11, 12});
+        REQUIRE (results == std::vector<Result>{Result::N_OK, Result::N_OK, Result::N_OK}); // No timeouts.
+}
+
+TEST_CASE ("TxQueue order", "[txQueue]")
+{
+        std::vector<CanFrame> framesFromR;
+        std::vector<CanFrame> framesFromT;
+        std::vector<size_t> sizes;
+
+        auto tpR = create (
+                Address (0x12, 0x89), [&sizes] (auto const &isoMessage) { sizes.push_back (isoMessage.size ()); },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        auto tpT = createQueued<4> (
+                Address (0x89, 0x12), [] (auto const & /* isoMessage */) {},
+                [&framesFromT] (auto const &canFrame) {
+                        framesFromT.push_back (canFrame);
+                        return true;
+                });
+
+        for (size_t i = 0; i < 5; ++i) {
+                REQUIRE (tpT.send (std::vector<uint8_t> (10 + i)));
+        }
+
+        while (tpT.isSending ()) {
+                tpT.run ();
+                for (CanFrame &f : framesFromT) {
+                        tpR.onCanNewFrame (f);
+                }
+                framesFromT.clear ();
+
+                tpR.run ();
+                for (CanFrame &f : framesFromR) {
+                        tpT.onCanNewFrame (f);
+                }
+                framesFromR.clear ();
+        }
+
+        REQUIRE (sizes == std::vector<size_t>{10, 11, 12, 13, 14});
+}
@@ -0,0 +1,121 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "LinuxTransportProtocol.h"
+#include <catch2/catch.hpp>
+#include <vector>
+
+using namespace tp;
+
+/// Every key lands in the same bucket, so everything depends on probing.
+struct ConstantHash {
+        uint32_t operator() (uint32_t /* k */) const { return 5; }
+};
+
+struct IdentityHash {
+        uint32_t operator() (uint32_t k) const { return k; }
+};
+
+TEST_CASE ("HashSessionIndex basic", "[sessionIndex]")
+{
+        HashSessionIndex<uint32_t, int, 4, IdentityHash> index;
+        REQUIRE (index.empty ());
+        REQUIRE (index.find (1) == nullptr);
+
+        *index.insert (1) = 10;
+        *index.insert (2) = 20;
+        *index.insert (3) = 30;
+        *index.insert (4) = 40;
+        REQUIRE (index.full ());
+        REQUIRE (index.insert (5) == nullptr);
+
+        REQUIRE (*index.find (1) == 10);
+        REQUIRE (*index.find (4) == 40);
+
+        index.erase (2);
+        REQUIRE (index.size () == 3);
+        REQUIRE (index.find (2) == nullptr);
+        REQUIRE (*index.find (3) == 30);
+
+        // Erasing absent key is fine.
+        index.erase (2);
+        REQUIRE (index.size () == 3);
+}
+
+TEST_CASE ("HashSessionIndex collisions", "[sessionIndex]")
+{
+        HashSessionIndex<uint32_t, int, 8, ConstantHash> index;
+
+        for (uint32_t i = 0; i < 8; ++i) {
+                *index.insert (i) = int (i * 10);
+        }
+
+        // Remove from the middle of the cluster, the rest has to be shifted back and still reachable.
+        index.erase (3);
+        index.erase (0);
+        REQUIRE (index.find (3) == nullptr);
+        REQUIRE (index.find (0) == nullptr);
+
+        for (uint32_t i : {1, 2, 4, 5, 6, 7}) {
+                REQUIRE (index.find (i) != nullptr);
+                REQUIRE (*index.find (i) == int (i * 10));
+        }
+
+        *index.insert (100) = 1000;
+        REQUIRE (*index.find (100) == 1000);
+        REQUIRE (index.size () == 7);
+}
+
+TEST_CASE ("DirectSessionIndex", "[sessionIndex]")
+{
+        using Encoder = NormalFixed29AddressEncoder;
+        DirectSessionIndex<Encoder::Key, int, 2, Encoder> index;
+
+        Encoder::Key a = Encoder::peerKey (Address (0, 0, 0x22, 0x11));
+        Encoder::Key b = Encoder::peerKey (Address (0, 0, 0x22, 0x12));
+
+        *index.insert (a) = 1;
+        *index.insert (b) = 2;
+        REQUIRE (index.full ());
+        REQUIRE (*index.find (a) == 1);
+        REQUIRE (*index.find (b) == 2);
+
+        index.erase (a);
+        REQUIRE (index.find (a) == nullptr);
+        REQUIRE (*index.find (b) == 2);
+}
+
+/**
+ * Two peers send segmented messages to one receiver at the same time. Frames are
+ * interleaved.
+ */
+TEST_CASE ("Interleaved rx NormalFixed29 direct index", "[sessionIndex]")
+{
+        std::vector<std::vector<uint8_t>> received;
+        auto callback = [&received] (auto const &isoMessage) { received.push_back (isoMessage); };
+        auto output = [] (auto const & /* canFrame */) { return true; };
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, NormalFixed29AddressEncoder,
+                                                             decltype (output), ChronoTimeProvider, InfiniteLoop, decltype (callback), 4, 1, 0,
+                                                             SessionIndexType::DIRECT>>;
+
+        TP tp{Address (0, 0, 0x22, 0x00), callback, output};
+
+        // Sender 0x11 and sender 0x12, both to 0x22.
+        tp.onCanNewFrame (CanFrame (0x18da2211, true, 0x10, 8, 1, 1, 1, 1, 1, 1));
+        tp.onCanNewFrame (CanFrame (0x18da2212, true, 0x10, 8, 2, 2, 2, 2, 2, 2));
+        REQUIRE (tp.transportMessagesMap.size () == 2);
+
+        tp.onCanNewFrame (CanFrame (0x18da2212, true, 0x21, 2, 2));
+        tp.onCanNewFrame (CanFrame (0x18da2211, true, 0x21, 1, 1));
+
+        REQUIRE (received.size () == 2);
+        REQUIRE (received[0] == std::vector<uint8_t> (8, 2));
+        REQUIRE (received[1] == std::vector<uint8_t> (8, 1));
+        REQUIRE (tp.transportMessagesMap.empty ());
+}
@@ -0,0 +1,241 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "LinuxTransportProtocol.h"
+#include <catch2/catch.hpp>
+#include <memory>
+#include <vector>
+
+using namespace tp;
+
+TEST_CASE ("TimerQueue order", "[timerQueue]")
+{
+        TimerQueue<8> q;
+        REQUIRE (q.empty ());
+
+        q.schedule (0, 50);
+        q.schedule (1, 10);
+        q.schedule (2, 30);
+        q.schedule (3, 20);
+        q.schedule (4, 40);
+        REQUIRE (q.size () == 5);
+        REQUIRE (q.nextDeadline () == 10);
+
+        std::vector<int> expired;
+        auto collect = [&expired] (auto id) { expired.push_back (id); };
+
+        q.expire (9, collect);
+        REQUIRE (expired.empty ());
+
+        q.expire (30, collect);
+        REQUIRE (expired == std::vector<int>{1, 3, 2});
+        REQUIRE (q.size () == 2);
+        REQUIRE (!q.isScheduled (1));
+        REQUIRE (q.isScheduled (0));
+
+        expired.clear ();
+        q.expire (100, collect);
+        REQUIRE (expired == std::vector<int>{4, 0});
+        REQUIRE (q.empty ());
+}
+
+TEST_CASE ("TimerQueue reschedule and cancel", "[timerQueue]")
+{
+        TimerQueue<8> q;
+        std::vector<int> expired;
+        auto collect = [&expired] (auto id) { expired.push_back (id); };
+
+        for (int i = 0; i < 8; ++i) {
+                q.schedule (i, 100 + i);
+        }
+
+        q.schedule (7, 1);   // Earlier.
+        q.schedule (0, 200); // Later.
+        q.cancel (3);
+        q.cancel (3); // No-op.
+        REQUIRE (q.size () == 7);
+        REQUIRE (q.nextDeadline () == 1);
+
+        q.expire (1000, collect);
+        REQUIRE (expired == std::vector<int>{7, 1, 2, 4, 5, 6, 0});
+}
+
+TEST_CASE ("TimerQueue wrap around", "[timerQueue]")
+{
+        TimerQueue<4> q;
+        std::vector<int> expired;
+        auto collect = [&expired] (auto id) { expired.push_back (id); };
+
+        q.schedule (0, 0xfffffff0);
+        q.schedule (1, 0x00000010); // After the counter wraps.
+
+        q.expire (0xfffffff5, collect);
+        REQUIRE (expired == std::vector<int>{0});
+
+        q.expire (0x00000005, collect);
+        REQUIRE (expired == std::vector<int>{0});
+
+        q.expire (0x00000010, collect);
+        REQUIRE (expired == std::vector<int>{0, 1});
+}
+
+/*****************************************************************************/
+
+namespace {
+uint32_t fakeTime{};
+}
+
+/// Returns ms, as it does not declare TICKS_PER_SECOND.
+struct FakeTimeProvider {
+        uint32_t operator() () const { return fakeTime; }
+};
+
+/**
+ * Only the sessions whose N_Cr expired are reported, in the order of expiration.
+ */
+TEST_CASE ("Receive timeouts", "[timerQueue]")
+{
+        std::vector<uint8_t> timedOut;
+
+        auto callback = [&timedOut] (Address const &a, auto const & /* isoMessage */, Result r) {
+                if (r == Result::N_TIMEOUT_CR) {
+                        timedOut.push_back (a.getSourceAddress ());
+                }
+        };
+
+        auto output = [] (auto const & /* canFrame */) { return true; };
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, NormalFixed29AddressEncoder,
+                                                             decltype (output), FakeTimeProvider, InfiniteLoop, decltype (callback), 8>>;
+
+        TP tp{Address (0, 0, 0x22, 0x00), callback, output};
+        fakeTime = 1000;
+
+        for (uint32_t sa = 1; sa <= 3; ++sa) {
+                tp.onCanNewFrame (CanFrame (0x18da2200 | sa, true, 0x10, 20, 1, 2, 3, 4, 5, 6));
+        }
+
+        // Every session gets a consecutive frame, at different times.
+        fakeTime = 1100;
+        tp.onCanNewFrame (CanFrame (0x18da2203, true, 0x21, 1, 2, 3, 4, 5, 6, 7));
+        fakeTime = 1200;
+        tp.onCanNewFrame (CanFrame (0x18da2201, true, 0x21, 1, 2, 3, 4, 5, 6, 7));
+        fakeTime = 1300;
+        tp.onCanNewFrame (CanFrame (0x18da2202, true, 0x21, 1, 2, 3, 4, 5, 6, 7));
+
+        fakeTime = 1100 + N_CR_TIMEOUT - 1;
+        tp.run ();
+        REQUIRE (timedOut.empty ());
+
+        fakeTime = 1200 + N_CR_TIMEOUT;
+        tp.run ();
+        REQUIRE (timedOut == std::vector<uint8_t>{3, 1});
+        REQUIRE (tp.transportMessagesMap.size () == 1);
+
+        // The last one completes, so it never times out.
+        tp.onCanNewFrame (CanFrame (0x18da2202, true, 0x22, 1, 2, 3, 4, 5, 6, 7));
+        REQUIRE (tp.transportMessagesMap.empty ());
+        REQUIRE (tp.receiveTimers.empty ());
+
+        fakeTime += 10 * N_CR_TIMEOUT;
+        tp.run ();
+        REQUIRE (timedOut.size () == 2);
+}
+
+TEST_CASE ("Next deadline", "[timerQueue]")
+{
+        auto output = [] (auto const & /* canFrame */) { return true; };
+        auto callback = [] (auto const & /* isoMessage */) {};
+
+        using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                             decltype (output), FakeTimeProvider, InfiniteLoop, decltype (callback), 4>>;
+
+        TP tp{Address (0x10, 0x20), callback, output};
+        fakeTime = 5000;
+
+        // Nothing to do.
+        REQUIRE (!tp.nextDeadline ());
+        REQUIRE (!tp.timeToNextDeadline ());
+
+        // Receiving : N_Bs after the first frame, N_Cr after a consecutive one.
+        tp.onCanNewFrame (CanFrame (0x10, true, 0x10, 100, 1, 2, 3, 4, 5, 6));
+        REQUIRE (*tp.nextDeadline () == (5000 + N_BS_TIMEOUT) * US_PER_MS);
+
+        fakeTime = 5100;
+        tp.onCanNewFrame (CanFrame (0x10, true, 0x21, 1, 2, 3, 4, 5, 6, 7));
+        REQUIRE (*tp.nextDeadline () == (5100 + N_CR_TIMEOUT) * US_PER_MS);
+        REQUIRE (*tp.timeToNextDeadline () == N_CR_TIMEOUT * US_PER_MS);
+
+        // Sending : the state machine has work to do immediately.
+        REQUIRE (tp.send (std::vector<uint8_t> (20)));
+        REQUIRE (*tp.timeToNextDeadline () == 0);
+        tp.run ();
+        REQUIRE (*tp.timeToNextDeadline () == 0);
+        tp.run (); // First frame sent, waiting for the flow control.
+        REQUIRE (*tp.nextDeadline () == (5100 + N_BS_TIMEOUT) * US_PER_MS);
+
+        // Flow control with STmin = 20ms.
+        fakeTime = 5200;
+        tp.onCanNewFrame (CanFrame (0x10, true, 0x30, 0, 20));
+        REQUIRE (*tp.timeToNextDeadline () == 0);
+        tp.run (); // First consecutive frame.
+        REQUIRE (*tp.timeToNextDeadline () == 20000);
+
+        fakeTime = 5215;
+        REQUIRE (*tp.timeToNextDeadline () == 5000);
+
+        // Past deadlines are reported as 0.
+        fakeTime = 5300;
+        REQUIRE (*tp.timeToNextDeadline () == 0);
+        tp.run (); // Last consecutive frame.
+        REQUIRE (!tp.isSending ());
+        REQUIRE (*tp.nextDeadline () == (5100 + N_CR_TIMEOUT) * US_PER_MS);
+}
+
+/// Simulated clock, every protocol instance can have its own.
+struct SimulatedClock {
+        static constexpr uint32_t TICKS_PER_SECOND = 1000000;
+        uint32_t operator() () const { return *time; }
+        uint32_t const *time;
+};
+
+TEST_CASE ("Per instance time provider", "[timerQueue]")
+{
+        int timeoutsA = 0;
+        int timeoutsB = 0;
+        uint32_t timeA = 0;
+        uint32_t timeB = 0;
+
+        auto output = [] (auto const & /* canFrame */) { return true; };
+
+        auto create = [&output] (uint32_t const &time, int &timeouts) {
+                auto callback = [&timeouts] (Address const & /* a */, auto const & /* isoMessage */, Result r) {
+                        timeouts += (r == Result::N_TIMEOUT_BS);
+                };
+
+                using TP = TransportProtocol<TransportProtocolTraits<CanFrame, IsoMessage, MAX_ALLOWED_ISO_MESSAGE_SIZE, Normal29AddressEncoder,
+                                                                     decltype (output), SimulatedClock, InfiniteLoop, decltype (callback), 4>>;
+
+                return std::make_unique<TP> (Address (0x10, 0x20), callback, output, SimulatedClock{&time});
+        };
+
+        auto tpA = create (timeA, timeoutsA);
+        auto tpB = create (timeB, timeoutsB);
+
+        tpA->onCanNewFrame (CanFrame (0x10, true, 0x10, 100, 1, 2, 3, 4, 5, 6));
+        tpB->onCanNewFrame (CanFrame (0x10, true, 0x10, 100, 1, 2, 3, 4, 5, 6));
+
+        // Only A's clock moves.
+        timeA += N_BS_TIMEOUT * US_PER_MS;
+        tpA->run ();
+        tpB->run ();
+
+        REQUIRE (timeoutsA == 1);
+        REQUIRE (timeoutsB == 0);
+        REQUIRE (*tpB->timeToNextDeadline () == N_BS_TIMEOUT * US_PER_MS);
+}
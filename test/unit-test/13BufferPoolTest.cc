@@ -0,0 +1,204 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "LinuxTransportProtocol.h"
+#include <catch2/catch.hpp>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+using namespace tp;
+
+TEST_CASE ("BufferPool size classes", "[bufferPool]")
+{
+        using Pool = BufferPool<BufferClass<64, 2>, BufferClass<512, 1>>;
+        static_assert (Pool::totalBytes () == 2 * 64 + 512);
+
+        auto pool = std::make_unique<Pool> ();
+        REQUIRE (pool->freeBlocks () == 3);
+
+        size_t cap{};
+        uint8_t *a = pool->allocate (20, cap);
+        REQUIRE (a != nullptr);
+        REQUIRE (cap == 64);
+
+        uint8_t *b = pool->allocate (100, cap);
+        REQUIRE (b != nullptr);
+        REQUIRE (cap == 512);
+
+        // The bigger class is exhausted.
+        REQUIRE (pool->allocate (100, cap) == nullptr);
+        REQUIRE (pool->allocate (1000, cap) == nullptr);
+
+        uint8_t *c = pool->allocate (64, cap);
+        REQUIRE (c != nullptr);
+        REQUIRE (cap == 64);
+        REQUIRE (pool->freeBlocks () == 0);
+        REQUIRE (pool->allocate (1, cap) == nullptr);
+
+        pool->deallocate (b);
+        REQUIRE (pool->freeBlocks () == 1);
+
+        // Small request gets a big block if the small ones are gone.
+        REQUIRE (pool->allocate (1, cap) == b);
+        REQUIRE (cap == 512);
+
+        pool->deallocate (a);
+        pool->deallocate (b);
+        pool->deallocate (c);
+        REQUIRE (pool->freeBlocks () == 3);
+}
+
+TEST_CASE ("PooledIsoMessage", "[bufferPool]")
+{
+        using Pool = BufferPool<BufferClass<8, 2>, BufferClass<32, 2>>;
+        using Message = PooledIsoMessage<Pool>;
+        Pool pool;
+
+        {
+                Message m (pool);
+                REQUIRE (m.empty ());
+                REQUIRE (pool.freeBlocks () == 4);
+
+                for (uint8_t i = 0; i < 20; ++i) {
+                        m.push_back (i);
+                }
+
+                // Moved to the bigger block while growing, and the small one was given back.
+                REQUIRE (m.size () == 20);
+                REQUIRE (m.capacity () == 32);
+                REQUIRE (m.at (19) == 19);
+                REQUIRE (pool.freeBlocks () == 3);
+
+                Message copy (m);
+                REQUIRE (copy.getPool () == &pool);
+                REQUIRE (copy == m);
+                REQUIRE (pool.freeBlocks () == 2);
+
+                Message moved (std::move (copy));
+                REQUIRE (moved == m);
+                REQUIRE (copy.empty ());
+                REQUIRE (pool.freeBlocks () == 2);
+
+                // Both 32 byte blocks are taken, so this one can't grow.
+                Message small (pool);
+                small.resize (8);
+                REQUIRE (small.capacity () == 8);
+                small.push_back (1);
+                REQUIRE (small.size () == 8);
+
+                uint8_t front = 0xaa;
+                moved.insert (moved.begin (), &front, &front + 1);
+                REQUIRE (moved.size () == 21);
+                REQUIRE (moved[0] == 0xaa);
+                REQUIRE (moved[1] == 0);
+
+                moved.clear ();
+                REQUIRE (pool.freeBlocks () == 2);
+
+                // No pool, no memory.
+                Message orphan;
+                orphan.push_back (1);
+                REQUIRE (orphan.empty ());
+        }
+
+        REQUIRE (pool.freeBlocks () == 4);
+}
+
+/*****************************************************************************/
+
+/**
+ * Receive and transmit sides borrow from the pool only for as long as they need, and
+ * everything gets back to it in the end.
+ */
+TEST_CASE ("Pooled transmission", "[bufferPool]")
+{
+        // Every protocol object has its own pool.
+        using Pool = BufferPool<BufferClass<16, 4>, BufferClass<256, 2>, BufferClass<4095, 2>>;
+        using Message = PooledIsoMessage<Pool>;
+
+        std::vector<CanFrame> framesFromR;
+        std::vector<CanFrame> framesFromT;
+        std::vector<size_t> receivedSizes;
+
+        auto tpR = create<CanFrame, Normal29AddressEncoder, Message> (
+                Address (0x89, 0x12), [&receivedSizes] (auto const &isoMessage) { receivedSizes.push_back (isoMessage.size ()); },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        auto tpT = create<CanFrame, Normal29AddressEncoder, Message> (
+                Address (0x12, 0x89), [] (auto const & /*unused*/) {},
+                [&framesFromT] (auto const &canFrame) {
+                        framesFromT.push_back (canFrame);
+                        return true;
+                });
+
+        for (size_t len : {5, 100, 4095}) {
+                std::vector<uint8_t> payload (len);
+                std::iota (payload.begin (), payload.end (), 0);
+                REQUIRE (tpT.send (Message (tpT.getBufferPool (), payload.begin (), payload.end ())));
+
+                if (len > 7) {
+                        REQUIRE (tpT.getBufferPool ().freeBlocks () == 7);
+                        REQUIRE (tpR.getBufferPool ().freeBlocks () == 8);
+                }
+
+                while (tpT.isSending ()) {
+                        tpT.run ();
+                        for (CanFrame &f : framesFromT) {
+                                tpR.onCanNewFrame (f);
+                        }
+                        framesFromT.clear ();
+
+                        tpR.run ();
+                        for (CanFrame &f : framesFromR) {
+                                tpT.onCanNewFrame (f);
+                        }
+                        framesFromR.clear ();
+                }
+
+                tpT.run (); // Gives the message back.
+                REQUIRE (tpT.getBufferPool ().freeBlocks () == 8);
+                REQUIRE (tpR.getBufferPool ().freeBlocks () == 8);
+        }
+
+        REQUIRE (receivedSizes == std::vector<size_t>{5, 100, 4095});
+}
+
+/**
+ * A First Frame which doesn't fit into the pool is answered with the overflow flow control.
+ */
+TEST_CASE ("Pool exhausted", "[bufferPool]")
+{
+        using Pool = BufferPool<BufferClass<64, 1>, BufferClass<256, 1>>;
+        using Message = PooledIsoMessage<Pool>;
+
+        std::vector<CanFrame> framesFromR;
+        int received{};
+
+        auto tpR = create<CanFrame, Normal29AddressEncoder, Message> (
+                Address (0x89, 0x12), [&received] (auto const & /* isoMessage */) { ++received; },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        // 300 bytes : no block is big enough.
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x11, 0x2c, 0, 1, 2, 3, 4, 5));
+        REQUIRE (framesFromR.size () == 1);
+        REQUIRE (framesFromR.back ().data[0] == 0x32); // Overflow.
+        REQUIRE (tpR.transportMessagesMap.empty ());
+        REQUIRE (tpR.getBufferPool ().freeBlocks () == 2);
+
+        // 200 bytes fit.
+        tpR.onCanNewFrame (CanFrame (0x89, true, 0x10, 200, 0, 1, 2, 3, 4, 5));
+        REQUIRE (framesFromR.back ().data[0] == 0x30); // Continue to send.
+        REQUIRE (tpR.getBufferPool ().freeBlocks () == 1);
+}
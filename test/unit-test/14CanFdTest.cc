@@ -0,0 +1,165 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "LinuxTransportProtocol.h"
+#include <catch2/catch.hpp>
+#include <numeric>
+#include <vector>
+
+using namespace tp;
+
+TEST_CASE ("CAN FD data lengths", "[canFd]")
+{
+        static_assert (FrameMaxDataLength<CanFrameWrapper<CanFrame>>::value == 8);
+        static_assert (FrameMaxDataLength<CanFrameWrapper<CanFdFrame>>::value == 64);
+
+        REQUIRE (canFdLength (0) == 0);
+        REQUIRE (canFdLength (8) == 8);
+        REQUIRE (canFdLength (9) == 12);
+        REQUIRE (canFdLength (12) == 12);
+        REQUIRE (canFdLength (13) == 16);
+        REQUIRE (canFdLength (21) == 24);
+        REQUIRE (canFdLength (25) == 32);
+        REQUIRE (canFdLength (33) == 48);
+        REQUIRE (canFdLength (49) == 64);
+        REQUIRE (canFdLength (64) == 64);
+}
+
+/*****************************************************************************/
+
+TEST_CASE ("CAN FD single frames", "[canFd]")
+{
+        std::vector<CanFdFrame> frames;
+        auto tp = create<CanFdFrame> (Address (0x12, 0x89), [] (auto const & /*unused*/) {},
+                                      [&frames] (auto const &canFrame) {
+                                              frames.push_back (canFrame);
+                                              return true;
+                                      });
+
+        static_assert (decltype (tp)::SINGLE_FRAME_MAX_SIZE == 62);
+
+        // Up to 7 bytes the classic format is used.
+        REQUIRE (tp.send ({1, 2, 3, 4, 5}));
+        REQUIRE (frames.size () == 1);
+        REQUIRE (frames.back ().dlc == 6);
+        REQUIRE (frames.back ().data[0] == 0x05);
+        REQUIRE (frames.back ().data[5] == 5);
+
+        // Escape sequence, and the frame padded from 22 to 24 bytes.
+        std::vector<uint8_t> payload (20);
+        std::iota (payload.begin (), payload.end (), 0);
+        REQUIRE (tp.send (payload));
+        REQUIRE (frames.size () == 2);
+        REQUIRE (frames.back ().dlc == 24);
+        REQUIRE (frames.back ().data[0] == 0x00);
+        REQUIRE (frames.back ().data[1] == 20);
+        REQUIRE (frames.back ().data[2] == 0);
+        REQUIRE (frames.back ().data[21] == 19);
+        REQUIRE (frames.back ().data[22] == 0xcc);
+        REQUIRE (frames.back ().data[23] == 0xcc);
+        REQUIRE (!tp.isSending ());
+
+        // The receiving side.
+        std::vector<std::vector<uint8_t>> received;
+        auto tpR = create<CanFdFrame> (Address (0x89, 0x12),
+                                       [&received] (auto const &isoMessage) { received.push_back (isoMessage); });
+
+        for (auto const &f : frames) {
+                tpR.onCanNewFrame (f);
+        }
+
+        REQUIRE (received.size () == 2);
+        REQUIRE (received[0] == std::vector<uint8_t>{1, 2, 3, 4, 5});
+        REQUIRE (received[1] == payload);
+
+        // SF_DL longer than the frame.
+        tpR.onCanNewFrame (CanFdFrame (0x89, true, 0x00, 11, 0, 1, 2, 3, 4, 5, 6, 7));
+        REQUIRE (received.size () == 2);
+}
+
+/*****************************************************************************/
+
+TEST_CASE ("CAN FD segmented", "[canFd]")
+{
+        std::vector<CanFdFrame> framesFromR;
+        std::vector<CanFdFrame> framesFromT;
+        std::vector<uint8_t> received;
+
+        auto tpR = create<CanFdFrame> (
+                Address (0x89, 0x12), [&received] (auto const &isoMessage) { received = isoMessage; },
+                [&framesFromR] (auto const &canFrame) {
+                        framesFromR.push_back (canFrame);
+                        return true;
+                });
+
+        auto tpT = create<CanFdFrame> (Address (0x12, 0x89), [] (auto const & /*unused*/) {},
+                                       [&framesFromT] (auto const &canFrame) {
+                                               framesFromT.push_back (canFrame);
+                                               return true;
+                                       });
+
+        std::vector<uint8_t> payload (200);
+        std::iota (payload.begin (), payload.end (), 0);
+        REQUIRE (tpT.send (payload));
+        std::vector<CanFdFrame> sent;
+
+        while (tpT.isSending ()) {
+                tpT.run ();
+                for (CanFdFrame &f : framesFromT) {
+                        tpR.onCanNewFrame (f);
+                        sent.push_back (f);
+                }
+                framesFromT.clear ();
+
+                tpR.run ();
+                for (CanFdFrame &f : framesFromR) {
+                        tpT.onCanNewFrame (f);
+                }
+                framesFromR.clear ();
+        }
+
+        REQUIRE (received == payload);
+
+        // 62 + 63 + 63 + 12 bytes.
+        REQUIRE (sent.size () == 4);
+        REQUIRE (sent[0].dlc == 64);
+        REQUIRE (sent[0].data[0] == 0x10);
+        REQUIRE (sent[0].data[1] == 200);
+        REQUIRE (sent[0].data[63] == 61);
+        REQUIRE (sent[1].dlc == 64);
+        REQUIRE (sent[1].data[0] == 0x21);
+        REQUIRE (sent[1].data[1] == 62);
+        REQUIRE (sent[3].dlc == 16);
+        REQUIRE (sent[3].data[0] == 0x23);
+        REQUIRE (sent[3].data[12] == 199);
+        REQUIRE (sent[3].data[13] == 0xcc);
+}
+
+/*****************************************************************************/
+
+/**
+ * The peer sends 8 byte frames (RX_DL == 8), which a CAN FD receiver has to accept as well.
+ */
+TEST_CASE ("CAN FD receive classic length", "[canFd]")
+{
+        std::vector<uint8_t> received;
+        auto tpR = create<CanFdFrame> (Address (0x89, 0x12), [&received] (auto const &isoMessage) { received = isoMessage; });
+
+        tpR.onCanNewFrame (CanFdFrame (0x89, true, 0x10, 20, 0, 1, 2, 3, 4, 5));
+        tpR.onCanNewFrame (CanFdFrame (0x89, true, 0x21, 6, 7, 8, 9, 10, 11, 12));
+        tpR.onCanNewFrame (CanFdFrame (0x89, true, 0x22, 13, 14, 15, 16, 17, 18, 19));
+
+        std::vector<uint8_t> expected (20);
+        std::iota (expected.begin (), expected.end (), 0);
+        REQUIRE (received == expected);
+
+        // First Frame of invalid length is ignored.
+        received.clear ();
+        tpR.onCanNewFrame (CanFdFrame (0x89, true, 0x10, 20, 0, 1, 2, 3, 4, 5, 6, 7));
+        REQUIRE (tpR.transportMessagesMap.empty ());
+}
@@ -0,0 +1,230 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "LinuxTransportProtocol.h"
+#include "linux/SocketCanBus.h"
+#include <catch2/catch.hpp>
+#include <numeric>
+#include <vector>
+
+using namespace tp;
+
+namespace {
+
+/// Pretends to be a CAN bus : frames written to one end come out of the other one, one per datagram.
+struct SocketPair {
+        SocketPair () { REQUIRE (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0); }
+        int fds[2]{};
+};
+
+/// Collects what SocketCanBus::receive passes.
+struct FrameSink {
+        void onCanNewFrames (etl::span<can_frame const> frames)
+        {
+                ++calls;
+                received.insert (received.end (), frames.begin (), frames.end ());
+        }
+
+        void onCanNewFrames (etl::span<can_frame const> frames, etl::span<uint32_t const> rxTimesUs)
+        {
+                onCanNewFrames (frames);
+                times.insert (times.end (), rxTimesUs.begin (), rxTimesUs.end ());
+        }
+
+        uint32_t now () const { return 1000000; }
+
+        size_t calls{};
+        std::vector<can_frame> received;
+        std::vector<uint32_t> times;
+};
+
+} // namespace
+
+TEST_CASE ("SocketCanBus batches", "[socketCan]")
+{
+        SocketPair pair;
+        SocketCanBus<> a;
+        SocketCanBus<> b;
+        REQUIRE (a.attach (pair.fds[0]));
+        REQUIRE (b.attach (pair.fds[1]));
+
+        // More than SOCKET_CAN_BATCH_SIZE in both directions.
+        std::vector<can_frame> frames (40);
+
+        for (size_t i = 0; i < frames.size (); ++i) {
+                frames[i].can_id = 0x100 + i;
+                frames[i].can_dlc = 2;
+                frames[i].data[0] = i;
+                frames[i].data[1] = 0xaa;
+        }
+
+        BatchOutputResult r = a.sendBatch (etl::span<can_frame const> (frames.data (), frames.size ()));
+        REQUIRE (r.accepted == 40);
+        REQUIRE (r.rest == OutputResult::RETRY);
+
+        FrameSink sink;
+        REQUIRE (b.receive (sink));
+        REQUIRE (sink.calls == 2);
+        REQUIRE (sink.received.size () == 40);
+        REQUIRE (sink.received[39].can_id == 0x100 + 39);
+        REQUIRE (sink.received[39].can_dlc == 2);
+        REQUIRE (sink.received[39].data[0] == 39);
+
+        // Nothing more to read.
+        REQUIRE (b.receive (sink));
+        REQUIRE (sink.calls == 2);
+
+        REQUIRE (a.send (frames[0]) == OutputResult::SENT);
+        REQUIRE (b.receive (sink));
+        REQUIRE (sink.received.size () == 41);
+
+        // The other end is gone, so there's no point in retrying.
+        b.close ();
+        r = a.sendBatch (etl::span<can_frame const> (frames.data (), frames.size ()));
+        REQUIRE (r.accepted == 0);
+        REQUIRE (r.rest == OutputResult::FAILED);
+        REQUIRE (a.send (frames[0]) == OutputResult::FAILED);
+}
+
+/*****************************************************************************/
+
+TEST_CASE ("SocketCanBus timestamps", "[socketCan]")
+{
+        SocketPair pair;
+        int enable = 1;
+        REQUIRE (setsockopt (pair.fds[1], SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof (enable)) == 0);
+
+        SocketCanBus<> a;
+        SocketCanBus<> b;
+        REQUIRE (a.attach (pair.fds[0]));
+        REQUIRE (b.attach (pair.fds[1]));
+
+        can_frame frame{};
+        frame.can_id = 0x123;
+        REQUIRE (a.send (frame) == OutputResult::SENT);
+        usleep (20000);
+
+        // The frame was received 20ms before the sink's "now".
+        FrameSink sink;
+        REQUIRE (b.receive (sink));
+        REQUIRE (sink.received.size () == 1);
+        REQUIRE (sink.times.size () == 1);
+        REQUIRE (sink.times[0] <= 1000000 - 20000);
+        REQUIRE (sink.times[0] > 1000000 - 1000000);
+}
+
+/*****************************************************************************/
+
+TEST_CASE ("SocketCanBus filters", "[socketCan]")
+{
+        can_filter f = SocketCanBus<>::toCanFilter (NormalFixed29AddressEncoder::localFilter (Address (0, 0, 0x22, 0x11)));
+        REQUIRE (f.can_id == (0x18da2200 | CAN_EFF_FLAG));
+        REQUIRE (f.can_mask == (0x1ffeff00 | CAN_EFF_FLAG | CAN_RTR_FLAG));
+
+        f = SocketCanBus<>::toCanFilter (Normal11AddressEncoder::localFilter (Address (0x123, 0x456)));
+        REQUIRE (f.can_id == 0x123);
+        REQUIRE (f.can_mask == (0x7ff | CAN_EFF_FLAG | CAN_RTR_FLAG));
+}
+
+/**
+ * Flow control frames of messages sent to other peers than myAddress have to get through
+ * the automatic filters.
+ */
+TEST_CASE ("SocketCanBus filters of peers", "[socketCan]")
+{
+        using Encoder = Normal29AddressEncoder;
+        auto tp = create<can_frame> (Address (0x12, 0x89), [] (auto const & /*unused*/) {}, [] (auto const & /* frame */) { return true; });
+        std::vector<IdFilter> filters;
+
+        SocketCanBus<>::autoFilters (tp, filters);
+        REQUIRE (filters == std::vector<IdFilter>{Encoder::localFilter (Address (0x12, 0x89))});
+
+        Address peer1 (0x34, 0x56);
+        Address peer2 (0x78, 0x9a);
+        REQUIRE (tp.send (std::vector<uint8_t> (20)));
+        REQUIRE (tp.send (peer1, std::vector<uint8_t> (20)));
+        REQUIRE (tp.send (peer1, std::vector<uint8_t> (20))); // Queued.
+        REQUIRE (tp.send (peer2, std::vector<uint8_t> (20)));
+        REQUIRE (tp.send (peer2, std::vector<uint8_t> (5))); // Single frame, needs no flow control.
+
+        SocketCanBus<>::autoFilters (tp, filters);
+        REQUIRE (filters
+                 == std::vector<IdFilter>{Encoder::localFilter (Address (0x12, 0x89)), Encoder::localFilter (peer1),
+                                          Encoder::localFilter (peer2)});
+
+        // Flow control from peer1 passes.
+        REQUIRE (filters[1].accepts (0x34, true));
+}
+
+TEST_CASE ("SocketCanBus transmission", "[socketCan]")
+{
+        SocketPair pair;
+        SocketCanBus<> busT;
+        SocketCanBus<> busR;
+        REQUIRE (busT.attach (pair.fds[0]));
+        REQUIRE (busR.attach (pair.fds[1]));
+
+        std::vector<uint8_t> received;
+        auto tpR = create<can_frame> (Address (0x89, 0x12), [&received] (auto const &isoMessage) { received = isoMessage; },
+                                      busR.output ());
+
+        auto tpT = create<can_frame> (Address (0x12, 0x89), [] (auto const & /*unused*/) {}, busT.output ());
+        tpT.setMaxBurst (8); // Consecutive frames go through sendBatch.
+
+        std::vector<uint8_t> payload (1000);
+        std::iota (payload.begin (), payload.end (), 0);
+        REQUIRE (tpT.send (payload));
+
+        for (int i = 0; i < 1000 && received.empty (); ++i) {
+                REQUIRE (busT.runOnce (tpT, 1));
+                REQUIRE (busR.runOnce (tpR, 1));
+        }
+
+        REQUIRE (received == payload);
+        REQUIRE (!tpT.isSending ());
+
+        // Stopped before it was started.
+        busR.stop ();
+        REQUIRE (busR.run (tpR));
+}
+
+/*****************************************************************************/
+
+/**
+ * Needs a virtual CAN interface, hence hidden (run with [vcan]) :
+ * ip link add dev vcan0 type vcan && ip link set up vcan0
+ */
+TEST_CASE ("SocketCanBus on vcan0", "[.vcan]")
+{
+        SocketCanBus<> busT;
+        SocketCanBus<> busR;
+
+        if (!busT.open ("vcan0") || !busR.open ("vcan0")) {
+                WARN ("vcan0 is not available");
+                return;
+        }
+
+        std::vector<uint8_t> received;
+        auto tpR = create<can_frame> (Address (0x89, 0x12), [&received] (auto const &isoMessage) { received = isoMessage; },
+                                      busR.output ());
+
+        // Sends to an address other than its own, so the flow control frames pass only thanks to the filter of the peer.
+        auto tpT = create<can_frame> (Address (0x55, 0x66), [] (auto const & /*unused*/) {}, busT.output ());
+        tpT.setMaxBurst (8);
+
+        std::vector<uint8_t> payload (4095);
+        std::iota (payload.begin (), payload.end (), 0);
+        REQUIRE (tpT.send (Address (0x12, 0x89), payload));
+
+        for (int i = 0; i < 10000 && received.empty (); ++i) {
+                REQUIRE (busT.runOnce (tpT, 1));
+                REQUIRE (busR.runOnce (tpR, 1));
+        }
+
+        REQUIRE (received == payload);
+}